@@ -0,0 +1,424 @@
+#include "auth.h"
+#include "common.h"
+#include "tunable.h"
+#include "sysutil.h"
+#include "userdb.h"
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define AUTH_CACHE_SLOTS    4096
+#define AUTH_SHADOW_PATH    "/etc/shadow"
+
+typedef struct auth_request {
+    char user[MAX_USERNAME];
+    char pass[MAX_ARG];
+} auth_request_t;
+
+#define AUTH_REQUEST_HEADER_SIZE    offsetof(auth_request_t, pass)
+
+// 散列值的两半分别用两个密钥计算，共 128 位
+typedef struct auth_cache_entry {
+    unsigned long long key[2];
+    long expires;
+} auth_cache_entry_t;
+
+typedef struct auth_cache {
+    volatile int lock;
+    // 缓存内容对应的 /etc/shadow 的状态与虚拟用户数据库的版本
+    unsigned int userdb_generation;
+    dev_t shadow_dev;
+    ino_t shadow_ino;
+    long long shadow_mtime_ns;
+    long long shadow_ctime_ns;
+    off_t shadow_size;
+    auth_cache_entry_t slots[AUTH_CACHE_SLOTS];
+} auth_cache_t;
+
+static auth_cache_t *s_cache;
+static unsigned char s_cache_key[2][16];
+
+// 请求队列，[0] 由验证进程接收，[1] 由会话发送
+static int s_queue_fds[2] = {-1, -1};
+static pid_t *s_pids;
+static unsigned int s_count;
+
+static void auth_start_worker(unsigned int index);
+static void auth_worker(void);
+static int auth_request(const char *user, const char *pass);
+static int auth_verify(const char *user, const char *pass);
+static const char* auth_lookup_hash(const char *user, userdb_user_t *vuser);
+static int auth_cache_lookup(const unsigned long long key[2]);
+static void auth_cache_insert(const unsigned long long key[2]);
+static void auth_cache_check_source(void);
+static void auth_cache_key(const char *user, const char *pass, unsigned long long key[2]);
+static unsigned long long siphash24(const unsigned char key[16], const unsigned char *data,
+    size_t len);
+
+void auth_init(void) {
+    if (tunable_auth_cache_ttl > 0) {
+        s_cache = (auth_cache_t *)mmap(NULL, sizeof(auth_cache_t), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (s_cache == MAP_FAILED) {
+            ERR_EXIT("mmap");
+        }
+        if (getrandom(s_cache_key, sizeof(s_cache_key), 0) != sizeof(s_cache_key)) {
+            ERR_EXIT("getrandom");
+        }
+    }
+
+    if (tunable_auth_workers == 0) {
+        return;
+    }
+    // 每个请求是一条消息，附带接收结果的套接字；队列满时发送阻塞，会话在这里排队
+    if (socketpair(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, s_queue_fds) < 0) {
+        ERR_EXIT("socketpair");
+    }
+    s_count = tunable_auth_workers;
+    s_pids = (pid_t *)malloc(s_count * sizeof(pid_t));
+    if (s_pids == NULL) {
+        ERR_EXIT("malloc");
+    }
+    unsigned int i;
+    for (i = 0; i < s_count; i++) {
+        auth_start_worker(i);
+    }
+}
+
+/**
+ * 主进程回收子进程时调用，验证进程意外退出时重新启动它
+ * 它正在处理的请求以验证失败结束，队列中的请求不受影响
+ * pid 是验证进程返回 1
+ */
+int auth_reap(pid_t pid) {
+    unsigned int i;
+    for (i = 0; i < s_count; i++) {
+        if (s_pids[i] == pid) {
+            auth_start_worker(i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 会话进程只发送请求，不能读到其他会话的口令
+ */
+void auth_session_close(void) {
+    if (s_queue_fds[0] != -1) {
+        close(s_queue_fds[0]);
+        s_queue_fds[0] = -1;
+    }
+}
+
+/**
+ * 验证用户的口令，正确返回 1
+ */
+int auth_check(const char *user, const char *pass) {
+    if (s_count > 0) {
+        return auth_request(user, pass);
+    }
+    return auth_verify(user, pass);
+}
+
+/**
+ * 把请求交给验证进程，返回接收结果的套接字，失败返回 -1
+ * @nonblock 非 0 时队列已满也不等待，返回 -1 且 errno 为 EAGAIN，返回的套接字为非阻塞
+ */
+int auth_submit(const char *user, const char *pass, int nonblock) {
+    size_t len = strlen(pass);
+    if (len >= sizeof(((auth_request_t *)0)->pass) || strlen(user) >= MAX_USERNAME) {
+        errno = EINVAL;
+        return -1;
+    }
+    int sv[2];
+    if (socketpair(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        return -1;
+    }
+
+    auth_request_t req;
+    memset(req.user, 0, sizeof(req.user));
+    strcpy(req.user, user);
+    memcpy(req.pass, pass, len);
+
+    struct iovec vec;
+    vec.iov_base = &req;
+    vec.iov_len = AUTH_REQUEST_HEADER_SIZE + len;
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &vec;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = cmsgbuf;
+    hdr.msg_controllen = sizeof(cmsgbuf);
+    struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&hdr);
+    p_cmsg->cmsg_level = SOL_SOCKET;
+    p_cmsg->cmsg_type = SCM_RIGHTS;
+    p_cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(p_cmsg), &sv[1], sizeof(int));
+
+    int ret;
+    do {
+        ret = sendmsg(s_queue_fds[1], &hdr, MSG_NOSIGNAL | (nonblock ? MSG_DONTWAIT : 0));
+    } while (ret == -1 && errno == EINTR);
+    memset(&req, 0, sizeof(req));
+    close(sv[1]);
+    if (ret == -1) {
+        int saved = errno;
+        close(sv[0]);
+        errno = saved;
+        return -1;
+    }
+    if (nonblock) {
+        activate_nonblock(sv[0]);
+    }
+    return sv[0];
+}
+
+/**
+ * 取得 auth_submit 提交的请求的结果并关闭套接字，口令正确返回 1
+ * 非阻塞的套接字应在可读时调用
+ */
+int auth_result(int fd) {
+    // 验证进程在给出结果之前退出时读到 EOF，按验证失败处理
+    char result = 0;
+    int ret;
+    do {
+        ret = recv(fd, &result, sizeof(result), 0);
+    } while (ret == -1 && errno == EINTR);
+    close(fd);
+    return ret == 1 && result == 1;
+}
+
+/**
+ * 请求队列的发送端，队列已满时可等待它可写后重新提交
+ * 没有配置验证进程时返回 -1
+ */
+int auth_queue_fd(void) {
+    return s_queue_fds[1];
+}
+
+static void auth_start_worker(unsigned int index) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        ERR_EXIT("fork");
+    }
+    if (pid > 0) {
+        s_pids[index] = pid;
+        return;
+    }
+
+    // 主进程退出时随之退出
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent) {
+        exit(EXIT_SUCCESS);
+    }
+    close(s_queue_fds[1]);
+    auth_worker();
+    exit(EXIT_SUCCESS);
+}
+
+// 验证进程以 root 身份运行，需要读 /etc/shadow
+static void auth_worker(void) {
+    // 会话在得到结果之前退出时，写结果不应终止本进程
+    signal(SIGPIPE, SIG_IGN);
+
+    auth_request_t req;
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+    while (1) {
+        struct iovec vec;
+        vec.iov_base = &req;
+        vec.iov_len = sizeof(req) - 1;
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &vec;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = cmsgbuf;
+        hdr.msg_controllen = sizeof(cmsgbuf);
+
+        int ret = recvmsg(s_queue_fds[0], &hdr, MSG_CMSG_CLOEXEC);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR_EXIT("recvmsg");
+        }
+        int reply_fd = -1;
+        struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&hdr);
+        if (p_cmsg != NULL && p_cmsg->cmsg_level == SOL_SOCKET && p_cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&reply_fd, CMSG_DATA(p_cmsg), sizeof(int));
+        }
+        if (reply_fd == -1) {
+            continue;
+        }
+
+        char result = 0;
+        if (ret >= (int)AUTH_REQUEST_HEADER_SIZE && ! (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            req.user[MAX_USERNAME - 1] = '\0';
+            req.pass[ret - AUTH_REQUEST_HEADER_SIZE] = '\0';
+            result = (char)auth_verify(req.user, req.pass);
+        }
+        memset(&req, 0, sizeof(req));
+        send(reply_fd, &result, sizeof(result), MSG_NOSIGNAL);
+        close(reply_fd);
+    }
+}
+
+// 把请求交给验证进程，等待结果
+static int auth_request(const char *user, const char *pass) {
+    int fd = auth_submit(user, pass, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    return auth_result(fd);
+}
+
+static int auth_verify(const char *user, const char *pass) {
+    unsigned long long key[2];
+    if (s_cache != NULL) {
+        auth_cache_key(user, pass, key);
+        if (auth_cache_lookup(key)) {
+            return 1;
+        }
+    }
+
+    userdb_user_t vuser;
+    const char *hash = auth_lookup_hash(user, &vuser);
+    if (hash == NULL) {
+        return 0;
+    }
+    // 加密明文密码
+    char *encrypted_pass = crypt(pass, hash);
+    // 验证密码
+    if (encrypted_pass == NULL || strcmp(encrypted_pass, hash) != 0) {
+        return 0;
+    }
+
+    if (s_cache != NULL) {
+        auth_cache_insert(key);
+    }
+    return 1;
+}
+
+// 口令的散列值，取自虚拟用户数据库或 /etc/shadow，用户不存在时返回 NULL
+static const char* auth_lookup_hash(const char *user, userdb_user_t *vuser) {
+    if (userdb_enabled()) {
+        return userdb_lookup(user, vuser) == 0 ? vuser->hash : NULL;
+    }
+    struct spwd *sp = getspnam(user);
+    return sp != NULL ? sp->sp_pwdp : NULL;
+}
+
+static int auth_cache_lookup(const unsigned long long key[2]) {
+    auth_cache_entry_t *e = &s_cache->slots[key[0] % AUTH_CACHE_SLOTS];
+    int hit;
+    shm_lock(&s_cache->lock);
+    auth_cache_check_source();
+    hit = e->key[0] == key[0] && e->key[1] == key[1] && e->expires > get_time_sec();
+    shm_unlock(&s_cache->lock);
+    return hit;
+}
+
+// 同一位置只保留最近验证成功的一项
+static void auth_cache_insert(const unsigned long long key[2]) {
+    auth_cache_entry_t *e = &s_cache->slots[key[0] % AUTH_CACHE_SLOTS];
+    shm_lock(&s_cache->lock);
+    auth_cache_check_source();
+    e->key[0] = key[0];
+    e->key[1] = key[1];
+    e->expires = get_time_sec() + tunable_auth_cache_ttl;
+    shm_unlock(&s_cache->lock);
+}
+
+// 修改口令、锁定账户都会改写 /etc/shadow 或虚拟用户数据库，发现它们变化时清空缓存
+static void auth_cache_check_source(void) {
+    unsigned int generation = userdb_enabled() ? userdb_generation() : 0;
+    struct stat sbuf;
+    memset(&sbuf, 0, sizeof(sbuf));
+    stat(AUTH_SHADOW_PATH, &sbuf);
+    long long mtime_ns = (long long)sbuf.st_mtim.tv_sec * 1000000000LL + sbuf.st_mtim.tv_nsec;
+    long long ctime_ns = (long long)sbuf.st_ctim.tv_sec * 1000000000LL + sbuf.st_ctim.tv_nsec;
+    if (sbuf.st_dev == s_cache->shadow_dev && sbuf.st_ino == s_cache->shadow_ino
+        && mtime_ns == s_cache->shadow_mtime_ns && ctime_ns == s_cache->shadow_ctime_ns
+        && sbuf.st_size == s_cache->shadow_size && generation == s_cache->userdb_generation) {
+        return;
+    }
+    memset(s_cache->slots, 0, sizeof(s_cache->slots));
+    s_cache->userdb_generation = generation;
+    s_cache->shadow_dev = sbuf.st_dev;
+    s_cache->shadow_ino = sbuf.st_ino;
+    s_cache->shadow_mtime_ns = mtime_ns;
+    s_cache->shadow_ctime_ns = ctime_ns;
+    s_cache->shadow_size = sbuf.st_size;
+}
+
+// 缓存的键，密钥在启动时随机生成，缓存中的内容不能用于离线猜测口令
+// 用户名与口令以 '\0' 分隔
+static void auth_cache_key(const char *user, const char *pass, unsigned long long key[2]) {
+    unsigned char buf[MAX_USERNAME + MAX_ARG];
+    size_t ulen = strnlen(user, MAX_USERNAME - 1);
+    size_t plen = strnlen(pass, MAX_ARG);
+    memcpy(buf, user, ulen);
+    buf[ulen] = '\0';
+    memcpy(buf + ulen + 1, pass, plen);
+    key[0] = siphash24(s_cache_key[0], buf, ulen + 1 + plen);
+    key[1] = siphash24(s_cache_key[1], buf, ulen + 1 + plen);
+    memset(buf, 0, sizeof(buf));
+}
+
+#define SIP_ROTL(x, b)  (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+static uint64_t sip_load64(const unsigned char *p) {
+    uint64_t v = 0;
+    int i;
+    for (i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// SipHash-2-4
+static unsigned long long siphash24(const unsigned char key[16], const unsigned char *data,
+    size_t len) {
+    uint64_t k0 = sip_load64(key);
+    uint64_t k1 = sip_load64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    size_t i;
+    for (i = 0; i + 8 <= len; i += 8) {
+        uint64_t m = sip_load64(data + i);
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    uint64_t b = (uint64_t)len << 56;
+    size_t left = len - i;
+    while (left > 0) {
+        left--;
+        b |= (uint64_t)data[i + left] << (8 * left);
+    }
+    v3 ^= b;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,21 @@
+#ifndef _AUTH_H_
+#define _AUTH_H_
+
+#include <sys/types.h>
+
+// 口令验证
+// 配置了 auth_workers 时，主进程启动时创建若干个验证进程，会话把 crypt() 交给它们完成，
+// 同时进行的 crypt() 不超过验证进程数，其余请求在队列中等待
+// 配置了 auth_cache_ttl 时，验证成功的 (用户, 口令) 在共享内存中缓存一段时间，
+// 缓存中只保存带密钥的散列值，/etc/shadow 或虚拟用户数据库变化时清空
+// 事件驱动引擎用 auth_submit 提交请求，不等待结果，结果套接字可读时用 auth_result 取得结果
+
+void auth_init(void);
+int auth_reap(pid_t pid);
+void auth_session_close(void);
+int auth_check(const char *user, const char *pass);
+int auth_submit(const char *user, const char *pass, int nonblock);
+int auth_result(int fd);
+int auth_queue_fd(void);
+
+#endif /* _AUTH_H_ */
@@ -0,0 +1,120 @@
+#include "broker.h"
+#include "common.h"
+#include "tunable.h"
+#include "privsock.h"
+#include "privparent.h"
+#include <sys/prctl.h>
+#include <sys/resource.h>
+
+// 每个 nobody 进程一对登记套接字，[0] 由 nobody 进程接收，[1] 由会话进程发送
+static int (*s_reg_fds)[2];
+static pid_t *s_pids;
+static unsigned int s_count;
+
+static void broker_start(unsigned int index);
+
+/**
+ * 创建共享的 nobody 进程
+ * 须在 pasvpool_init 之后调用，nobody 进程要继承端口池的监听套接字
+ */
+void broker_init(void) {
+    if (tunable_broker_processes == 0) {
+        return;
+    }
+    s_count = tunable_broker_processes;
+    s_reg_fds = malloc(s_count * sizeof(*s_reg_fds));
+    s_pids = (pid_t *)malloc(s_count * sizeof(pid_t));
+    if (s_reg_fds == NULL || s_pids == NULL) {
+        ERR_EXIT("malloc");
+    }
+    unsigned int i;
+    for (i = 0; i < s_count; i++) {
+        // 每条登记消息附带一个描述符，必须保持消息边界
+        if (socketpair(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, s_reg_fds[i]) < 0) {
+            ERR_EXIT("socketpair");
+        }
+    }
+    for (i = 0; i < s_count; i++) {
+        broker_start(i);
+    }
+}
+
+/**
+ * 主进程回收子进程时调用，nobody 进程意外退出时重新启动它
+ * 登记在它上面的会话随之失去通道，下次内部命令时退出
+ * pid 是 nobody 进程返回 1
+ */
+int broker_reap(pid_t pid) {
+    unsigned int i;
+    for (i = 0; i < s_count; i++) {
+        if (s_pids[i] == pid) {
+            broker_start(i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int broker_enabled(void) {
+    return s_count > 0;
+}
+
+/**
+ * 把会话通道的 nobody 端登记给一个共享的 nobody 进程，之后本进程只保留 FTP 服务进程的一端
+ * 须在 priv_sock_init 之后调用
+ */
+void broker_register(session_t *sess) {
+    unsigned int addrs[2];
+    addrs[0] = sess->client_ip;
+    addrs[1] = sess->local_ip;
+    // 按会话进程的 pid 分配，各 nobody 进程的会话数大致相同
+    unsigned int index = (unsigned int)getpid() % s_count;
+    if (priv_sock_send(s_reg_fds[index][1], PRIV_SOCK_REGISTER, 0, addrs, sizeof(addrs),
+        sess->parent_fd) < 0) {
+        ERR_EXIT("broker_register");
+    }
+
+    // FTP 服务进程不能读到其他会话的登记
+    unsigned int i;
+    for (i = 0; i < s_count; i++) {
+        close(s_reg_fds[i][0]);
+        close(s_reg_fds[i][1]);
+    }
+    s_count = 0;
+}
+
+static void broker_start(unsigned int index) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        ERR_EXIT("fork");
+    }
+    if (pid > 0) {
+        s_pids[index] = pid;
+        return;
+    }
+
+    // 主进程退出时随之退出
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent) {
+        exit(EXIT_SUCCESS);
+    }
+
+    unsigned int i;
+    for (i = 0; i < s_count; i++) {
+        close(s_reg_fds[i][1]);
+        if (i != index) {
+            close(s_reg_fds[i][0]);
+        }
+    }
+
+    // 每个会话占用一个通道，等待数据连接时还有一个监听套接字，软限制提高到硬限制
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    handle_broker(s_reg_fds[index][0]);
+    exit(EXIT_SUCCESS);
+}
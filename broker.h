@@ -0,0 +1,16 @@
+#ifndef _BROKER_H_
+#define _BROKER_H_
+
+#include "session.h"
+
+// 共享的 nobody 进程
+// 配置了 broker_processes 时，主进程启动时创建若干个 nobody 进程为所有会话执行特权操作，
+// 会话进程不再各自 fork 出 nobody 进程，而是把通道的一端登记给其中一个后直接成为 FTP 服务进程
+// 每个 nobody 进程有一对登记用的套接字，两端都由主进程持有，nobody 进程重启后仍能收到登记
+
+void broker_init(void);
+int broker_reap(pid_t pid);
+int broker_enabled(void);
+void broker_register(session_t *sess);
+
+#endif /* _BROKER_H_ */
@@ -0,0 +1,326 @@
+#include "bwshare.h"
+#include "common.h"
+#include "tunable.h"
+#include "ratelimit.h"
+#include "sysutil.h"
+#include <sys/mman.h>
+
+#define BWSHARE_SLOTS       4096
+#define BWSHARE_MAX_PROBE   32
+#define BWSHARE_HOLDERS     65536
+#define BWSHARE_SWEEP_NS    1000000000LL
+
+typedef struct bwshare_bucket {
+    volatile int lock;
+    // key 与 active 只在持有表锁时修改
+    unsigned int key;
+    unsigned int active;
+    unsigned int rate;
+    unsigned int burst;
+    double tokens;
+    long long last_ns;
+} bwshare_bucket_t;
+
+// 正在传输的会话持有的份额，记录它登记到的各级令牌桶
+typedef struct bwshare_holder {
+    pid_t pid;                      // 0 表示空闲
+    int slots[BWSHARE_LEVELS];      // 桶在该级表中的位置，-1 表示这一级没有登记
+} bwshare_holder_t;
+
+typedef struct bwshare_shm {
+    // 表锁，在传输开始和结束、清理已退出进程的份额时使用
+    volatile int lock;
+    bwshare_bucket_t global;
+    bwshare_bucket_t ips[BWSHARE_SLOTS];
+    bwshare_bucket_t users[BWSHARE_SLOTS];
+    // 持有记录只在持有表锁时修改
+    volatile long long swept_ns;
+    unsigned int holder_next;
+    bwshare_holder_t holders[BWSHARE_HOLDERS];
+} bwshare_shm_t;
+
+static bwshare_shm_t *s_shm;
+
+static void bwshare_setup(bwshare_bucket_t *b, unsigned int key, unsigned int rate);
+static bwshare_bucket_t* bwshare_attach(bwshare_bucket_t *table, unsigned int key,
+    unsigned int rate);
+static void bwshare_refill(bwshare_bucket_t *b, long long now);
+static int bwshare_hold(bwshare_t *share);
+static void bwshare_release(bwshare_holder_t *h);
+static void bwshare_sweep(long long now);
+
+/**
+ * 创建共享的令牌桶，没有配置任何聚合限速时什么也不做
+ */
+void bwshare_init(void) {
+    if (tunable_global_max_rate == 0 && tunable_per_ip_max_rate == 0
+        && tunable_per_user_max_rate == 0) {
+        return;
+    }
+
+    s_shm = (bwshare_shm_t *)mmap(NULL, sizeof(bwshare_shm_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s_shm == MAP_FAILED) {
+        ERR_EXIT("mmap");
+    }
+    bwshare_setup(&s_shm->global, 0, tunable_global_max_rate);
+}
+
+/**
+ * 开始一次传输，把会话登记到各级令牌桶
+ * @ip 客户端 IP，网络字节序
+ * @uid 登录用户
+ */
+void bwshare_start(bwshare_t *share, unsigned int ip, uid_t uid) {
+    memset(share, 0, sizeof(bwshare_t));
+    share->holder = -1;
+    if (s_shm == NULL) {
+        return;
+    }
+
+    shm_lock(&s_shm->lock);
+    // 先清理已退出进程的份额，它们占用的桶可以重新使用
+    bwshare_sweep(ratelimit_now());
+    if (tunable_global_max_rate > 0) {
+        share->buckets[BWSHARE_GLOBAL] = &s_shm->global;
+    }
+    if (tunable_per_ip_max_rate > 0) {
+        share->buckets[BWSHARE_IP] = bwshare_attach(s_shm->ips, ip, tunable_per_ip_max_rate);
+    }
+    if (tunable_per_user_max_rate > 0) {
+        share->buckets[BWSHARE_USER] = bwshare_attach(s_shm->users, (unsigned int)uid,
+            tunable_per_user_max_rate);
+    }
+    int i;
+    for (i = 0; i < BWSHARE_LEVELS; i++) {
+        bwshare_bucket_t *b = share->buckets[i];
+        if (b == NULL) {
+            continue;
+        }
+        if (b->active++ == 0) {
+            // 与会话自己的令牌桶一样，空闲后重新开始时桶为空，避免突发
+            shm_lock(&b->lock);
+            b->tokens = 0;
+            b->last_ns = ratelimit_now();
+            shm_unlock(&b->lock);
+        }
+    }
+    share->holder = bwshare_hold(share);
+    shm_unlock(&s_shm->lock);
+
+    share->active = 1;
+}
+
+/**
+ * 申请传输 want 字节，任何一级令牌不足时先等待
+ * 每个会话一次最多取得桶容量除以活跃会话数的份额，申请到的令牌立即扣除
+ */
+size_t bwshare_grant(bwshare_t *share, size_t want) {
+    if ( ! share->active || want == 0) {
+        return want;
+    }
+
+    // 意外退出的会话不再传输，它的份额应尽快让给其他会话
+    if (ratelimit_now() - s_shm->swept_ns >= BWSHARE_SWEEP_NS) {
+        shm_lock(&s_shm->lock);
+        bwshare_sweep(ratelimit_now());
+        shm_unlock(&s_shm->lock);
+    }
+
+    while (1) {
+        long long now = ratelimit_now();
+        size_t grant = want;
+        double tokens[BWSHARE_LEVELS];
+        int i;
+        for (i = 0; i < BWSHARE_LEVELS; i++) {
+            bwshare_bucket_t *b = share->buckets[i];
+            if (b == NULL) {
+                continue;
+            }
+            shm_lock(&b->lock);
+            bwshare_refill(b, now);
+            tokens[i] = b->tokens;
+            size_t fair = b->burst / (b->active > 0 ? b->active : 1);
+            if (fair == 0) {
+                fair = 1;
+            }
+            if (grant > fair) {
+                grant = fair;
+            }
+            shm_unlock(&b->lock);
+        }
+
+        double wait = 0;
+        for (i = 0; i < BWSHARE_LEVELS; i++) {
+            bwshare_bucket_t *b = share->buckets[i];
+            if (b != NULL && tokens[i] < (double)grant) {
+                double w = ((double)grant - tokens[i]) / (double)b->rate;
+                if (w > wait) {
+                    wait = w;
+                }
+            }
+        }
+        if (wait > 0) {
+            ratelimit_sleep(wait);
+            continue;
+        }
+
+        // 两次加锁之间其他进程也可能取走令牌，余额会短暂为负，之后的申请会等待更久作为补偿
+        for (i = 0; i < BWSHARE_LEVELS; i++) {
+            bwshare_bucket_t *b = share->buckets[i];
+            if (b != NULL) {
+                shm_lock(&b->lock);
+                b->tokens -= (double)grant;
+                shm_unlock(&b->lock);
+            }
+        }
+        share->granted = grant;
+        return grant;
+    }
+}
+
+/**
+ * 报告实际传输的字节数，归还申请了但没有用掉的令牌
+ */
+void bwshare_consume(bwshare_t *share, size_t used) {
+    if ( ! share->active) {
+        return;
+    }
+    if (used < share->granted) {
+        double unused = (double)(share->granted - used);
+        int i;
+        for (i = 0; i < BWSHARE_LEVELS; i++) {
+            bwshare_bucket_t *b = share->buckets[i];
+            if (b != NULL) {
+                shm_lock(&b->lock);
+                b->tokens += unused;
+                shm_unlock(&b->lock);
+            }
+        }
+    }
+    share->granted = 0;
+}
+
+/**
+ * 结束一次传输，注销会话，其份额由其他会话平分
+ * 可以在进程退出时调用
+ */
+void bwshare_stop(bwshare_t *share) {
+    if ( ! share->active) {
+        return;
+    }
+    bwshare_consume(share, 0);
+
+    shm_lock(&s_shm->lock);
+    if (share->holder == -1) {
+        int i;
+        for (i = 0; i < BWSHARE_LEVELS; i++) {
+            if (share->buckets[i] != NULL) {
+                share->buckets[i]->active--;
+            }
+        }
+    } else if (s_shm->holders[share->holder].pid == getpid()) {
+        bwshare_release(&s_shm->holders[share->holder]);
+    }
+    shm_unlock(&s_shm->lock);
+
+    memset(share, 0, sizeof(bwshare_t));
+    share->holder = -1;
+}
+
+// 记录当前进程持有的份额，须持有表锁；记录已满时返回 -1，份额只在进程正常退出时让出
+static int bwshare_hold(bwshare_t *share) {
+    unsigned int i;
+    for (i = 0; i < BWSHARE_HOLDERS; i++) {
+        unsigned int k = (s_shm->holder_next + i) & (BWSHARE_HOLDERS - 1);
+        bwshare_holder_t *h = &s_shm->holders[k];
+        if (h->pid != 0) {
+            continue;
+        }
+        h->pid = getpid();
+        h->slots[BWSHARE_GLOBAL] = share->buckets[BWSHARE_GLOBAL] != NULL ? 0 : -1;
+        h->slots[BWSHARE_IP] = share->buckets[BWSHARE_IP] != NULL
+            ? (int)(share->buckets[BWSHARE_IP] - s_shm->ips) : -1;
+        h->slots[BWSHARE_USER] = share->buckets[BWSHARE_USER] != NULL
+            ? (int)(share->buckets[BWSHARE_USER] - s_shm->users) : -1;
+        s_shm->holder_next = k + 1;
+        return (int)k;
+    }
+    return -1;
+}
+
+// 让出记录中的份额，须持有表锁
+static void bwshare_release(bwshare_holder_t *h) {
+    if (h->slots[BWSHARE_GLOBAL] != -1) {
+        s_shm->global.active--;
+    }
+    if (h->slots[BWSHARE_IP] != -1) {
+        s_shm->ips[h->slots[BWSHARE_IP]].active--;
+    }
+    if (h->slots[BWSHARE_USER] != -1) {
+        s_shm->users[h->slots[BWSHARE_USER]].active--;
+    }
+    h->pid = 0;
+}
+
+/**
+ * 让出已退出的进程持有的份额，须持有表锁，最多每秒检查一次
+ * 被信号终止的会话进程不会调用 bwshare_stop，不清理时各级桶的份额会被永久摊薄
+ */
+static void bwshare_sweep(long long now) {
+    if (now - s_shm->swept_ns < BWSHARE_SWEEP_NS) {
+        return;
+    }
+    s_shm->swept_ns = now;
+    unsigned int i;
+    for (i = 0; i < BWSHARE_HOLDERS; i++) {
+        bwshare_holder_t *h = &s_shm->holders[i];
+        if (h->pid != 0 && kill(h->pid, 0) == -1 && errno == ESRCH) {
+            bwshare_release(h);
+        }
+    }
+}
+
+static void bwshare_setup(bwshare_bucket_t *b, unsigned int key, unsigned int rate) {
+    b->key = key;
+    b->rate = rate;
+    b->burst = tunable_rate_burst > 0 ? tunable_rate_burst : rate / 10;
+    if (b->burst == 0) {
+        b->burst = 1;
+    }
+    b->tokens = 0;
+    b->last_ns = ratelimit_now();
+}
+
+// 在表中找到 key 正在使用的桶，没有则占用一个空闲的桶，须持有表锁
+// 表满时返回 NULL，这一级不限速
+static bwshare_bucket_t* bwshare_attach(bwshare_bucket_t *table, unsigned int key,
+    unsigned int rate) {
+    unsigned int h = key * 2654435761u;
+    bwshare_bucket_t *free_slot = NULL;
+    int i;
+    for (i = 0; i < BWSHARE_MAX_PROBE; i++) {
+        bwshare_bucket_t *b = &table[(h + i) & (BWSHARE_SLOTS - 1)];
+        if (b->active > 0 && b->key == key) {
+            return b;
+        }
+        if (b->active == 0 && free_slot == NULL) {
+            free_slot = b;
+        }
+    }
+
+    if (free_slot != NULL) {
+        bwshare_setup(free_slot, key, rate);
+    }
+    return free_slot;
+}
+
+static void bwshare_refill(bwshare_bucket_t *b, long long now) {
+    if (now > b->last_ns) {
+        b->tokens += (double)(now - b->last_ns) * (double)b->rate / 1e9;
+        if (b->tokens > (double)b->burst) {
+            b->tokens = b->burst;
+        }
+        b->last_ns = now;
+    }
+}
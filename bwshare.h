@@ -0,0 +1,33 @@
+#ifndef _BW_SHARE_H_
+#define _BW_SHARE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// 多个会话进程共享的聚合限速
+// 全局、每个 IP、每个用户各有一个令牌桶，位于匿名共享内存中，须在创建工作进程之前调用 bwshare_init
+// 同一个桶的容量按正在传输的会话数平分，会话空闲后其份额自动让给其他会话
+// 份额记录持有进程的 pid，进程意外退出而没有让出份额时，由其他会话在登记或申请时清理
+
+#define BWSHARE_GLOBAL  0
+#define BWSHARE_IP      1
+#define BWSHARE_USER    2
+#define BWSHARE_LEVELS  3
+
+struct bwshare_bucket;
+
+// 会话持有的句柄，记录本次传输涉及的令牌桶
+typedef struct bwshare {
+    struct bwshare_bucket *buckets[BWSHARE_LEVELS];
+    size_t granted;
+    int active;
+    int holder;             // 共享内存中记录持有进程的位置，记录已满时为 -1
+} bwshare_t;
+
+void bwshare_init(void);
+void bwshare_start(bwshare_t *share, unsigned int ip, uid_t uid);
+size_t bwshare_grant(bwshare_t *share, size_t want);
+void bwshare_consume(bwshare_t *share, size_t used);
+void bwshare_stop(bwshare_t *share);
+
+#endif /* _BW_SHARE_H_ */
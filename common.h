@@ -12,6 +12,7 @@
 #include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <linux/capability.h>
@@ -20,11 +21,13 @@
 
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <dirent.h>
 #include <sys/time.h>
 
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -43,6 +46,7 @@
 #define MAX_COMMAND_LINE 1024
 #define MAX_COMMAND 32
 #define MAX_ARG 1024
+#define MAX_USERNAME 64
 #define MINIFTP_CONF "miniftpd.conf"
 
 #endif /* _COMMON_H_ */
\ No newline at end of file
@@ -0,0 +1,260 @@
+#include "conntab.h"
+#include "common.h"
+#include "hash.h"
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sched.h>
+
+#define CONNTAB_SLOTS       65536
+#define CONNTAB_MAX_PROBE   64
+#define CONNTAB_CONNS       65536
+
+// 槽位的高 32 位为 IP，低 32 位为该 IP 当前的连接数，整体用 CAS 更新
+// 槽位一旦被占用就不再清零，连接数降为 0 的槽位可以被其他 IP 重新占用
+#define SLOT_IP(w)              ((unsigned int)((w) >> 32))
+#define SLOT_COUNT(w)           ((unsigned int)((w) & 0xFFFFFFFFu))
+#define SLOT_MAKE(ip, count)    (((unsigned long long)(ip) << 32) | (count))
+
+// 连接记录的高 32 位为持有进程的 pid，低 32 位为客户端 IP，0 表示空闲
+// 登记连接的工作进程是最初的持有者，连接交给会话进程后改由会话进程持有
+#define CONN_PID(w)             ((pid_t)((w) >> 32))
+#define CONN_IP(w)              ((unsigned int)((w) & 0xFFFFFFFFu))
+#define CONN_MAKE(pid, ip)      (((unsigned long long)(unsigned int)(pid) << 32) | (ip))
+
+typedef struct conntab {
+    volatile unsigned int num_clients;
+    // 只在占用新槽位时加锁，计数的增减都是无锁的
+    volatile int insert_lock;
+    volatile unsigned long long slots[CONNTAB_SLOTS];
+    // 下一次分配连接记录的起点
+    volatile unsigned int conn_next;
+    volatile unsigned long long conns[CONNTAB_CONNS];
+} conntab_t;
+
+// 会话进程对应的连接
+typedef struct conntab_child {
+    unsigned int ip;
+    int id;
+} conntab_child_t;
+
+static conntab_t *s_conntab;
+
+// 本工作进程创建的会话进程 pid -> 连接
+static hash_t *s_children;
+
+static unsigned int conntab_hash(unsigned int ip);
+static volatile unsigned long long* conntab_slot(unsigned int ip, int probe);
+static unsigned int conntab_inc_existing(unsigned int ip);
+static unsigned int conntab_insert(unsigned int ip);
+static void conntab_dec(unsigned int ip);
+static int conntab_alloc(unsigned int ip);
+static unsigned int conntab_pid_hash(unsigned int buckets, void *key);
+
+void conntab_init(void) {
+    s_conntab = (conntab_t *)mmap(NULL, sizeof(conntab_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s_conntab == MAP_FAILED) {
+        ERR_EXIT("mmap");
+    }
+}
+
+/**
+ * 登记一个新连接，由当前进程持有
+ * 返回连接记录的编号，注销时使用；记录已满时返回 -1，连接仍被计数
+ * @num_clients 输出参数，返回登记后的总连接数
+ * @num_this_ip 输出参数，返回登记后该 IP 的连接数，表满时返回 0
+ */
+int conntab_add(unsigned int ip, unsigned int *num_clients, unsigned int *num_this_ip) {
+    *num_clients = __sync_add_and_fetch(&s_conntab->num_clients, 1);
+
+    unsigned int count = conntab_inc_existing(ip);
+    if (count == 0) {
+        count = conntab_insert(ip);
+    }
+    *num_this_ip = count;
+    return conntab_alloc(ip);
+}
+
+/**
+ * 注销一个连接，可以在信号处理函数中调用
+ * @id conntab_add 返回的连接记录
+ */
+void conntab_remove(unsigned int ip, int id) {
+    if (id != -1) {
+        s_conntab->conns[id] = 0;
+    }
+    conntab_dec(ip);
+}
+
+/**
+ * 主进程回收进程后调用，注销仍由该进程持有的连接
+ * 工作进程意外退出时，它托管的连接在此注销；主进程是 subreaper，
+ * 工作进程遗留的会话进程退出时也由主进程回收，它们的连接同样在此注销
+ */
+void conntab_sweep(pid_t pid) {
+    unsigned int i;
+    for (i = 0; i < CONNTAB_CONNS; i++) {
+        unsigned long long w = s_conntab->conns[i];
+        if (w != 0 && CONN_PID(w) == pid
+            && __sync_bool_compare_and_swap(&s_conntab->conns[i], w, 0)) {
+            conntab_dec(CONN_IP(w));
+        }
+    }
+}
+
+static void conntab_dec(unsigned int ip) {
+    __sync_sub_and_fetch(&s_conntab->num_clients, 1);
+
+    int i;
+    for (i = 0; i < CONNTAB_MAX_PROBE; i++) {
+        volatile unsigned long long *slot = conntab_slot(ip, i);
+        unsigned long long w = *slot;
+        if (w == 0) {
+            return;
+        }
+        while (SLOT_IP(w) == ip) {
+            if (SLOT_COUNT(w) == 0
+                || __sync_bool_compare_and_swap(slot, w, w - 1)) {
+                return;
+            }
+            w = *slot;
+        }
+    }
+}
+
+/**
+ * 阻塞 SIGCHLD 并返回用于接收它的非阻塞 signalfd
+ */
+int conntab_reaper_open(void) {
+    s_children = hash_alloc(256, conntab_pid_hash);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        ERR_EXIT("sigprocmask");
+    }
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK);
+    if (sigfd == -1) {
+        ERR_EXIT("signalfd");
+    }
+    return sigfd;
+}
+
+/**
+ * 在新创建的会话进程中调用，恢复会话所需的信号设置
+ */
+void conntab_reaper_release(int sigfd) {
+    close(sigfd);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    signal(SIGCHLD, SIG_IGN);
+}
+
+/**
+ * 连接改由会话进程持有，进程退出时由 conntab_reap 注销该连接
+ */
+void conntab_track(pid_t pid, unsigned int ip, int id) {
+    if (id != -1) {
+        s_conntab->conns[id] = CONN_MAKE(pid, ip);
+    }
+    conntab_child_t child = {ip, id};
+    hash_add_entry(s_children, &pid, sizeof(pid), &child, sizeof(child));
+}
+
+/**
+ * 回收所有已退出的会话进程并注销其连接，signalfd 可读时调用
+ */
+void conntab_reap(int sigfd) {
+    struct signalfd_siginfo info;
+    while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+        ;
+    }
+
+    // 多个 SIGCHLD 可能合并为一个，逐个回收直到没有已退出的子进程
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        conntab_child_t *child = hash_lookup_entry(s_children, &pid, sizeof(pid));
+        if (child == NULL) {
+            continue;
+        }
+        conntab_remove(child->ip, child->id);
+        hash_free_entry(s_children, &pid, sizeof(pid));
+    }
+}
+
+static unsigned int conntab_pid_hash(unsigned int buckets, void *key) {
+    unsigned int *number = (unsigned int *)key;
+    return (*number) % buckets;
+}
+
+static unsigned int conntab_hash(unsigned int ip) {
+    return (ip * 2654435761u) & (CONNTAB_SLOTS - 1);
+}
+
+static volatile unsigned long long* conntab_slot(unsigned int ip, int probe) {
+    return &s_conntab->slots[(conntab_hash(ip) + probe) & (CONNTAB_SLOTS - 1)];
+}
+
+// 在探测链上查找 ip 并将其连接数加一，找不到返回 0
+static unsigned int conntab_inc_existing(unsigned int ip) {
+    int i;
+    for (i = 0; i < CONNTAB_MAX_PROBE; i++) {
+        volatile unsigned long long *slot = conntab_slot(ip, i);
+        unsigned long long w = *slot;
+        if (w == 0) {
+            // 链尾
+            return 0;
+        }
+        while (SLOT_IP(w) == ip) {
+            if (__sync_bool_compare_and_swap(slot, w, w + 1)) {
+                return SLOT_COUNT(w) + 1;
+            }
+            w = *slot;
+        }
+    }
+    return 0;
+}
+
+// 从上次分配的位置之后查找空闲的连接记录
+static int conntab_alloc(unsigned int ip) {
+    unsigned long long w = CONN_MAKE(getpid(), ip);
+    unsigned int start = __sync_fetch_and_add(&s_conntab->conn_next, 1);
+    unsigned int i;
+    for (i = 0; i < CONNTAB_CONNS; i++) {
+        unsigned int k = (start + i) & (CONNTAB_CONNS - 1);
+        if (s_conntab->conns[k] == 0
+            && __sync_bool_compare_and_swap(&s_conntab->conns[k], 0, w)) {
+            return (int)k;
+        }
+    }
+    return -1;
+}
+
+// 为 ip 占用一个空闲槽位，加锁保证同一个 IP 不会占用两个槽位
+static unsigned int conntab_insert(unsigned int ip) {
+    while (__sync_lock_test_and_set(&s_conntab->insert_lock, 1)) {
+        sched_yield();
+    }
+
+    // 加锁期间可能已有其他进程插入了该 IP
+    unsigned int count = conntab_inc_existing(ip);
+    int i;
+    for (i = 0; count == 0 && i < CONNTAB_MAX_PROBE; i++) {
+        volatile unsigned long long *slot = conntab_slot(ip, i);
+        unsigned long long w = *slot;
+        while (w == 0 || SLOT_COUNT(w) == 0) {
+            if (__sync_bool_compare_and_swap(slot, w, SLOT_MAKE(ip, 1))) {
+                count = 1;
+                break;
+            }
+            w = *slot;
+        }
+    }
+
+    __sync_lock_release(&s_conntab->insert_lock);
+    return count;
+}
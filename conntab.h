@@ -0,0 +1,21 @@
+#ifndef _CONN_TAB_H_
+#define _CONN_TAB_H_
+
+#include <sys/types.h>
+
+// 多个进程共享的连接计数表
+// 位于匿名共享内存中，须在创建工作进程之前调用 conntab_init
+// 每个连接另有一条记录其持有进程的记录，持有进程意外退出时由主进程注销
+void conntab_init(void);
+int conntab_add(unsigned int ip, unsigned int *num_clients, unsigned int *num_this_ip);
+void conntab_remove(unsigned int ip, int id);
+void conntab_sweep(pid_t pid);
+
+// 会话进程的回收，只在工作进程中使用
+// 用 signalfd 同步得知 SIGCHLD，在主循环而不是信号处理函数中注销连接
+int conntab_reaper_open(void);
+void conntab_reaper_release(int sigfd);
+void conntab_track(pid_t pid, unsigned int ip, int id);
+void conntab_reap(int sigfd);
+
+#endif /* _CONN_TAB_H_ */
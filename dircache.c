@@ -0,0 +1,447 @@
+#include "dircache.h"
+#include "common.h"
+#include "tunable.h"
+#include "sysutil.h"
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+
+#define DIRCACHE_BLOCK_SIZE     4096
+#define DIRCACHE_MAX_ENTRIES    1024
+#define DIRCACHE_BUCKETS        1024
+#define DIRCACHE_WD_SLOTS       4096
+
+// 目录的内容、目录项本身的属性变化都会使缓存失效
+#define DIRCACHE_WATCH_MASK \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB \
+    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct dircache_entry {
+    int used;
+    dev_t dev;
+    ino_t ino;
+    long long mtime_ns;
+    int detail;
+    int wd;
+    unsigned long long last_used;
+    size_t len;
+    int first_block;
+    int next;           // 哈希链，空闲时为空闲链
+} dircache_entry_t;
+
+typedef struct dircache_shm {
+    volatile int lock;
+    unsigned long long tick;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long entries;
+    unsigned long long bytes;
+    // 移除 inotify 监视时递增，正在填充的缓存项可能因此失去监视
+    unsigned int unwatch_seq;
+    // 监视的目录发生变化时递增，按 wd 分槽
+    unsigned int wd_seq[DIRCACHE_WD_SLOTS];
+    int buckets[DIRCACHE_BUCKETS];
+    int free_entry;
+    int free_block;
+    int free_blocks;
+    dircache_entry_t table[DIRCACHE_MAX_ENTRIES];
+    // 之后是每个数据块的后继下标，再之后是数据块本身
+} dircache_shm_t;
+
+static dircache_shm_t *s_shm;
+static int *s_block_next;
+static char *s_blocks;
+static int s_nblocks;
+static int s_inotify_fd = -1;
+static pid_t s_watcher = -1;
+
+static void dircache_start_watcher(void);
+static void dircache_watch_loop(void);
+static unsigned int dircache_hash(dev_t dev, ino_t ino, int detail);
+static int dircache_find(dev_t dev, ino_t ino, int detail);
+static void dircache_remove(int idx, int unwatch);
+static int dircache_evict(int keep_wd);
+static void dircache_flush(void);
+static long long dircache_mtime_ns(const struct stat *st);
+
+/**
+ * 创建共享的缓存区与 inotify 实例，并启动监视进程
+ * dir_cache_size 为 0 或 inotify 不可用时什么也不做，列表不经过缓存
+ */
+void dircache_init(void) {
+    if (tunable_dir_cache_size <= sizeof(dircache_shm_t)) {
+        return;
+    }
+    size_t size = tunable_dir_cache_size;
+    int nblocks = (size - sizeof(dircache_shm_t)) / (DIRCACHE_BLOCK_SIZE + sizeof(int));
+    if (nblocks <= 0) {
+        return;
+    }
+
+    // 所有进程共用同一个 inotify 实例，会话进程添加监视，监视进程读取事件
+    s_inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (s_inotify_fd < 0) {
+        return;
+    }
+
+    s_shm = (dircache_shm_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s_shm == MAP_FAILED) {
+        ERR_EXIT("mmap");
+    }
+    s_nblocks = nblocks;
+    s_block_next = (int *)(s_shm + 1);
+    s_blocks = (char *)(s_block_next + nblocks);
+
+    int i;
+    for (i = 0; i < DIRCACHE_BUCKETS; i++) {
+        s_shm->buckets[i] = -1;
+    }
+    for (i = 0; i < DIRCACHE_MAX_ENTRIES; i++) {
+        s_shm->table[i].next = i + 1 < DIRCACHE_MAX_ENTRIES ? i + 1 : -1;
+    }
+    s_shm->free_entry = 0;
+    for (i = 0; i < nblocks; i++) {
+        s_block_next[i] = i + 1 < nblocks ? i + 1 : -1;
+    }
+    s_shm->free_block = 0;
+    s_shm->free_blocks = nblocks;
+
+    dircache_start_watcher();
+}
+
+/**
+ * 主进程回收子进程时调用，监视进程意外退出时清空缓存并重新启动它
+ * pid 是监视进程返回 1
+ */
+int dircache_reap(pid_t pid) {
+    if (s_shm == NULL || pid != s_watcher) {
+        return 0;
+    }
+    shm_lock(&s_shm->lock);
+    dircache_flush();
+    shm_unlock(&s_shm->lock);
+    dircache_start_watcher();
+    return 1;
+}
+
+int dircache_enabled(void) {
+    return s_shm != NULL;
+}
+
+// 单个目录列表最多能缓存的字节数
+size_t dircache_capacity(void) {
+    return (size_t)s_nblocks * DIRCACHE_BLOCK_SIZE;
+}
+
+/**
+ * 查找目录 st 的列表，命中时返回一份用 malloc 分配的副本，由调用者释放
+ * 不能在持有锁时写套接字，因此先复制出来再发送
+ * @detail 为真时是 LIST 的输出，否则是 NLST 的输出
+ */
+char* dircache_get(const struct stat *st, int detail, size_t *len) {
+    char *data = NULL;
+    shm_lock(&s_shm->lock);
+    int idx = dircache_find(st->st_dev, st->st_ino, detail);
+    if (idx >= 0 && s_shm->table[idx].mtime_ns != dircache_mtime_ns(st)) {
+        // 目录已被修改，即使还没有收到 inotify 事件也不再使用
+        dircache_remove(idx, 0);
+        idx = -1;
+    }
+    if (idx >= 0) {
+        dircache_entry_t *e = &s_shm->table[idx];
+        data = (char *)malloc(e->len > 0 ? e->len : 1);
+        size_t off = 0;
+        int b;
+        for (b = e->first_block; b >= 0; b = s_block_next[b]) {
+            size_t n = e->len - off > DIRCACHE_BLOCK_SIZE ? DIRCACHE_BLOCK_SIZE : e->len - off;
+            memcpy(data + off, s_blocks + (size_t)b * DIRCACHE_BLOCK_SIZE, n);
+            off += n;
+        }
+        *len = e->len;
+        e->last_used = ++s_shm->tick;
+        s_shm->hits++;
+    } else {
+        s_shm->misses++;
+    }
+    shm_unlock(&s_shm->lock);
+    return data;
+}
+
+/**
+ * 开始为当前目录生成列表，须在读目录之前调用
+ * 先记录序号再添加监视，之后目录的任何变化都会改变序号，使 dircache_fill_commit 放弃写入
+ * 无法添加监视时返回 0，此时不应缓存
+ */
+int dircache_fill_begin(dircache_fill_t *fill, const struct stat *st, int detail) {
+    fill->dev = st->st_dev;
+    fill->ino = st->st_ino;
+    fill->mtime_ns = dircache_mtime_ns(st);
+    fill->detail = detail;
+
+    shm_lock(&s_shm->lock);
+    fill->unwatch_seq = s_shm->unwatch_seq;
+    shm_unlock(&s_shm->lock);
+
+    fill->wd = inotify_add_watch(s_inotify_fd, ".", DIRCACHE_WATCH_MASK);
+    if (fill->wd < 0) {
+        return 0;
+    }
+
+    shm_lock(&s_shm->lock);
+    fill->wd_seq = s_shm->wd_seq[fill->wd & (DIRCACHE_WD_SLOTS - 1)];
+    shm_unlock(&s_shm->lock);
+    return 1;
+}
+
+/**
+ * 把生成好的列表写入缓存，空间不足时按 LRU 淘汰其他目录
+ * 读目录期间目录发生过变化或失去了监视时放弃写入
+ */
+void dircache_fill_commit(dircache_fill_t *fill, const char *data, size_t len) {
+    if (len > dircache_capacity()) {
+        return;
+    }
+    int nblocks = (len + DIRCACHE_BLOCK_SIZE - 1) / DIRCACHE_BLOCK_SIZE;
+
+    shm_lock(&s_shm->lock);
+    if (s_shm->unwatch_seq != fill->unwatch_seq
+        || s_shm->wd_seq[fill->wd & (DIRCACHE_WD_SLOTS - 1)] != fill->wd_seq) {
+        shm_unlock(&s_shm->lock);
+        return;
+    }
+
+    // 其他会话可能同时填充了同一个目录，以本次的结果为准
+    int idx = dircache_find(fill->dev, fill->ino, fill->detail);
+    if (idx >= 0) {
+        dircache_remove(idx, s_shm->table[idx].wd != fill->wd);
+    }
+    while (s_shm->free_entry < 0 || s_shm->free_blocks < nblocks) {
+        if ( ! dircache_evict(fill->wd)) {
+            shm_unlock(&s_shm->lock);
+            return;
+        }
+    }
+
+    idx = s_shm->free_entry;
+    dircache_entry_t *e = &s_shm->table[idx];
+    s_shm->free_entry = e->next;
+
+    // 从空闲链表上取下数据块，顺序即为数据的顺序
+    e->first_block = nblocks > 0 ? s_shm->free_block : -1;
+    int b = -1;
+    size_t off = 0;
+    int i;
+    for (i = 0; i < nblocks; i++) {
+        b = s_shm->free_block;
+        s_shm->free_block = s_block_next[b];
+        size_t n = len - off > DIRCACHE_BLOCK_SIZE ? DIRCACHE_BLOCK_SIZE : len - off;
+        memcpy(s_blocks + (size_t)b * DIRCACHE_BLOCK_SIZE, data + off, n);
+        off += n;
+    }
+    if (b >= 0) {
+        s_block_next[b] = -1;
+    }
+    s_shm->free_blocks -= nblocks;
+
+    e->used = 1;
+    e->dev = fill->dev;
+    e->ino = fill->ino;
+    e->mtime_ns = fill->mtime_ns;
+    e->detail = fill->detail;
+    e->wd = fill->wd;
+    e->len = len;
+    e->last_used = ++s_shm->tick;
+
+    unsigned int h = dircache_hash(e->dev, e->ino, e->detail);
+    e->next = s_shm->buckets[h];
+    s_shm->buckets[h] = idx;
+
+    s_shm->entries++;
+    s_shm->bytes += len;
+    shm_unlock(&s_shm->lock);
+}
+
+/**
+ * 取得命中、未命中、淘汰次数以及当前占用，未启用缓存时返回 0
+ */
+int dircache_get_stats(dircache_stats_t *stats) {
+    if (s_shm == NULL) {
+        return 0;
+    }
+    shm_lock(&s_shm->lock);
+    stats->hits = s_shm->hits;
+    stats->misses = s_shm->misses;
+    stats->evictions = s_shm->evictions;
+    stats->entries = s_shm->entries;
+    stats->bytes = s_shm->bytes;
+    shm_unlock(&s_shm->lock);
+    return 1;
+}
+
+static void dircache_start_watcher(void) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        ERR_EXIT("fork");
+    }
+    if (pid > 0) {
+        s_watcher = pid;
+        return;
+    }
+
+    // 主进程退出时随之退出
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent) {
+        exit(EXIT_SUCCESS);
+    }
+
+    // 监视进程只需要读 inotify 事件和访问共享内存
+    uid_t uid;
+    gid_t gid;
+    if (get_nobody(&uid, &gid) == 0) {
+        if (setgid(gid) < 0) {
+            ERR_EXIT("setgid");
+        }
+        if (setuid(uid) < 0) {
+            ERR_EXIT("setuid");
+        }
+    }
+
+    dircache_watch_loop();
+    exit(EXIT_SUCCESS);
+}
+
+static void dircache_watch_loop(void) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(s_inotify_fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ERR_EXIT("read");
+        }
+
+        // 一次读到的所有事件在同一次加锁中处理
+        shm_lock(&s_shm->lock);
+        char *p = buf;
+        while (p < buf + n) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // 丢失了事件，无法知道哪些目录发生了变化
+                dircache_flush();
+                continue;
+            }
+
+            s_shm->wd_seq[ev->wd & (DIRCACHE_WD_SLOTS - 1)]++;
+            int i;
+            for (i = 0; i < DIRCACHE_MAX_ENTRIES; i++) {
+                if (s_shm->table[i].used && s_shm->table[i].wd == ev->wd) {
+                    dircache_remove(i, 0);
+                }
+            }
+            // 缓存项已经失效，不再需要监视，下次填充时重新添加
+            if ( ! (ev->mask & IN_IGNORED) && inotify_rm_watch(s_inotify_fd, ev->wd) == 0) {
+                s_shm->unwatch_seq++;
+            }
+        }
+        shm_unlock(&s_shm->lock);
+    }
+}
+
+static unsigned int dircache_hash(dev_t dev, ino_t ino, int detail) {
+    unsigned long long key = ((unsigned long long)dev * 31 + ino) * 2 + (detail != 0);
+    return (unsigned int)(key * 2654435761u) & (DIRCACHE_BUCKETS - 1);
+}
+
+// 以下函数须持有锁
+
+static int dircache_find(dev_t dev, ino_t ino, int detail) {
+    int idx = s_shm->buckets[dircache_hash(dev, ino, detail)];
+    while (idx >= 0) {
+        dircache_entry_t *e = &s_shm->table[idx];
+        if (e->dev == dev && e->ino == ino && e->detail == detail) {
+            return idx;
+        }
+        idx = e->next;
+    }
+    return -1;
+}
+
+/**
+ * 移除一个缓存项，归还其数据块
+ * @unwatch 为真且没有其他缓存项使用同一个监视时，一并移除 inotify 监视
+ */
+static void dircache_remove(int idx, int unwatch) {
+    dircache_entry_t *e = &s_shm->table[idx];
+
+    int *link = &s_shm->buckets[dircache_hash(e->dev, e->ino, e->detail)];
+    while (*link != idx) {
+        link = &s_shm->table[*link].next;
+    }
+    *link = e->next;
+
+    int b = e->first_block;
+    while (b >= 0) {
+        int next = s_block_next[b];
+        s_block_next[b] = s_shm->free_block;
+        s_shm->free_block = b;
+        s_shm->free_blocks++;
+        b = next;
+    }
+
+    e->used = 0;
+    e->next = s_shm->free_entry;
+    s_shm->free_entry = idx;
+    s_shm->entries--;
+    s_shm->bytes -= e->len;
+
+    if (unwatch) {
+        int i;
+        for (i = 0; i < DIRCACHE_MAX_ENTRIES; i++) {
+            if (s_shm->table[i].used && s_shm->table[i].wd == e->wd) {
+                return;
+            }
+        }
+        if (inotify_rm_watch(s_inotify_fd, e->wd) == 0) {
+            s_shm->unwatch_seq++;
+        }
+    }
+}
+
+// 淘汰最久未使用的缓存项，没有可淘汰的返回 0
+// keep_wd 是正在写入的目录的监视，不能移除
+static int dircache_evict(int keep_wd) {
+    int victim = -1;
+    int i;
+    for (i = 0; i < DIRCACHE_MAX_ENTRIES; i++) {
+        dircache_entry_t *e = &s_shm->table[i];
+        if (e->used && (victim < 0 || e->last_used < s_shm->table[victim].last_used)) {
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        return 0;
+    }
+    dircache_remove(victim, s_shm->table[victim].wd != keep_wd);
+    s_shm->evictions++;
+    return 1;
+}
+
+static void dircache_flush(void) {
+    int i;
+    for (i = 0; i < DIRCACHE_MAX_ENTRIES; i++) {
+        if (s_shm->table[i].used) {
+            dircache_remove(i, 1);
+        }
+    }
+    s_shm->unwatch_seq++;
+}
+
+static long long dircache_mtime_ns(const struct stat *st) {
+    return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
@@ -0,0 +1,43 @@
+#ifndef _DIR_CACHE_H_
+#define _DIR_CACHE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// 所有会话进程共享的目录列表缓存
+// 缓存格式化好的 LIST/NLST 输出，以目录的 (dev, ino) 为键，并校验目录的 mtime
+// 目录中的文件被修改时 mtime 不变，因此由一个监视进程通过 inotify 使缓存失效
+// 占用的内存不超过 dir_cache_size，空间不足时淘汰最久未使用的目录
+
+// 一次填充缓存的过程，开始读目录之前记录失效序号，读完后序号未变才写入缓存
+typedef struct dircache_fill {
+    dev_t dev;
+    ino_t ino;
+    long long mtime_ns;
+    int detail;
+    int wd;
+    unsigned int unwatch_seq;
+    unsigned int wd_seq;
+} dircache_fill_t;
+
+typedef struct dircache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long entries;
+    unsigned long long bytes;
+} dircache_stats_t;
+
+void dircache_init(void);
+int dircache_reap(pid_t pid);
+int dircache_enabled(void);
+size_t dircache_capacity(void);
+
+char* dircache_get(const struct stat *st, int detail, size_t *len);
+int dircache_fill_begin(dircache_fill_t *fill, const struct stat *st, int detail);
+void dircache_fill_commit(dircache_fill_t *fill, const char *data, size_t len);
+
+int dircache_get_stats(dircache_stats_t *stats);
+
+#endif /* _DIR_CACHE_H_ */
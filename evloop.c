@@ -0,0 +1,646 @@
+#include "evloop.h"
+#include "common.h"
+#include "sysutil.h"
+#include "ftpproto.h"
+#include "ftpcodes.h"
+#include "tunable.h"
+#include "conntab.h"
+#include "privsock.h"
+#include "auth.h"
+#include <sys/epoll.h>
+
+#define EVLOOP_MAX_EVENTS   256
+
+// 会话进程交还会话时发给引擎的消息，沿用内部通信的消息格式
+// 先发 RETURN_CWD 附带当前目录，再发 RETURN_CTRL 附带控制连接，数据为 evloop_state_t
+#define EVLOOP_RETURN_CWD   1
+#define EVLOOP_RETURN_CTRL  2
+
+extern session_t *p_sess;
+
+typedef struct evconn {
+    session_t sess;
+    long last_active;
+    int ret_fd;             // 已移交给会话进程时为等待交还的通道，托管中为 -1
+    int auth_fd;            // 等待口令验证结果的套接字，没有提交的请求时为 -1
+    struct evconn *prev;
+    struct evconn *next;
+} evconn_t;
+
+// 会话进程中可能改变、交还时需要带回的协议状态
+typedef struct evloop_state {
+    int is_ascii;
+    int is_block_mode;
+    int is_deflate_mode;
+} evloop_state_t;
+
+static int s_listenfd = -1;
+static int s_epollfd = -1;
+static int s_sigfd = -1;
+static uid_t s_euid;
+static gid_t s_egid;
+// 验证请求队列已满、等待重新提交的连接数
+static int s_auth_waiting;
+
+// 托管中的连接
+static evconn_t *s_conns;
+// 已移交给会话进程、等待交还的连接
+static evconn_t *s_promoted;
+static const session_t *s_sess_template;
+
+static int evloop_check_limits(session_t *sess);
+static void evloop_accept(void);
+static void evloop_handle_input(evconn_t *conn);
+static void evloop_handle_return(evconn_t *conn);
+static void evloop_check_idle(void);
+static void evloop_auth_submit(evconn_t *conn);
+static int evloop_auth_send(evconn_t *conn);
+static void evloop_auth_resubmit(void);
+static void evloop_handle_auth(evconn_t *conn);
+static void evloop_auth_done(evconn_t *conn, int ok);
+static int evloop_login(session_t *sess);
+static int evloop_user_enter(session_t *sess);
+static void evloop_user_leave(void);
+static void evloop_promote(evconn_t *conn);
+static void evloop_link(evconn_t **head, evconn_t *conn);
+static void evloop_unlink(evconn_t **head, evconn_t *conn);
+static void evloop_free(evconn_t *conn);
+static void evloop_close(evconn_t *conn);
+
+void evloop_run(int listenfd, const session_t *sess_template) {
+    s_listenfd = listenfd;
+    s_sess_template = sess_template;
+    // 已登录会话的命令临时切换为登录用户执行，执行完切换回来
+    s_euid = geteuid();
+    s_egid = getegid();
+
+    // 向已关闭的连接写应答不能让整个引擎退出
+    signal(SIGPIPE, SIG_IGN);
+
+    // 已移交的会话进程退出时才从连接计数中注销
+    s_sigfd = conntab_reaper_open();
+
+    s_epollfd = epoll_create1(0);
+    if (s_epollfd == -1) {
+        ERR_EXIT("epoll_create1");
+    }
+
+    activate_nonblock(s_listenfd);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(s_epollfd, EPOLL_CTL_ADD, s_listenfd, &ev) < 0) {
+        ERR_EXIT("epoll_ctl");
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &s_sigfd;
+    if (epoll_ctl(s_epollfd, EPOLL_CTL_ADD, s_sigfd, &ev) < 0) {
+        ERR_EXIT("epoll_ctl");
+    }
+    // 验证进程取走请求后队列可写，重新提交因队列已满而等待的请求
+    if (auth_queue_fd() != -1) {
+        ev.events = EPOLLOUT | EPOLLET;
+        ev.data.ptr = &s_auth_waiting;
+        if (epoll_ctl(s_epollfd, EPOLL_CTL_ADD, auth_queue_fd(), &ev) < 0) {
+            ERR_EXIT("epoll_ctl");
+        }
+    }
+
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+    while (1) {
+        // 至少每秒醒来一次检查空闲超时
+        int n = epoll_wait(s_epollfd, events, EVLOOP_MAX_EVENTS, 1000);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR_EXIT("epoll_wait");
+        }
+
+        int i;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                evloop_accept();
+            } else if (events[i].data.ptr == &s_sigfd) {
+                conntab_reap(s_sigfd);
+            } else if (events[i].data.ptr == &s_auth_waiting) {
+                evloop_auth_resubmit();
+            } else {
+                evconn_t *conn = (evconn_t *)events[i].data.ptr;
+                if (conn->ret_fd != -1) {
+                    evloop_handle_return(conn);
+                } else if (conn->auth_fd != -1) {
+                    evloop_handle_auth(conn);
+                } else {
+                    evloop_handle_input(conn);
+                }
+            }
+        }
+
+        evloop_check_idle();
+    }
+}
+
+static int evloop_check_limits(session_t *sess) {
+    if (tunable_max_clients > 0 && sess->num_clients > tunable_max_clients) {
+        ftp_reply(sess, FTP_TOO_MANY_USERS,
+            "There are too many connected users, please try later.");
+        return 0;
+    }
+
+    if (tunable_max_per_ip > 0 && sess->num_this_ip > tunable_max_per_ip) {
+        ftp_reply(sess, FTP_IP_LIMIT,
+            "There are too many connections from your internet address.");
+        return 0;
+    }
+    return 1;
+}
+
+static void evloop_accept(void) {
+    while (1) {
+        struct sockaddr_in addr;
+        int fd = accept_timeout(s_listenfd, &addr, 0);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // EAGAIN：已取完所有连接
+            return;
+        }
+
+        evconn_t *conn = (evconn_t *)malloc(sizeof(evconn_t));
+        memset(conn, 0, sizeof(evconn_t));
+        conn->ret_fd = -1;
+        conn->auth_fd = -1;
+        conn->sess = *s_sess_template;
+        conn->sess.ctrl_fd = fd;
+        conn->sess.evloop_hosted = 1;
+        conn->sess.client_ip = addr.sin_addr.s_addr;
+        conn->last_active = get_time_sec();
+
+        conn->sess.conntab_id = conntab_add(conn->sess.client_ip, &conn->sess.num_clients,
+            &conn->sess.num_this_ip);
+
+        // 超出限制的连接直接拒绝，不必创建任何进程
+        if ( ! evloop_check_limits(&conn->sess)) {
+            evloop_close(conn);
+            continue;
+        }
+
+        activate_oobinline(fd);
+        activate_nodelay(fd);
+        activate_nonblock(fd);
+
+        // 边沿触发：未读完的半行数据留在内核缓冲区，等新数据到达再处理
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(s_epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            evloop_close(conn);
+            continue;
+        }
+
+        evloop_link(&s_conns, conn);
+
+        ftp_reply(&conn->sess, FTP_GREET, "(miniftpd 0.1)");
+        ftp_flush_reply(&conn->sess);
+    }
+}
+
+static void evloop_handle_input(evconn_t *conn) {
+    session_t *sess = &conn->sess;
+    while (1) {
+        memset(sess->cmd, 0, sizeof(sess->cmd));
+        memset(sess->arg, 0, sizeof(sess->arg));
+
+        // 未取走的数据留在会话的接收缓冲区中，移交时随会话一起交给会话进程
+        int ret = linebuf_readline(sess->ctrl_fd, &sess->ctrl_buf, &sess->cmdline);
+        if (ret == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // 出错或命令行过长
+                evloop_close(conn);
+                return;
+            }
+            // 已处理完客户端一次发来的所有命令，把积累的应答一次写出
+            ftp_flush_reply(sess);
+            return;
+        } else if (ret == 0) {
+            evloop_close(conn);
+            return;
+        }
+        conn->last_active = get_time_sec();
+
+        ftp_parse_command(sess);
+        // 已登录的会话以登录用户的身份、在它的当前目录下执行命令
+        int logged_in = sess->logged_in;
+        if (logged_in && evloop_user_enter(sess) < 0) {
+            // 不能以 root 身份替用户执行命令
+            ftp_reply(sess, FTP_BADSENDFILE, "Local error, please try later.");
+            continue;
+        }
+        int handled = ftp_dispatch_command(sess, 1);
+        if (logged_in) {
+            evloop_user_leave();
+        } else if (sess->logged_in && evloop_login(sess) < 0) {
+            evloop_close(conn);
+            return;
+        }
+        if (sess->auth_pending) {
+            evloop_auth_submit(conn);
+            return;
+        }
+        if ( ! handled) {
+            evloop_promote(conn);
+            return;
+        }
+        if (sess->quit_received) {
+            evloop_close(conn);
+            return;
+        }
+    }
+}
+
+static void evloop_check_idle(void) {
+    if (tunable_idle_session_timeout == 0) {
+        return;
+    }
+
+    long now = get_time_sec();
+    evconn_t *conn = s_conns;
+    while (conn != NULL) {
+        evconn_t *next = conn->next;
+        if (now - conn->last_active >= (long)tunable_idle_session_timeout) {
+            ftp_reply(&conn->sess, FTP_IDLE_TIMEOUT, "Timeout.");
+            evloop_close(conn);
+        }
+        conn = next;
+    }
+}
+
+/**
+ * 把 PASS 的口令交给验证进程，不等待结果
+ * 等待期间不读取控制连接，之后的命令在结果到达后按顺序处理
+ */
+static void evloop_auth_submit(evconn_t *conn) {
+    ftp_flush_reply(&conn->sess);
+    epoll_ctl(s_epollfd, EPOLL_CTL_DEL, conn->sess.ctrl_fd, NULL);
+    if (evloop_auth_send(conn) < 0) {
+        // 队列已满，等队列可写时重新提交
+        s_auth_waiting++;
+    }
+}
+
+/**
+ * 提交请求并等待结果套接字可读，队列已满返回 -1
+ * 提交失败时按验证失败结束 PASS，此时连接可能已关闭
+ */
+static int evloop_auth_send(evconn_t *conn) {
+    session_t *sess = &conn->sess;
+    int fd = auth_submit(sess->user, sess->arg, 1);
+    if (fd == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        evloop_auth_done(conn, 0);
+        return 0;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(s_epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        evloop_auth_done(conn, 0);
+        return 0;
+    }
+    conn->auth_fd = fd;
+    return 0;
+}
+
+static void evloop_auth_resubmit(void) {
+    evconn_t *conn = s_conns;
+    while (conn != NULL && s_auth_waiting > 0) {
+        evconn_t *next = conn->next;
+        if (conn->sess.auth_pending && conn->auth_fd == -1) {
+            if (evloop_auth_send(conn) < 0) {
+                return;
+            }
+            s_auth_waiting--;
+        }
+        conn = next;
+    }
+}
+
+static void evloop_handle_auth(evconn_t *conn) {
+    epoll_ctl(s_epollfd, EPOLL_CTL_DEL, conn->auth_fd, NULL);
+    int ok = auth_result(conn->auth_fd);
+    conn->auth_fd = -1;
+    evloop_auth_done(conn, ok);
+}
+
+/**
+ * 验证结束后回复 PASS，恢复读取控制连接并处理等待期间收到的命令
+ */
+static void evloop_auth_done(evconn_t *conn, int ok) {
+    session_t *sess = &conn->sess;
+    sess->auth_pending = 0;
+    ftp_login_result(sess, ok);
+    if (sess->logged_in && evloop_login(sess) < 0) {
+        evloop_close(conn);
+        return;
+    }
+    conn->last_active = get_time_sec();
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(s_epollfd, EPOLL_CTL_ADD, sess->ctrl_fd, &ev) < 0) {
+        evloop_close(conn);
+        return;
+    }
+    evloop_handle_input(conn);
+}
+
+/**
+ * 会话进程交还会话时恢复托管，会话进程没有交还就退出时会话结束
+ */
+static void evloop_handle_return(evconn_t *conn) {
+    session_t *sess = &conn->sess;
+    priv_msg_t msg;
+    if (priv_sock_try_recv(conn->ret_fd, &msg) < 0) {
+        // 连接计数在回收会话进程时注销
+        evloop_unlink(&s_promoted, conn);
+        evloop_free(conn);
+        return;
+    }
+    if (msg.code == EVLOOP_RETURN_CWD && msg.fd != -1) {
+        if (sess->cwd_fd != -1) {
+            close(sess->cwd_fd);
+        }
+        sess->cwd_fd = msg.fd;
+        return;
+    }
+    if (msg.code != EVLOOP_RETURN_CTRL || msg.fd == -1 || msg.len != sizeof(evloop_state_t)) {
+        if (msg.fd != -1) {
+            close(msg.fd);
+        }
+        return;
+    }
+
+    evloop_state_t state;
+    memcpy(&state, msg.data, sizeof(state));
+    sess->is_ascii = state.is_ascii;
+    sess->is_block_mode = state.is_block_mode;
+    sess->is_deflate_mode = state.is_deflate_mode;
+    sess->restart_pos = 0;
+    sess->ctrl_buf.start = sess->ctrl_buf.scan = sess->ctrl_buf.end = 0;
+    sess->ctrl_fd = msg.fd;
+
+    epoll_ctl(s_epollfd, EPOLL_CTL_DEL, conn->ret_fd, NULL);
+    close(conn->ret_fd);
+    conn->ret_fd = -1;
+    evloop_unlink(&s_promoted, conn);
+
+    // 会话进程退出时会注销它的连接计数，连接回到引擎后重新登记
+    sess->conntab_id = conntab_add(sess->client_ip, &sess->num_clients, &sess->num_this_ip);
+    conn->last_active = get_time_sec();
+    evloop_link(&s_conns, conn);
+
+    // 加入 epoll 时已有数据可读也会触发一次事件
+    activate_nonblock(sess->ctrl_fd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(s_epollfd, EPOLL_CTL_ADD, sess->ctrl_fd, &ev) < 0) {
+        evloop_close(conn);
+    }
+}
+
+/**
+ * 在会话进程中调用，没有跨命令的数据连接状态、也没有未处理的命令时，
+ * 把控制连接与当前目录交还给引擎后退出，否则直接返回，由本进程继续处理
+ */
+void evloop_return_session(session_t *sess) {
+    mode_t mask = umask(0);
+    umask(mask);
+    // SITE UMASK 修改过的 umask 不随会话交还
+    if (sess->port_addr != NULL || sess->pasv_accepting || sess->data_keep_fd != -1
+        || sess->rnfr_name != NULL || sess->restart_pos != 0
+        || sess->ctrl_buf.start != sess->ctrl_buf.end || mask != tunable_local_umask) {
+        return;
+    }
+
+    ftp_flush_reply(sess);
+    evloop_state_t state;
+    state.is_ascii = sess->is_ascii;
+    state.is_block_mode = sess->is_block_mode;
+    state.is_deflate_mode = sess->is_deflate_mode;
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd == -1
+        || priv_sock_send(sess->evloop_fd, EVLOOP_RETURN_CWD, 0, NULL, 0, cwd) < 0
+        || priv_sock_send(sess->evloop_fd, EVLOOP_RETURN_CTRL, 0, &state, sizeof(state),
+            sess->ctrl_fd) < 0) {
+        // 引擎不能接收时一直由本进程处理
+        if (cwd != -1) {
+            close(cwd);
+        }
+        close(sess->evloop_fd);
+        sess->evloop_fd = -1;
+        return;
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * 登录成功后取得登录用户，以该用户的身份打开 home 目录作为会话的当前目录
+ * 引擎本身不切换身份
+ */
+static int evloop_login(session_t *sess) {
+    char home[PATH_MAX];
+    if (ftp_session_identity(sess, home) < 0) {
+        return -1;
+    }
+    if (setegid(sess->gid) < 0) {
+        return -1;
+    }
+    if (seteuid(sess->uid) < 0) {
+        evloop_user_leave();
+        return -1;
+    }
+    sess->cwd_fd = open(home, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (sess->cwd_fd == -1) {
+        sess->cwd_fd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    evloop_user_leave();
+    return sess->cwd_fd != -1 ? 0 : -1;
+}
+
+/**
+ * 引擎是单线程的，命令执行期间的身份与当前目录只属于这个会话
+ * 切换失败时恢复引擎自己的身份并返回 -1，命令不能执行
+ */
+static int evloop_user_enter(session_t *sess) {
+    if (setegid(sess->gid) < 0) {
+        return -1;
+    }
+    // 当前目录仍是上一个会话的，不能在切换失败后继续
+    if (seteuid(sess->uid) < 0 || fchdir(sess->cwd_fd) < 0) {
+        evloop_user_leave();
+        return -1;
+    }
+    return 0;
+}
+
+// 不能恢复引擎的身份时继续运行是不安全的
+static void evloop_user_leave(void) {
+    if (seteuid(s_euid) < 0) {
+        ERR_EXIT("seteuid");
+    }
+    if (setegid(s_egid) < 0) {
+        ERR_EXIT("setegid");
+    }
+}
+
+/**
+ * 为会话创建会话进程，由其执行挂起的命令并在传输期间接管控制连接
+ * 引擎保留会话的登录状态与当前目录，等待会话进程在传输结束后交还
+ */
+static void evloop_promote(evconn_t *conn) {
+    session_t *sess = &conn->sess;
+    int fds[2];
+    if (socketpair(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        evloop_close(conn);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        evloop_close(conn);
+        return;
+    }
+
+    if (pid == 0) {
+        // 释放引擎持有的描述符，回到传统的会话处理流程
+        close(fds[0]);
+        close(s_listenfd);
+        close(s_epollfd);
+        conntab_reaper_release(s_sigfd);
+        evconn_t *other;
+        for (other = s_conns; other != NULL; other = other->next) {
+            if (other != conn) {
+                close(other->sess.ctrl_fd);
+                if (other->sess.cwd_fd != -1) {
+                    close(other->sess.cwd_fd);
+                }
+                if (other->auth_fd != -1) {
+                    close(other->auth_fd);
+                }
+            }
+        }
+        for (other = s_promoted; other != NULL; other = other->next) {
+            close(other->ret_fd);
+            if (other->sess.cwd_fd != -1) {
+                close(other->sess.cwd_fd);
+            }
+        }
+
+        signal(SIGPIPE, SIG_DFL);
+
+        deactivate_nonblock(sess->ctrl_fd);
+        sess->evloop_hosted = 0;
+        sess->evloop_fd = fds[1];
+        p_sess = sess;
+        begin_session(sess);
+        exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+
+    // 连接计数待会话进程退出时注销
+    conntab_track(pid, sess->client_ip, sess->conntab_id);
+    evloop_unlink(&s_conns, conn);
+
+    // 会话进程仍持有该套接字，仅 close 不会把它从 epoll 中移除
+    epoll_ctl(s_epollfd, EPOLL_CTL_DEL, sess->ctrl_fd, NULL);
+    close(sess->ctrl_fd);
+    sess->ctrl_fd = -1;
+    // 未写出的应答与数据连接的设置已随会话交给会话进程
+    sess->reply_len = 0;
+    if (sess->port_addr != NULL) {
+        free(sess->port_addr);
+        sess->port_addr = NULL;
+    }
+    if (sess->rnfr_name != NULL) {
+        free(sess->rnfr_name);
+        sess->rnfr_name = NULL;
+    }
+
+    conn->ret_fd = fds[0];
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(s_epollfd, EPOLL_CTL_ADD, conn->ret_fd, &ev) < 0) {
+        // 不能等待交还时会话一直由会话进程处理
+        evloop_free(conn);
+        return;
+    }
+    evloop_link(&s_promoted, conn);
+}
+
+static void evloop_link(evconn_t **head, evconn_t *conn) {
+    conn->prev = NULL;
+    conn->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = conn;
+    }
+    *head = conn;
+}
+
+static void evloop_unlink(evconn_t **head, evconn_t *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else if (*head == conn) {
+        *head = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+}
+
+static void evloop_free(evconn_t *conn) {
+    if (conn->sess.auth_pending && conn->auth_fd == -1) {
+        s_auth_waiting--;
+    }
+    if (conn->auth_fd != -1) {
+        epoll_ctl(s_epollfd, EPOLL_CTL_DEL, conn->auth_fd, NULL);
+        close(conn->auth_fd);
+    }
+    if (conn->sess.ctrl_fd != -1) {
+        epoll_ctl(s_epollfd, EPOLL_CTL_DEL, conn->sess.ctrl_fd, NULL);
+        close(conn->sess.ctrl_fd);
+    }
+    if (conn->ret_fd != -1) {
+        epoll_ctl(s_epollfd, EPOLL_CTL_DEL, conn->ret_fd, NULL);
+        close(conn->ret_fd);
+    }
+    if (conn->sess.cwd_fd != -1) {
+        close(conn->sess.cwd_fd);
+    }
+    if (conn->sess.port_addr != NULL) {
+        free(conn->sess.port_addr);
+    }
+    if (conn->sess.rnfr_name != NULL) {
+        free(conn->sess.rnfr_name);
+    }
+    free(conn);
+}
+
+static void evloop_close(evconn_t *conn) {
+    ftp_flush_reply(&conn->sess);
+    conntab_remove(conn->sess.client_ip, conn->sess.conntab_id);
+    evloop_unlink(&s_conns, conn);
+    evloop_free(conn);
+}
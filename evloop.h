@@ -0,0 +1,13 @@
+#ifndef _EVLOOP_H_
+#define _EVLOOP_H_
+
+#include "session.h"
+
+// 事件驱动的控制连接引擎
+// 单进程用 epoll 托管大量控制连接，已登录会话的命令临时切换为登录用户执行，
+// 只有需要数据连接或 nobody 进程的命令才为会话创建独立的会话进程，
+// 传输结束后会话进程把控制连接交还给引擎并退出
+void evloop_run(int listenfd, const session_t *sess_template);
+void evloop_return_session(session_t *sess);
+
+#endif /* _EVLOOP_H_ */
@@ -4,8 +4,18 @@
 #include "ftpcodes.h"
 #include "tunable.h"
 #include "privsock.h"
+#include "uring.h"
+#include "dircache.h"
+#include "pasvpool.h"
+#include "auth.h"
+#include "userdb.h"
+#include "zcache.h"
+#include "evloop.h"
+#include <zlib.h>
 
 void ftp_lreply(session_t *sess, int status, const char *text);
+static void ftp_reply_text(session_t *sess, const char *text);
+static void ftp_reply_send(session_t *sess, int more);
 
 void handle_alarm_timeout(int sig);
 void handle_sigalrm(int sig);
@@ -16,14 +26,159 @@ void start_data_alarm(void);
 void check_abor(session_t *sess);
 
 int list_common(session_t *sess, int detail);
-void limit_rate(session_t *sess, int byte_transfered, int is_upload);
 void upload_common(session_t *sess, int is_append);
 
+#define DIRCACHE_CAPTURE_INIT   (16 * 1024)
+// 列表输出按批发送，与 io_uring 的缓冲区大小相同
+#define LIST_BATCH_SIZE         URING_BUF_SIZE
+#define LIST_DENTS_SIZE         (64 * 1024)
+// 一行 LIST 输出的上限：文件名与符号链接目标之外的字段不超过 128 字节
+#define LIST_LINE_MAX           (128 + NAME_MAX + PATH_MAX)
+// 并发 statx 时同时等待结果的目录项数的上限
+#define LIST_STAT_MAX_PARALLEL  URING_ENTRIES
+#define LIST_STATX_MASK \
+    (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_INO | \
+     STATX_SIZE | STATX_MTIME)
+
+// MODE B 的块头：1 字节描述符，随后为 2 字节网络字节序的数据长度
+#define BLOCK_HEADER_SIZE       3
+#define BLOCK_MAX_DATA          65535
+#define BLOCK_DESC_EOR          0x80
+#define BLOCK_DESC_EOF          0x40
+#define BLOCK_DESC_ERRORS       0x20
+#define BLOCK_DESC_RESTART      0x10
+
+// MODE Z 读文件与压缩输出各用一个缓冲区，压缩后的数据不能用 sendfile，大块读写以减少系统调用
+#define ZBUF_SIZE               (256 * 1024)
+
+// 列表输出，数据先在当前缓冲区中积累，满一批后发送
+// 启用 io_uring 时轮流使用其缓冲区异步发送，否则使用 batch 同步发送
+typedef struct list_out {
+    session_t *sess;
+    uring_t *ring;
+    char *buf;
+    int cur;
+    int len;
+    int inflight;
+    int failed;
+    // 同时保留一份完整的输出，用于写入目录列表缓存，超出缓存容量时放弃
+    char *capture;
+    size_t capture_len;
+    size_t capture_size;
+    char batch[LIST_BATCH_SIZE];
+} list_out_t;
+
+// getdents64 返回的目录项
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// 逐批读入的目录项，跳过以 '.' 开头的文件
+typedef struct list_dents {
+    int dirfd;
+    long n;
+    long off;
+    char buf[LIST_DENTS_SIZE] __attribute__((aligned(8)));
+} list_dents_t;
+
+// 并发 statx 时一个等待结果的目录项，name 与 stx 在完成之前由内核使用
+typedef struct list_stat_slot {
+    struct statx stx;
+    int state;
+    int res;
+    char name[NAME_MAX + 1];
+} list_stat_slot_t;
+
+#define LIST_SLOT_FREE      0
+#define LIST_SLOT_PENDING   1
+#define LIST_SLOT_DONE      2
+
+// 输出一个已取得属性的目录项
+typedef void (*list_emit_t)(list_out_t *out, int dirfd, const char *name,
+    const struct statx *stx, void *arg);
+
+static uring_t* get_data_uring(session_t *sess);
+static void list_out_init(list_out_t *out, session_t *sess);
+static char* list_out_reserve(list_out_t *out, int need);
+static void list_out_commit(list_out_t *out, int len);
+static void list_out_write(list_out_t *out, const char *buf, int len);
+static void list_out_send(list_out_t *out);
+static void list_out_capture(list_out_t *out, const char *buf, int len);
+static int list_out_flush(list_out_t *out);
+static int list_out_wait(list_out_t *out);
+static void list_dents_init(list_dents_t *dents, int dirfd);
+static const char* list_dents_next(list_dents_t *dents);
+static uring_t* get_stat_uring(session_t *sess);
+static int list_statx(int dirfd, const char *name, int follow, struct statx *stx);
+static void list_walk(list_out_t *out, int dirfd, int follow, list_emit_t emit, void *arg);
+static void list_walk_parallel(list_out_t *out, uring_t *ring, list_dents_t *dents,
+    int follow, list_emit_t emit, void *arg);
+static void list_emit_line(list_out_t *out, int dirfd, const char *name,
+    const struct statx *stx, void *arg);
+
+// MLSD/MLST 计算 perm 事实时使用的会话身份
+typedef struct mlsx_ctx {
+    uid_t uid;
+    gid_t gid;
+    gid_t *groups;
+    int ngroups;
+    int dir_writable;   // 条目所在目录可写，可以删除与改名
+} mlsx_ctx_t;
+
+static void mlsx_ctx_init(mlsx_ctx_t *ctx, const char *dir);
+static void mlsx_ctx_free(mlsx_ctx_t *ctx);
+static int mlsx_access(mlsx_ctx_t *ctx, const struct statx *stx, int mask);
+static char* mlsx_format_facts(char *p, const struct statx *stx, mlsx_ctx_t *ctx);
+static void mlsd_emit(list_out_t *out, int dirfd, const char *name,
+    const struct statx *stx, void *arg);
+static int mlsd_common(session_t *sess, int dirfd, const char *path);
+static int retr_uring(session_t *sess, uring_t *ring, int fd, long long offset,
+    long long bytes);
+static int upload_uring(session_t *sess, uring_t *ring, int fd);
+static int splice_pipe_open(int pipefd[2]);
+static size_t retr_chunk_size(session_t *sess);
+static int retr_sendfile(session_t *sess, int fd, long long offset, long long bytes);
+static void rate_start(session_t *sess);
+static void rate_stop(session_t *sess);
+static void rate_exit(void);
+static int rate_limited(session_t *sess, int is_upload);
+static size_t rate_grant(session_t *sess, size_t want, int is_upload);
+static void rate_consume(session_t *sess, size_t used, int is_upload);
+static int upload_splice(session_t *sess, int fd);
+static int block_send_header(int fd, int desc, size_t len);
+static int block_write(int fd, int desc, const char *buf, size_t len);
+static int retr_block(session_t *sess, int fd, long long offset, long long bytes);
+static int upload_block(session_t *sess, int fd);
+static int zmode_buf_alloc(session_t *sess);
+static int zmode_deflate_begin(session_t *sess, int level);
+static z_stream* zmode_inflate_begin(session_t *sess);
+static int zmode_level(void);
+static int zmode_stored(const char *name, int fd);
+static int zmode_send(session_t *sess, const char *buf, size_t len, int flush, int limited);
+static int retr_zmode(session_t *sess, int fd, long long offset, long long bytes);
+static int zmode_precompressed(session_t *sess, int fd, long long bytes);
+static int zmode_sidecar(session_t *sess, int fd);
+static int zmode_gzip_range(int gz, off_t gz_size, off_t src_size, long long *start,
+    long long *end);
+static int zmode_adler32(session_t *sess, int fd, off_t size, unsigned long *adler);
+static int zmode_cached(session_t *sess, int fd);
+static int upload_zmode(session_t *sess, int fd);
+
 int get_port_fd(session_t *sess);
 int get_pasv_fd(session_t *sess);
 int get_transfer_fd(session_t *sess);
 int port_active(session_t *sess);
 int pasv_active(session_t *sess);
+static void pasv_cancel(session_t *sess);
+static int get_data_result(session_t *sess);
+static int data_reuse(session_t *sess);
+static void data_discard(session_t *sess);
+static void data_close(session_t *sess, int keep);
+static void save_cwd(session_t *sess);
 
 static void do_user(session_t *sess);
 static void do_pass(session_t *sess);
@@ -40,6 +195,8 @@ static void do_stor(session_t *sess);
 static void do_appe(session_t *sess);
 static void do_list(session_t *sess);
 static void do_nlst(session_t *sess);
+static void do_mlsd(session_t *sess);
+static void do_mlst(session_t *sess);
 static void do_rest(session_t *sess);
 static void do_abor(session_t *sess);
 static void do_pwd(session_t *sess);
@@ -52,93 +209,150 @@ static void do_site(session_t *sess);
 static void do_syst(session_t *sess);
 static void do_feat(session_t *sess);
 static void do_size(session_t *sess);
+static void do_mdtm(session_t *sess);
 static void do_stat(session_t *sess);
 static void do_noop(session_t *sess);
 static void do_help(session_t *sess);
+static int cmd_name_cmp(const void *a, const void *b);
 
 static void do_site_chmod(session_t *sess, char *chmod_arg);
 static void do_site_umask(session_t *sess, char *umask_arg);
 
+// 命令属性
+#define CMD_INLINE      0x01    // 不使用数据连接与 nobody 进程，可由事件驱动引擎直接处理
+#define CMD_LOGIN       0x02    // 须先登录
+#define CMD_DATA        0x04    // 须先用 PORT 或 PASV 建立数据连接
+#define CMD_ARG_NONE    0x08    // 不接受参数
+#define CMD_ARG_NEED    0x10    // 必须带参数
+
+// 命令名最长 4 个字符，按字节打包成一个整数作为操作码
+#define CMD_OP(a, b, c, d) \
+    ((unsigned int)(a) << 24 | (unsigned int)(b) << 16 | (unsigned int)(c) << 8 | (unsigned int)(d))
+
+// 命令表，每一项为：命令名、命令名的 4 个字符（不足补 0）、处理函数、属性、在 FEAT 中声明的特性
+// 由它在编译期展开出命令编号、命令表以及按操作码分派的 switch，重复的命令名会导致编译错误
+#define FTP_CMD_TABLE(X) \
+    /* 访问控制命令 */ \
+    X(USER, 'U', 'S', 'E', 'R', do_user, CMD_INLINE | CMD_ARG_NEED, NULL) \
+    X(PASS, 'P', 'A', 'S', 'S', do_pass, CMD_INLINE, NULL) \
+    X(CWD,  'C', 'W', 'D', 0,   do_cwd,  CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(XCWD, 'X', 'C', 'W', 'D', do_cwd,  CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(CDUP, 'C', 'D', 'U', 'P', do_cdup, CMD_INLINE | CMD_LOGIN | CMD_ARG_NONE, NULL) \
+    X(XCUP, 'X', 'C', 'U', 'P', do_cdup, CMD_INLINE | CMD_LOGIN | CMD_ARG_NONE, NULL) \
+    X(QUIT, 'Q', 'U', 'I', 'T', do_quit, CMD_INLINE | CMD_ARG_NONE, NULL) \
+    X(ACCT, 'A', 'C', 'C', 'T', NULL,    CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(SMNT, 'S', 'M', 'N', 'T', NULL,    CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(REIN, 'R', 'E', 'I', 'N', NULL,    CMD_INLINE | CMD_LOGIN | CMD_ARG_NONE, NULL) \
+    /* 传输参数命令 */ \
+    X(PORT, 'P', 'O', 'R', 'T', do_port, CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(PASV, 'P', 'A', 'S', 'V', do_pasv, CMD_LOGIN | CMD_ARG_NONE, "PASV") \
+    X(TYPE, 'T', 'Y', 'P', 'E', do_type, CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(STRU, 'S', 'T', 'R', 'U', do_stru, CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(MODE, 'M', 'O', 'D', 'E', do_mode, CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, "MODE Z") \
+    /* 服务命令 */ \
+    X(RETR, 'R', 'E', 'T', 'R', do_retr, CMD_LOGIN | CMD_DATA | CMD_ARG_NEED, NULL) \
+    X(STOR, 'S', 'T', 'O', 'R', do_stor, CMD_LOGIN | CMD_DATA | CMD_ARG_NEED, NULL) \
+    X(APPE, 'A', 'P', 'P', 'E', do_appe, CMD_LOGIN | CMD_DATA | CMD_ARG_NEED, NULL) \
+    X(LIST, 'L', 'I', 'S', 'T', do_list, CMD_LOGIN | CMD_DATA, NULL) \
+    X(NLST, 'N', 'L', 'S', 'T', do_nlst, CMD_LOGIN | CMD_DATA, NULL) \
+    X(MLSD, 'M', 'L', 'S', 'D', do_mlsd, CMD_LOGIN | CMD_DATA, NULL) \
+    X(MLST, 'M', 'L', 'S', 'T', do_mlst, CMD_INLINE | CMD_LOGIN, "MLST type*;size*;modify*;perm*;unique*;") \
+    X(REST, 'R', 'E', 'S', 'T', do_rest, CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, "REST STREAM") \
+    X(ABOR, 'A', 'B', 'O', 'R', do_abor, CMD_INLINE | CMD_LOGIN | CMD_ARG_NONE, NULL) \
+    X(PWD,  'P', 'W', 'D', 0,   do_pwd,  CMD_INLINE | CMD_LOGIN | CMD_ARG_NONE, NULL) \
+    X(XPWD, 'X', 'P', 'W', 'D', do_pwd,  CMD_INLINE | CMD_LOGIN | CMD_ARG_NONE, NULL) \
+    X(MKD,  'M', 'K', 'D', 0,   do_mkd,  CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(XMKD, 'X', 'M', 'K', 'D', do_mkd,  CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(RMD,  'R', 'M', 'D', 0,   do_rmd,  CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(XRMD, 'X', 'R', 'M', 'D', do_rmd,  CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(DELE, 'D', 'E', 'L', 'E', do_dele, CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(RNFR, 'R', 'N', 'F', 'R', do_rnfr, CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(RNTO, 'R', 'N', 'T', 'O', do_rnto, CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(SITE, 'S', 'I', 'T', 'E', do_site, CMD_LOGIN | CMD_ARG_NEED, NULL) \
+    X(SYST, 'S', 'Y', 'S', 'T', do_syst, CMD_INLINE | CMD_ARG_NONE, NULL) \
+    X(FEAT, 'F', 'E', 'A', 'T', do_feat, CMD_INLINE | CMD_ARG_NONE, NULL) \
+    X(SIZE, 'S', 'I', 'Z', 'E', do_size, CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, "SIZE") \
+    X(MDTM, 'M', 'D', 'T', 'M', do_mdtm, CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, "MDTM") \
+    X(STAT, 'S', 'T', 'A', 'T', do_stat, CMD_INLINE | CMD_LOGIN, NULL) \
+    X(NOOP, 'N', 'O', 'O', 'P', do_noop, CMD_INLINE | CMD_ARG_NONE, NULL) \
+    X(HELP, 'H', 'E', 'L', 'P', do_help, CMD_INLINE, NULL) \
+    X(STOU, 'S', 'T', 'O', 'U', NULL,    CMD_INLINE | CMD_LOGIN | CMD_DATA, NULL) \
+    X(ALLO, 'A', 'L', 'L', 'O', NULL,    CMD_INLINE | CMD_LOGIN | CMD_ARG_NEED, NULL)
+
 typedef struct ftpcmd {
     const char *cmd;
     void (*cmd_handler)(session_t *sess);
+    unsigned int flags;
+    const char *feat;
 } ftpcmd_t;
 
-static ftpcmd_t ctrl_cmds[] = {
-    /* 访问控制命令 */
-    {"USER",    do_user },
-    {"PASS",    do_pass },
-    {"CWD",     do_cwd  },
-    {"XCWD",    do_cwd  },
-    {"CDUP",    do_cdup },
-    {"XCUP",    do_cdup },
-    {"QUIT",    do_quit },
-    {"ACCT",    NULL    },
-    {"SMNT",    NULL    },
-    {"REIN",    NULL    },
-    /* 传输参数命令 */
-    {"PORT",    do_port },
-    {"PASV",    do_pasv },
-    {"TYPE",    do_type },
-    {"STRU",    do_stru },
-    {"MODE",    do_mode },
-
-    /* 服务命令 */
-    {"RETR",    do_retr },
-    {"STOR",    do_stor },
-    {"APPE",    do_appe },
-    {"LIST",    do_list },
-    {"NLST",    do_nlst },
-    {"REST",    do_rest },
-    {"ABOR",    do_abor },
-    {"\377\364\377\362ABOR", do_abor},
-    {"PWD",     do_pwd  },
-    {"XPWD",    do_pwd  },
-    {"MKD",     do_mkd  },
-    {"XMKD",    do_mkd  },
-    {"RMD",     do_rmd  },
-    {"XRMD",    do_rmd  },
-    {"DELE",    do_dele },
-    {"RNFR",    do_rnfr },
-    {"RNTO",    do_rnto },
-    {"SITE",    do_site },
-    {"SYST",    do_syst },
-    {"FEAT",    do_feat },
-    {"SIZE",    do_size },
-    {"STAT",    do_stat },
-    {"NOOP",    do_noop },
-    {"HELP",    do_help },
-    {"STOU",    NULL    },
-    {"ALLO",    NULL    }
+#define CMD_TABLE_ID(name, a, b, c, d, handler, flags, feat)    CMDID_##name,
+#define CMD_TABLE_ENTRY(name, a, b, c, d, handler, flags, feat) {#name, handler, flags, feat},
+#define CMD_TABLE_CASE(name, a, b, c, d, handler, flags, feat) \
+    case CMD_OP(a, b, c, d): return &ctrl_cmds[CMDID_##name];
+
+enum {
+    FTP_CMD_TABLE(CMD_TABLE_ID)
+    CMDID_COUNT
+};
+
+static const ftpcmd_t ctrl_cmds[CMDID_COUNT] = {
+    FTP_CMD_TABLE(CMD_TABLE_ENTRY)
 };
 
+static const ftpcmd_t* ftp_lookup_command(const char *cmd);
+static int is_abor_line(const char *line, size_t len);
+
 session_t *p_sess;
 
 void handle_alarm_timeout(int sig) {
     shutdown(p_sess->ctrl_fd, SHUT_RD);
     ftp_reply(p_sess, FTP_IDLE_TIMEOUT, "Timeout.");
+    ftp_flush_reply(p_sess);
     shutdown(p_sess->ctrl_fd, SHUT_WR);
     exit(EXIT_FAILURE);
 }
 
+/**
+ * 传输过程中收到紧急数据时检查控制连接上的下一条命令，是 ABOR 时中止传输
+ * 信号处理函数中不阻塞，也不取走其他命令：
+ * 下一条命令不是 ABOR 时全部留给主流程在传输结束后按顺序处理；
+ * ABOR 还没有完整到达时，让控制连接上有数据到达时再次产生 SIGURG，由主流程在传输结束后取消
+ */
 void handle_sigurg(int sig) {
     if (p_sess->data_fd == -1) {
         return;
     }
 
-    char cmdline[MAX_COMMAND_LINE] = {0};
-    int ret = readline(p_sess->ctrl_fd, cmdline, MAX_COMMAND_LINE);
-    if (ret <= 0) {
-        ERR_EXIT("readline");
-    }
-    str_trim_crlf(cmdline);
-    if (strcmp(cmdline, "ABOR") == 0
-        || strcmp(cmdline, "\377\364\377\362ABOR") == 0) {
+    int saved_errno = errno;
+    // 传输过程中主流程不会读控制连接，可以直接使用会话的接收缓冲区
+    char *line;
+    ssize_t len = linebuf_peekline(p_sess->ctrl_fd, &p_sess->ctrl_buf, &line);
+    if (len == 0) {
+        if ( ! p_sess->urg_pending) {
+            p_sess->urg_pending = 1;
+            activate_sigurg_input(p_sess->ctrl_fd);
+        }
+    } else if (is_abor_line(line, len)) {
+        // 缓冲区中已有完整的行，不会读套接字
+        char *cmdline;
+        linebuf_readline(p_sess->ctrl_fd, &p_sess->ctrl_buf, &cmdline);
         p_sess->abor_received = 1;
         shutdown(p_sess->data_fd, SHUT_RDWR);
-    } else {
-        ftp_reply(p_sess, FTP_BADCMD, "Unknown command.");
     }
+    errno = saved_errno;
+}
+
+// 去掉行尾的空白与 Telnet 的 IP、Synch 序列之后是否为 ABOR
+static int is_abor_line(const char *line, size_t len) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ')) {
+        len--;
+    }
+    if (len >= 4 && memcmp(line, "\377\364\377\362", 4) == 0) {
+        line += 4;
+        len -= 4;
+    }
+    return len == 4 && strncasecmp(line, "ABOR", 4) == 0;
 }
 
 void check_abor(session_t *sess) {
@@ -151,6 +365,7 @@ void check_abor(session_t *sess) {
 void handle_sigalrm(int sig) {
     if ( ! p_sess->data_process) {
         ftp_reply(p_sess, FTP_DATA_TIMEOUT, "Data timeout. Reconnect. Sorry.");
+        ftp_flush_reply(p_sess);
         exit(EXIT_FAILURE);
     }
     // 否则，当前处于数据传输的时候收到了超时信号
@@ -181,132 +396,243 @@ void start_data_alarm() {
 }
 
 void handle_child(session_t *sess) {
-    ftp_reply(sess, FTP_GREET, "(miniftpd 0.1)");
+    if (sess->cmd[0] == '\0') {
+        ftp_reply(sess, FTP_GREET, "(miniftpd 0.1)");
+    } else {
+        // 由事件驱动引擎移交过来的会话，先恢复登录状态，再执行挂起的命令
+        if (sess->logged_in) {
+            ftp_session_login(sess);
+        }
+        ftp_dispatch_command(sess, 0);
+    }
     int ret;
     while (1) {
-        memset(sess->cmdline, 0, sizeof(sess->cmdline));
+        // 传输期间没有等到完整的 ABOR，之后的命令照常按顺序读取
+        if (sess->urg_pending) {
+            sess->urg_pending = 0;
+            deactivate_sigurg_input(sess->ctrl_fd);
+        }
+
+        // 由事件驱动引擎移交过来的会话，传输结束后把控制连接交还给引擎，本进程退出
+        if (sess->evloop_fd != -1) {
+            evloop_return_session(sess);
+        }
+
         memset(sess->cmd, 0, sizeof(sess->cmd));
         memset(sess->arg, 0, sizeof(sess->arg));
 
         start_cmdio_alarm();
 
-        ret = readline(sess->ctrl_fd, sess->cmdline, MAX_COMMAND_LINE);
+        if ( ! linebuf_has_line(&sess->ctrl_buf)) {
+            // 已处理完客户端一次发来的所有命令，把积累的应答一次写出
+            ftp_flush_reply(sess);
+        }
+        ret = linebuf_readline(sess->ctrl_fd, &sess->ctrl_buf, &sess->cmdline);
         if (ret == -1) {
             ERR_EXIT("readline");
         } else if (ret == 0) {
             exit(EXIT_SUCCESS);
         }
-        str_trim_crlf(sess->cmdline);
-        // 解析 FTP 命令与参数
-        str_split(sess->cmdline, sess->cmd, sess->arg, ' ');
-        str_upper(sess->cmd);
-        // 处理 FTP 命令
-        int i;
-        int size = sizeof(ctrl_cmds) / sizeof(ctrl_cmds[0]);
-        for (i = 0; i < size; i++) {
-            if (strcmp(ctrl_cmds[i].cmd, sess->cmd) == 0) {
-                if (ctrl_cmds[i].cmd_handler != NULL) {
-                    ctrl_cmds[i].cmd_handler(sess);
-                } else {
-                    ftp_reply(sess, FTP_COMMANDNOTIMPL, "Unimplement command.");
-                }
-                break;
-            }
+        ftp_parse_command(sess);
+        ftp_dispatch_command(sess, 0);
+    }
+}
+
+void ftp_parse_command(session_t *sess) {
+    str_trim_crlf(sess->cmdline);
+    // 解析 FTP 命令与参数
+    str_split(sess->cmdline, sess->cmd, sess->arg, ' ');
+    str_upper(sess->cmd);
+}
+
+/**
+ * 按操作码查找命令，找不到返回 NULL
+ * 由编译器把 switch 生成跳转表或比较树，已知与未知命令的查找开销都是常数
+ */
+static const ftpcmd_t* ftp_lookup_command(const char *cmd) {
+    // Telnet 的 IP 与 Synch 序列之后只能紧跟 ABOR
+    if (strncmp(cmd, "\377\364\377\362", 4) == 0) {
+        cmd += 4;
+        if (strcmp(cmd, "ABOR") != 0) {
+            return NULL;
         }
+    }
+    // 空命令，避免下面移位 32 位
+    if (cmd[0] == '\0') {
+        return NULL;
+    }
+
+    unsigned int op = 0;
+    int i;
+    for (i = 0; i < 4 && cmd[i] != '\0'; i++) {
+        op = op << 8 | (unsigned char)cmd[i];
+    }
+    if (cmd[i] != '\0') {
+        return NULL;
+    }
+    op <<= 8 * (4 - i);
+
+    switch (op) {
+    FTP_CMD_TABLE(CMD_TABLE_CASE)
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * 处理 sess->cmd 中已解析好的命令
+ * 登录、参数与数据连接的检查按命令表中的属性统一进行
+ * @inline_only 为真时只执行带 CMD_INLINE 属性的命令
+ * 命令已处理返回 1，需要移交给会话进程处理返回 0
+ */
+int ftp_dispatch_command(session_t *sess, int inline_only) {
+    const ftpcmd_t *c = ftp_lookup_command(sess->cmd);
+    if (c == NULL) {
         // 找不到该请求对应的命令
-        if (i == size) {
-            ftp_reply(sess, FTP_BADCMD, "Unknown command.");
+        ftp_reply(sess, FTP_BADCMD, "Unknown command.");
+        return 1;
+    }
+    if ((c->flags & CMD_LOGIN) && ! sess->logged_in) {
+        ftp_reply(sess, FTP_LOGINERR, "Please login with USER and PASS.");
+        return 1;
+    }
+    if (c->cmd_handler == NULL) {
+        ftp_reply(sess, FTP_COMMANDNOTIMPL, "Unimplement command.");
+        return 1;
+    }
+    if ((c->flags & CMD_ARG_NEED) && sess->arg[0] == '\0') {
+        ftp_reply(sess, FTP_BADOPTS, "Missing argument.");
+        return 1;
+    }
+    if ((c->flags & CMD_ARG_NONE) && sess->arg[0] != '\0') {
+        ftp_reply(sess, FTP_BADOPTS, "Command takes no argument.");
+        return 1;
+    }
+    if (inline_only) {
+        // 事件驱动引擎中不会有 PASV，没有 PORT 时可以直接拒绝，不必为此创建会话进程
+        // 会话进程中由 get_transfer_fd 检查
+        if ((c->flags & CMD_DATA) && sess->port_addr == NULL) {
+            ftp_reply(sess, FTP_BADSENDCONN, "Use PORT or PASV first.");
+            return 1;
+        }
+        if ( ! (c->flags & CMD_INLINE)) {
+            return 0;
         }
     }
+    c->cmd_handler(sess);
+    return 1;
 }
 
 // 列出目录详情
 int list_common(session_t *sess, int detail) {
-    DIR *dir = opendir(".");
-    if (dir == NULL) {
+    list_out_t out;
+
+    // 目录列表缓存只用于当前用户有读权限的目录
+    struct stat dirbuf;
+    dircache_fill_t fill;
+    int cacheable = dircache_enabled() && stat(".", &dirbuf) == 0
+        && faccessat(AT_FDCWD, ".", R_OK, AT_EACCESS) == 0;
+    if (cacheable) {
+        size_t len;
+        char *data = dircache_get(&dirbuf, detail, &len);
+        if (data != NULL) {
+            list_out_init(&out, sess);
+            list_out_write(&out, data, len);
+            free(data);
+            return list_out_flush(&out);
+        }
+        cacheable = dircache_fill_begin(&fill, &dirbuf, detail);
+    }
+
+    int dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
         return 0;
     }
 
-    struct dirent *dt;
-    struct stat sbuf;
-    while ((dt = readdir(dir)) != NULL) {
-        if (lstat(dt->d_name, &sbuf) < 0) {
-            continue;
-        }
-        if (dt->d_name[0] == '.') {
-            continue;
-        }
+    list_out_init(&out, sess);
+    if (cacheable) {
+        out.capture_size = DIRCACHE_CAPTURE_INIT;
+        out.capture = (char *)malloc(out.capture_size);
+    }
 
-        char buf[1024] = {0};
-
-        if (detail) {
-            const char *perms = statbuf_get_perms(&sbuf);
-            const char *datebuf = statbuf_get_date(&sbuf);
-            int off = 0;
-            off += sprintf(buf, "%s ", perms);
-            off += sprintf(buf + off, "%3d %-8d %-8d ", sbuf.st_nlink, sbuf.st_uid, sbuf.st_gid);
-            off += sprintf(buf + off, "%8lu ", (unsigned long)sbuf.st_size);
-            off += sprintf(buf + off, "%s ", datebuf);
-            if (S_ISLNK(sbuf.st_mode)) {
-                char tmp[1024] = {0};
-                readlink(dt->d_name, tmp, sizeof(tmp));
-                off += sprintf(buf + off, "%s -> %s\r\n", dt->d_name, tmp);
-            } else {
-                off += sprintf(buf + off, "%s\r\n", dt->d_name);
-            }
-        } else {
-            sprintf(buf, "%s\r\n", dt->d_name);
+    // NLST 只需要文件名，不必 stat
+    if (detail) {
+        date_clock_t clk;
+        date_clock_init(&clk);
+        list_walk(&out, dirfd, 0, list_emit_line, &clk);
+    } else {
+        list_dents_t dents;
+        list_dents_init(&dents, dirfd);
+        const char *name;
+        while ((name = list_dents_next(&dents)) != NULL) {
+            int len = strlen(name);
+            char *p = list_out_reserve(&out, len + 2);
+            memcpy(p, name, len);
+            p[len] = '\r';
+            p[len + 1] = '\n';
+            list_out_commit(&out, len + 2);
         }
+    }
+    close(dirfd);
 
-        writen(sess->data_fd, buf, strlen(buf));
+    int ret = list_out_flush(&out);
+    if (out.capture != NULL) {
+        if (ret) {
+            dircache_fill_commit(&fill, out.capture, out.capture_len);
+        }
+        free(out.capture);
     }
-    closedir(dir);
-    return 1;
+    return ret;
 }
 
-void limit_rate(session_t *sess, int byte_transfered, int is_upload) {
-    sess->data_process = 1;
-
-    // 睡眠时间 = (当前传输速度 / 最大传输速度 – 1) * 当前传输时间;
-    long cur_sec = get_time_sec();
-    long cur_usec = get_time_usec();
-
-    double elapsed;
-    elapsed = (double)(cur_sec - sess->bw_transfer_start_sec); 
-    elapsed += (double)(cur_usec - sess->bw_transfer_start_usec) / (double)1000000;
-    if (elapsed <= (double)0) {
-        elapsed = (double)0.01;
+/**
+ * 每次传输开始时重置会话自己的令牌桶，并登记到共享的聚合令牌桶
+ */
+static void rate_start(session_t *sess) {
+    static int registered = 0;
+    if ( ! registered) {
+        // 传输中途因超时等原因退出进程时，同样要让出聚合限速的份额
+        atexit(rate_exit);
+        registered = 1;
     }
 
-    // 计算当前传输速度
-    unsigned int bw_rate = (unsigned int)((double)byte_transfered / elapsed);
+    ratelimit_init(&sess->bw_upload_bucket, sess->bw_upload_rate_max, tunable_rate_burst);
+    ratelimit_init(&sess->bw_download_bucket, sess->bw_download_rate_max, tunable_rate_burst);
+    bwshare_start(&sess->bw_share, sess->client_ip, sess->uid);
+}
 
-    double rate_ratio;
-    if (is_upload) {
-        if (bw_rate <= sess->bw_upload_rate_max) {
-            // 不需要限速
-            sess->bw_transfer_start_sec = cur_sec;
-            sess->bw_transfer_start_usec = cur_usec;
-            return;
-        }
-        rate_ratio = bw_rate / sess->bw_upload_rate_max;
-    } else {
-        if (bw_rate <= sess->bw_download_rate_max) {
-            // 不需要限速
-            sess->bw_transfer_start_sec = cur_sec;
-            sess->bw_transfer_start_usec = cur_usec;
-            return;
-        }
-        rate_ratio = bw_rate / sess->bw_download_rate_max;
+static void rate_stop(session_t *sess) {
+    bwshare_stop(&sess->bw_share);
+}
+
+static void rate_exit(void) {
+    if (p_sess != NULL) {
+        rate_stop(p_sess);
     }
+}
 
-    // 睡眠时间
-    double pause_time = (rate_ratio - (double)1) * elapsed;
+// 是否需要限速，不限速时可以按最大的分块传输
+static int rate_limited(session_t *sess, int is_upload) {
+    unsigned int rate_max = is_upload ? sess->bw_upload_rate_max : sess->bw_download_rate_max;
+    return rate_max > 0 || sess->bw_share.active;
+}
 
-    nano_sleep(pause_time);
+/**
+ * 申请本次传输的字节数，令牌不足时先等待，返回值不超过 want
+ * 先受会话自身的限速约束，再受全局、每 IP、每用户的聚合限速约束
+ */
+static size_t rate_grant(session_t *sess, size_t want, int is_upload) {
+    size_t n = ratelimit_grant(is_upload ? &sess->bw_upload_bucket : &sess->bw_download_bucket, want);
+    return bwshare_grant(&sess->bw_share, n);
+}
 
-    sess->bw_transfer_start_sec = get_time_sec();
-    sess->bw_transfer_start_usec = get_time_usec();
+/**
+ * 扣除实际传输的字节数，同时告知数据连接闹钟传输仍在进行
+ */
+static void rate_consume(session_t *sess, size_t used, int is_upload) {
+    sess->data_process = 1;
+    ratelimit_consume(is_upload ? &sess->bw_upload_bucket : &sess->bw_download_bucket, used);
+    bwshare_consume(&sess->bw_share, used);
 }
 
 void upload_common(session_t *sess, int is_append) {
@@ -321,6 +647,7 @@ void upload_common(session_t *sess, int is_append) {
     // 打开文件
     int fd = open(sess->arg, O_CREAT | O_WRONLY, 0666);
     if (fd == -1) {
+        data_close(sess, 0);
         ftp_reply(sess, FTP_UPLOADFAIL, "Could not create file.");
         return;
     }
@@ -328,6 +655,8 @@ void upload_common(session_t *sess, int is_append) {
     // 加写锁
     int ret = lock_file_write(fd);
     if (ret == -1) {
+        close(fd);
+        data_close(sess, 0);
         ftp_reply(sess, FTP_UPLOADFAIL, "Could not create file.");
         return;
     }
@@ -338,12 +667,16 @@ void upload_common(session_t *sess, int is_append) {
             // STOR
             ftruncate(fd, 0);
             if (lseek(fd, 0, SEEK_SET) < 0) {
+                close(fd);
+                data_close(sess, 0);
                 ftp_reply(sess, FTP_UPLOADFAIL, "Could not create file.");
                 return;
             }
         } else {
             // REST + STOR
             if (lseek(fd, offset, SEEK_SET) < 0) {
+                close(fd);
+                data_close(sess, 0);
                 ftp_reply(sess, FTP_UPLOADFAIL, "Could not create file.");
                 return;
             }
@@ -351,154 +684,1570 @@ void upload_common(session_t *sess, int is_append) {
     } else {
         // APPE
         if (lseek(fd, offset, SEEK_END) < 0) {
+            close(fd);
+            data_close(sess, 0);
             ftp_reply(sess, FTP_UPLOADFAIL, "Could not create file.");
             return;
         }
     }
 
-    struct stat sbuf;
-    ret = fstat(fd, &sbuf);
-    if ( ! S_ISREG(sbuf.st_mode)) {
-        ftp_reply(sess, FTP_UPLOADFAIL, "Could not create file.");
-        return;
+    struct stat sbuf;
+    ret = fstat(fd, &sbuf);
+    if (ret == -1 || ! S_ISREG(sbuf.st_mode)) {
+        close(fd);
+        data_close(sess, 0);
+        ftp_reply(sess, FTP_UPLOADFAIL, "Could not create file.");
+        return;
+    }
+
+    // 150
+    char text[1024] = {0};
+    if (sess->is_ascii) {
+        sprintf(text, "Opening ASCII mode data connection for %s (%lld bytes).",
+            sess->arg, (long long)sbuf.st_size);
+    } else {
+        sprintf(text, "Opening BINARY mode data connection for %s (%lld bytes).",
+            sess->arg, (long long)sbuf.st_size);
+    }
+
+    ftp_reply(sess, FTP_DATACONN, text);
+
+    // 上传文件
+    int flag = 0;
+    char buf[1024] = {0};
+
+    rate_start(sess);
+
+    // 块模式需要逐块解析块头，MODE Z 需要解压；否则依次尝试 io_uring、splice，最后回退到 read/write
+    int done = 0;
+    uring_t *ring = sess->is_block_mode || sess->is_deflate_mode ? NULL : get_data_uring(sess);
+    if (sess->is_block_mode) {
+        flag = upload_block(sess, fd);
+        done = 1;
+    } else if (sess->is_deflate_mode) {
+        flag = upload_zmode(sess, fd);
+        done = 1;
+    } else if (ring != NULL) {
+        flag = upload_uring(sess, ring, fd);
+        done = 1;
+    } else if ( ! sess->is_ascii) {
+        flag = upload_splice(sess, fd);
+        done = flag != -1;
+        if ( ! done) {
+            flag = 0;
+        }
+    }
+
+    while ( ! done) {
+        ret = read(sess->data_fd, buf, rate_grant(sess, sizeof(buf), 1));
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else {
+                flag = 2;
+                break;
+            }
+        } else if (ret == 0) {
+            flag = 0;
+            break;
+        }
+
+        rate_consume(sess, ret, 1);
+        if (sess->abor_received) {
+            flag = 2;
+            break;
+        }
+
+        if (writen(fd, buf, ret) != ret) {
+            flag = 1;
+            break;
+        }
+    }
+
+    // 关闭套接字，块模式下传输成功时保留
+    data_close(sess, flag == 0);
+
+    close(fd);
+    rate_stop(sess);
+
+    if (flag == 0 && ! sess->abor_received) {
+        // 226
+        ftp_reply(sess, FTP_TRANSFEROK, "Transfer complete.");
+    } else if (flag == 1) {
+        // 426
+        ftp_reply(sess, FTP_BADSENDFILE, "Failure writting to local file.");
+    } else if (flag == 2) {
+        // 451
+        ftp_reply(sess, FTP_BADSENDNET, "Failure reading from network stream.");
+    }
+
+    check_abor(sess);
+    // 重新开启控制连接通道闹钟
+    start_cmdio_alarm();
+}
+
+// 取得会话的 io_uring 实例，未启用或内核不支持时返回 NULL
+static uring_t* get_data_uring(session_t *sess) {
+    if ( ! tunable_io_uring_enable || sess->data_uring_failed) {
+        return NULL;
+    }
+    if (sess->data_uring == NULL) {
+        sess->data_uring = uring_create(1);
+        if (sess->data_uring == NULL) {
+            sess->data_uring_failed = 1;
+        }
+    }
+    return sess->data_uring;
+}
+
+// 取得目录列表并发 statx 使用的 io_uring 实例，不需要传输缓冲区
+// list_stat_parallel 小于 2 或内核不支持时返回 NULL，逐个 statx
+static uring_t* get_stat_uring(session_t *sess) {
+    if (tunable_list_stat_parallel < 2 || sess->stat_uring_failed) {
+        return NULL;
+    }
+    if (sess->stat_uring == NULL) {
+        sess->stat_uring = uring_create(0);
+        if (sess->stat_uring == NULL) {
+            sess->stat_uring_failed = 1;
+        }
+    }
+    return sess->stat_uring;
+}
+
+static void list_out_init(list_out_t *out, session_t *sess) {
+    out->sess = sess;
+    // 块模式下每批数据前要加块头，MODE Z 下要先压缩，都同步发送
+    out->ring = sess->is_block_mode || sess->is_deflate_mode ? NULL : get_data_uring(sess);
+    out->buf = out->ring != NULL ? out->ring->bufs[0] : out->batch;
+    out->cur = 0;
+    out->len = 0;
+    out->inflight = 0;
+    out->failed = 0;
+    out->capture = NULL;
+    out->capture_len = 0;
+    out->capture_size = 0;
+    if (sess->is_deflate_mode && zmode_deflate_begin(sess, zmode_level()) < 0) {
+        out->failed = 1;
+    }
+}
+
+// 在当前缓冲区中预留 need 字节并返回写入位置，剩余空间不足时先发送已积累的数据
+static char* list_out_reserve(list_out_t *out, int need) {
+    if (out->len + need > LIST_BATCH_SIZE) {
+        list_out_send(out);
+    }
+    return out->buf + out->len;
+}
+
+// 确认已在预留位置写入 len 字节
+static void list_out_commit(list_out_t *out, int len) {
+    if (out->capture != NULL) {
+        list_out_capture(out, out->buf + out->len, len);
+    }
+    out->len += len;
+}
+
+static void list_out_write(list_out_t *out, const char *buf, int len) {
+    // 从缓存取出的整个列表可能超过一批
+    while (len > 0) {
+        int n = len > LIST_BATCH_SIZE ? LIST_BATCH_SIZE : len;
+        memcpy(list_out_reserve(out, n), buf, n);
+        list_out_commit(out, n);
+        buf += n;
+        len -= n;
+    }
+}
+
+// 发送当前缓冲区，出错后只丢弃数据，由 list_out_flush 报告失败
+static void list_out_send(list_out_t *out) {
+    if (out->len == 0 || out->failed) {
+        out->len = 0;
+        return;
+    }
+    if (out->sess->is_block_mode) {
+        if (block_write(out->sess->data_fd, 0, out->buf, out->len) < 0) {
+            out->failed = 1;
+        }
+        out->len = 0;
+        return;
+    }
+    if (out->sess->is_deflate_mode) {
+        if (zmode_send(out->sess, out->buf, out->len, Z_NO_FLUSH, 0) < 0) {
+            out->failed = 1;
+        }
+        out->len = 0;
+        return;
+    }
+    if (out->ring == NULL) {
+        if (writen(out->sess->data_fd, out->buf, out->len) != out->len) {
+            out->failed = 1;
+        }
+        out->len = 0;
+        return;
+    }
+
+    // 同一套接字上同时只有一个发送操作，保证数据顺序
+    // 等待上一个缓冲区发送完成时，下一个缓冲区可以继续填充
+    if (list_out_wait(out) < 0) {
+        out->len = 0;
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(out->ring);
+    uring_prep_rw(sqe, IORING_OP_SEND, out->sess->data_fd, out->buf, out->len, 0);
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->user_data = out->len;
+    uring_submit(out->ring);
+    out->inflight = 1;
+    out->cur = (out->cur + 1) % URING_NUM_BUFS;
+    out->buf = out->ring->bufs[out->cur];
+    out->len = 0;
+}
+
+static void list_out_capture(list_out_t *out, const char *buf, int len) {
+    if (out->capture_len + len > dircache_capacity()) {
+        free(out->capture);
+        out->capture = NULL;
+        return;
+    }
+    if (out->capture_len + len > out->capture_size) {
+        while (out->capture_len + len > out->capture_size) {
+            out->capture_size *= 2;
+        }
+        out->capture = (char *)realloc(out->capture, out->capture_size);
+    }
+    memcpy(out->capture + out->capture_len, buf, len);
+    out->capture_len += len;
+}
+
+// 等待已提交的发送完成
+static int list_out_wait(list_out_t *out) {
+    if (out->inflight) {
+        struct io_uring_cqe cqe;
+        out->inflight = 0;
+        if (uring_wait_cqe(out->ring, &cqe) < 0 || cqe.res != (int)cqe.user_data) {
+            out->failed = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 发送剩余数据，全部成功返回 1
+static int list_out_flush(list_out_t *out) {
+    if (out->sess->is_block_mode) {
+        // 剩余数据与文件结束标记放在同一个块中
+        if ( ! out->failed
+            && block_write(out->sess->data_fd, BLOCK_DESC_EOF, out->buf, out->len) < 0) {
+            out->failed = 1;
+        }
+        out->len = 0;
+        return ! out->failed;
+    }
+    if (out->sess->is_deflate_mode) {
+        // 剩余数据与压缩流的结尾一起发出
+        if ( ! out->failed
+            && zmode_send(out->sess, out->buf, out->len, Z_FINISH, 0) < 0) {
+            out->failed = 1;
+        }
+        out->len = 0;
+        return ! out->failed;
+    }
+    list_out_send(out);
+    if (out->ring != NULL && ! out->failed) {
+        list_out_wait(out);
+    }
+    return ! out->failed;
+}
+
+static void list_dents_init(list_dents_t *dents, int dirfd) {
+    dents->dirfd = dirfd;
+    dents->n = 0;
+    dents->off = 0;
+}
+
+// 取得下一个目录项的文件名，目录读完或出错时返回 NULL
+// 返回的文件名在下一次调用之前有效
+static const char* list_dents_next(list_dents_t *dents) {
+    while (1) {
+        if (dents->off >= dents->n) {
+            dents->n = syscall(SYS_getdents64, dents->dirfd, dents->buf, sizeof(dents->buf));
+            dents->off = 0;
+            if (dents->n <= 0) {
+                dents->n = 0;
+                return NULL;
+            }
+        }
+        struct linux_dirent64 *d = (struct linux_dirent64 *)(dents->buf + dents->off);
+        dents->off += d->d_reclen;
+        if (d->d_name[0] != '.') {
+            return d->d_name;
+        }
+    }
+}
+
+// 取得目录项的属性，失败时返回 -1
+// follow 非 0 时符号链接取其指向的文件，链接已失效时取链接本身
+static int list_statx(int dirfd, const char *name, int follow, struct statx *stx) {
+    int flags = AT_NO_AUTOMOUNT | (follow ? 0 : AT_SYMLINK_NOFOLLOW);
+    if (statx(dirfd, name, flags, LIST_STATX_MASK, stx) == 0) {
+        return 0;
+    }
+    if ( ! follow || errno != ENOENT) {
+        return -1;
+    }
+    return statx(dirfd, name, flags | AT_SYMLINK_NOFOLLOW, LIST_STATX_MASK, stx);
+}
+
+/**
+ * 遍历目录 dirfd，取得每个目录项的属性后交给 emit 输出，文件已不存在时跳过
+ * 配置了 list_stat_parallel 时通过 io_uring 同时发出多个 statx，
+ * 在 NFS、FUSE 等每次 stat 都要经过一次网络往返的文件系统上，各次等待可以重叠
+ */
+static void list_walk(list_out_t *out, int dirfd, int follow, list_emit_t emit, void *arg) {
+    list_dents_t dents;
+    list_dents_init(&dents, dirfd);
+
+    uring_t *ring = get_stat_uring(out->sess);
+    if (ring != NULL) {
+        list_walk_parallel(out, ring, &dents, follow, emit, arg);
+        return;
+    }
+
+    const char *name;
+    while ((name = list_dents_next(&dents)) != NULL) {
+        struct statx stx;
+        if (list_statx(dirfd, name, follow, &stx) == 0) {
+            emit(out, dirfd, name, &stx, arg);
+        }
+    }
+}
+
+/**
+ * 保持最多 list_stat_parallel 个 statx 同时进行，已取得属性的目录项立即输出，
+ * 输出批次满时数据连接开始发送，其余 statx 仍在内核中继续
+ * list_stat_ordered 为 YES 时 slots 按提交顺序循环使用，只输出队首连续完成的目录项，
+ * 保持与 readdir 相同的顺序；为 NO 时按完成顺序输出，慢的目录项不会阻塞后面的目录项
+ */
+static void list_walk_parallel(list_out_t *out, uring_t *ring, list_dents_t *dents,
+    int follow, list_emit_t emit, void *arg) {
+    int nslots = tunable_list_stat_parallel > LIST_STAT_MAX_PARALLEL ?
+        LIST_STAT_MAX_PARALLEL : (int)tunable_list_stat_parallel;
+    int ordered = tunable_list_stat_ordered;
+    int flags = AT_NO_AUTOMOUNT | (follow ? 0 : AT_SYMLINK_NOFOLLOW);
+
+    list_stat_slot_t *slots = (list_stat_slot_t *)malloc(nslots * sizeof(list_stat_slot_t));
+    int *free_slots = (int *)malloc(nslots * sizeof(int));
+    int nfree = 0;
+    int i;
+    for (i = nslots - 1; i >= 0; i--) {
+        slots[i].state = LIST_SLOT_FREE;
+        free_slots[nfree++] = i;
+    }
+
+    // 有序模式下 head 为下一个要输出的序号，tail 为下一个提交的序号
+    unsigned int head = 0;
+    unsigned int tail = 0;
+    int inflight = 0;
+    int eof = 0;
+    while (1) {
+        // 数据连接已出错时不再发出新的 statx，只等待已提交的完成
+        while ( ! eof && ! out->failed) {
+            if (ordered ? tail - head >= (unsigned int)nslots : nfree == 0) {
+                break;
+            }
+            const char *name = list_dents_next(dents);
+            if (name == NULL) {
+                eof = 1;
+                break;
+            }
+            int idx = ordered ? (int)(tail % nslots) : free_slots[--nfree];
+            list_stat_slot_t *slot = &slots[idx];
+            strcpy(slot->name, name);
+            slot->state = LIST_SLOT_PENDING;
+
+            // 同时进行的 statx 不超过提交队列的长度，总能取得提交项
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            uring_prep_statx(sqe, dents->dirfd, slot->name, flags, LIST_STATX_MASK, &slot->stx);
+            sqe->user_data = idx;
+            tail++;
+            inflight++;
+        }
+        if (inflight == 0) {
+            break;
+        }
+
+        struct io_uring_cqe cqe;
+        if (uring_wait_cqe(ring, &cqe) < 0) {
+            // 内核可能仍在写入 slots，不能释放
+            out->failed = 1;
+            free(free_slots);
+            return;
+        }
+        inflight--;
+        list_stat_slot_t *slot = &slots[cqe.user_data];
+        slot->res = cqe.res;
+        if (slot->res == -ENOENT && follow) {
+            // 失效的符号链接，与逐个 statx 时一样取链接本身
+            slot->res = list_statx(dents->dirfd, slot->name, 0, &slot->stx);
+        }
+        slot->state = LIST_SLOT_DONE;
+
+        if ( ! ordered) {
+            if (slot->res == 0) {
+                emit(out, dents->dirfd, slot->name, &slot->stx, arg);
+            }
+            slot->state = LIST_SLOT_FREE;
+            free_slots[nfree++] = cqe.user_data;
+            continue;
+        }
+        while (head != tail && slots[head % nslots].state == LIST_SLOT_DONE) {
+            slot = &slots[head % nslots];
+            if (slot->res == 0) {
+                emit(out, dents->dirfd, slot->name, &slot->stx, arg);
+            }
+            slot->state = LIST_SLOT_FREE;
+            head++;
+        }
+    }
+
+    free(free_slots);
+    free(slots);
+}
+
+/**
+ * 以 ls -l 的格式输出一个目录项
+ * 格式为：权限 链接数 uid gid 大小 时间 文件名[ -> 链接目标]
+ */
+static void list_emit_line(list_out_t *out, int dirfd, const char *name,
+    const struct statx *stx, void *arg) {
+    date_clock_t *clk = (date_clock_t *)arg;
+    char *start = list_out_reserve(out, LIST_LINE_MAX);
+    char *p = statbuf_format_perms(start, stx->stx_mode);
+    *p++ = ' ';
+    p = format_uint(p, stx->stx_nlink, 3, 0);
+    *p++ = ' ';
+    p = format_uint(p, stx->stx_uid, 8, 1);
+    *p++ = ' ';
+    p = format_uint(p, stx->stx_gid, 8, 1);
+    *p++ = ' ';
+    p = format_uint(p, stx->stx_size, 8, 0);
+    *p++ = ' ';
+    p = statbuf_format_date(p, clk, stx->stx_mtime.tv_sec);
+    *p++ = ' ';
+    int len = strlen(name);
+    memcpy(p, name, len);
+    p += len;
+    if (S_ISLNK(stx->stx_mode)) {
+        memcpy(p, " -> ", 4);
+        p += 4;
+        ssize_t n = readlinkat(dirfd, name, p, PATH_MAX);
+        if (n > 0) {
+            p += n;
+        }
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    list_out_commit(out, p - start);
+}
+
+// 一行 MLSD 输出中事实部分的上限
+#define MLSX_FACTS_MAX          192
+
+static void mlsx_ctx_init(mlsx_ctx_t *ctx, const char *dir) {
+    ctx->uid = geteuid();
+    ctx->gid = getegid();
+    ctx->ngroups = getgroups(0, NULL);
+    if (ctx->ngroups < 0) {
+        ctx->ngroups = 0;
+    }
+    ctx->groups = (gid_t *)malloc((ctx->ngroups + 1) * sizeof(gid_t));
+    ctx->ngroups = getgroups(ctx->ngroups, ctx->groups);
+    if (ctx->ngroups < 0) {
+        ctx->ngroups = 0;
+    }
+    // 会话只切换了有效用户，须按有效用户检查
+    ctx->dir_writable = faccessat(AT_FDCWD, dir, W_OK | X_OK, AT_EACCESS) == 0;
+}
+
+static void mlsx_ctx_free(mlsx_ctx_t *ctx) {
+    free(ctx->groups);
+}
+
+/**
+ * 按权限位判断会话对文件是否具有 mask 表示的权限（4 读、2 写、1 执行）
+ * 与内核一样依次匹配属主、属组与其他用户，不额外调用系统调用
+ */
+static int mlsx_access(mlsx_ctx_t *ctx, const struct statx *stx, int mask) {
+    if (ctx->uid == 0) {
+        return 1;
+    }
+    int bits;
+    if (stx->stx_uid == ctx->uid) {
+        bits = stx->stx_mode >> 6;
+    } else {
+        int in_group = stx->stx_gid == ctx->gid;
+        int i;
+        for (i = 0; i < ctx->ngroups && ! in_group; i++) {
+            in_group = stx->stx_gid == ctx->groups[i];
+        }
+        bits = in_group ? stx->stx_mode >> 3 : stx->stx_mode;
+    }
+    return (bits & mask) == mask;
+}
+
+/**
+ * 写出 RFC 3659 的事实列表，以 "; " 结尾，之后紧跟文件名
+ * type=file|dir|OS.unix=slink;size=;modify=YYYYMMDDHHMMSS;perm=;unique=
+ */
+static char* mlsx_format_facts(char *p, const struct statx *stx, mlsx_ctx_t *ctx) {
+    memcpy(p, "type=", 5);
+    p += 5;
+    const char *type = "file";
+    if (S_ISDIR(stx->stx_mode)) {
+        type = "dir";
+    } else if (S_ISLNK(stx->stx_mode)) {
+        type = "OS.unix=slink";
+    } else if ( ! S_ISREG(stx->stx_mode)) {
+        type = "OS.unix=special";
+    }
+    int len = strlen(type);
+    memcpy(p, type, len);
+    p += len;
+
+    memcpy(p, ";size=", 6);
+    p = format_uint(p + 6, stx->stx_size, 0, 0);
+
+    memcpy(p, ";modify=", 8);
+    p += 8;
+    time_t mtime = stx->stx_mtime.tv_sec;
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    int fields[6] = {tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec};
+    int i;
+    for (i = 0; i < 6; i++) {
+        if (i == 0) {
+            p = format_uint(p, fields[i], 4, 0);
+        } else {
+            *p++ = '0' + fields[i] / 10;
+            *p++ = '0' + fields[i] % 10;
+        }
+    }
+
+    // perm 表示本会话能对该条目执行的操作
+    memcpy(p, ";perm=", 6);
+    p += 6;
+    if (S_ISDIR(stx->stx_mode)) {
+        if (mlsx_access(ctx, stx, 1)) {
+            *p++ = 'e';
+        }
+        if (mlsx_access(ctx, stx, 4 | 1)) {
+            *p++ = 'l';
+        }
+        if (mlsx_access(ctx, stx, 2 | 1)) {
+            *p++ = 'c';
+            *p++ = 'm';
+            *p++ = 'p';
+        }
+    } else if (S_ISREG(stx->stx_mode)) {
+        if (mlsx_access(ctx, stx, 4)) {
+            *p++ = 'r';
+        }
+        if (mlsx_access(ctx, stx, 2)) {
+            *p++ = 'a';
+            *p++ = 'w';
+        }
+    }
+    if (ctx->dir_writable) {
+        *p++ = 'd';
+        *p++ = 'f';
+    }
+
+    memcpy(p, ";unique=", 8);
+    p = format_hex(p + 8, makedev(stx->stx_dev_major, stx->stx_dev_minor));
+    *p++ = 'g';
+    p = format_hex(p, stx->stx_ino);
+    *p++ = ';';
+    *p++ = ' ';
+    return p;
+}
+
+/**
+ * 以 MLSD 格式输出目录 dirfd 的内容，与 LIST 一样按批发送
+ * perm 事实与会话用户有关，因此不使用共享的目录列表缓存
+ */
+static int mlsd_common(session_t *sess, int dirfd, const char *path) {
+    mlsx_ctx_t ctx;
+    mlsx_ctx_init(&ctx, path);
+
+    list_out_t out;
+    list_out_init(&out, sess);
+    list_walk(&out, dirfd, 1, mlsd_emit, &ctx);
+
+    mlsx_ctx_free(&ctx);
+    return list_out_flush(&out);
+}
+
+static void mlsd_emit(list_out_t *out, int dirfd, const char *name,
+    const struct statx *stx, void *arg) {
+    int len = strlen(name);
+    char *start = list_out_reserve(out, MLSX_FACTS_MAX + len + 2);
+    char *p = mlsx_format_facts(start, stx, (mlsx_ctx_t *)arg);
+    memcpy(p, name, len);
+    p += len;
+    *p++ = '\r';
+    *p++ = '\n';
+    list_out_commit(out, p - start);
+}
+
+#define SPLICE_PIPE_SIZE        (1024 * 1024)
+#define URING_SPLICE_BATCH      4
+
+/**
+ * 创建 splice 使用的管道，并尽量扩大其容量
+ * 成功返回管道容量，失败返回 -1
+ */
+static int splice_pipe_open(int pipefd[2]) {
+    if (pipe(pipefd) < 0) {
+        return -1;
+    }
+    int pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (pipe_size < 0) {
+        pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    }
+    return pipe_size;
+}
+
+/**
+ * 用 io_uring 的 splice 链发送文件：文件 -> 管道 -> 套接字
+ * 每次提交一条由多个分块组成的链，链中的操作按顺序执行
+ * 返回值与 do_retr 中的 flag 含义相同
+ */
+static int retr_uring(session_t *sess, uring_t *ring, int fd, long long offset,
+    long long bytes) {
+    int pipefd[2];
+    int pipe_size = splice_pipe_open(pipefd);
+    if (pipe_size < 0) {
+        return 1;
+    }
+
+    int flag = 0;
+    while (bytes > 0 && flag == 0) {
+        // 偏移量不按页对齐时数据会多占一个页，分块取管道容量的一半以免写不满
+        long long chunk = pipe_size / 2;
+        int nchunks = URING_SPLICE_BATCH;
+        if (rate_limited(sess, 0)) {
+            // 限速时每次只发送一个分块，大小由令牌桶决定
+            chunk = rate_grant(sess, bytes > chunk ? chunk : bytes, 0);
+            nchunks = 1;
+        }
+
+        // user_data 的最低位区分链中的两端：0 为文件端，1 为套接字端
+        struct io_uring_sqe *sqe = NULL;
+        long long queued = 0;
+        int nsqes = 0;
+        int i;
+        for (i = 0; i < nchunks && queued < bytes; i++) {
+            unsigned int len = bytes - queued > chunk ? chunk : bytes - queued;
+            sqe = uring_get_sqe(ring);
+            uring_prep_splice(sqe, fd, offset + queued, pipefd[1], -1, len);
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe->user_data = (unsigned long long)len << 1;
+
+            sqe = uring_get_sqe(ring);
+            uring_prep_splice(sqe, pipefd[0], -1, sess->data_fd, -1, len);
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe->user_data = ((unsigned long long)len << 1) | 1;
+
+            queued += len;
+            nsqes += 2;
+        }
+        sqe->flags &= ~IOSQE_IO_LINK;
+
+        // 链中任何一步出错或不完整，后续操作会以 -ECANCELED 完成
+        long long sent = 0;
+        for (i = 0; i < nsqes; i++) {
+            struct io_uring_cqe cqe;
+            if (uring_wait_cqe(ring, &cqe) < 0) {
+                flag = 2;
+                break;
+            }
+            int is_sock = cqe.user_data & 1;
+            int expected = cqe.user_data >> 1;
+            if (cqe.res != expected) {
+                if (flag == 0) {
+                    flag = is_sock ? 2 : 1;
+                }
+                continue;
+            }
+            if (is_sock) {
+                sent += cqe.res;
+            }
+        }
+
+        rate_consume(sess, sent, 0);
+        offset += sent;
+        bytes -= sent;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return flag;
+}
+
+/**
+ * 用 io_uring 接收上传的文件
+ * 同一时刻只有一个套接字读操作，保证数据顺序；读完成后立即提交写文件操作，
+ * 并用另一个缓冲区发起下一次读，磁盘写入与网络接收重叠进行
+ * 返回值与 upload_common 中的 flag 含义相同
+ */
+static int upload_uring(session_t *sess, uring_t *ring, int fd) {
+    long long pos = lseek(fd, 0, SEEK_CUR);
+    int busy[URING_NUM_BUFS] = {0};
+    int reading = 0;
+    int writing = 0;
+    int flag = 0;
+    int eof = 0;
+    int idx = 0;
+
+    // user_data：高位为长度，第 8 位表示写操作，低 8 位为缓冲区下标
+    int read_op = ring->bufs_registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    int write_op = ring->bufs_registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+
+    while (1) {
+        if ( ! reading && ! eof && flag == 0 && ! busy[idx]) {
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            uring_prep_rw(sqe, read_op, sess->data_fd, ring->bufs[idx],
+                rate_grant(sess, URING_BUF_SIZE, 1), (unsigned long long)-1);
+            sqe->buf_index = idx;
+            sqe->user_data = idx;
+            busy[idx] = 1;
+            reading = 1;
+        }
+        if ( ! reading && ! writing) {
+            break;
+        }
+
+        struct io_uring_cqe cqe;
+        if (uring_wait_cqe(ring, &cqe) < 0) {
+            // io_uring 本身出错，没有办法再等待其余操作完成
+            sess->data_uring_failed = 1;
+            return 2;
+        }
+        int i = cqe.user_data & 0xFF;
+        if (cqe.user_data & 0x100) {
+            writing--;
+            busy[i] = 0;
+            if (cqe.res != (int)(cqe.user_data >> 16) && flag == 0) {
+                flag = 1;
+            }
+            continue;
+        }
+
+        reading = 0;
+        if (cqe.res < 0) {
+            busy[i] = 0;
+            if (flag == 0) {
+                flag = 2;
+            }
+            continue;
+        } else if (cqe.res == 0) {
+            busy[i] = 0;
+            eof = 1;
+            continue;
+        }
+
+        rate_consume(sess, cqe.res, 1);
+        if (sess->abor_received) {
+            busy[i] = 0;
+            flag = 2;
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        uring_prep_rw(sqe, write_op, fd, ring->bufs[i], cqe.res, pos);
+        sqe->buf_index = i;
+        sqe->user_data = ((unsigned long long)cqe.res << 16) | 0x100 | i;
+        pos += cqe.res;
+        writing++;
+        idx = (i + 1) % URING_NUM_BUFS;
+    }
+
+    return flag;
+}
+
+#define RETR_MIN_CHUNK      (256 * 1024)
+#define RETR_MAX_CHUNK      (8 * 1024 * 1024)
+#define RETR_SNDBUF_FACTOR  8
+
+/**
+ * 确定 do_retr 每次调用 sendfile 发送的字节数上限
+ * 取套接字发送缓冲区的若干倍，既减少系统调用次数，又让每次调用能在合理的时间内返回；
+ * 限速时实际发送的字节数再由令牌桶裁剪
+ */
+static size_t retr_chunk_size(session_t *sess) {
+    int sndbuf = 0;
+    socklen_t len = sizeof(sndbuf);
+    if (getsockopt(sess->data_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0) {
+        sndbuf = 0;
+    }
+    size_t chunk = (size_t)sndbuf * RETR_SNDBUF_FACTOR;
+    if (chunk < RETR_MIN_CHUNK) {
+        chunk = RETR_MIN_CHUNK;
+    } else if (chunk > RETR_MAX_CHUNK) {
+        chunk = RETR_MAX_CHUNK;
+    }
+    return chunk;
+}
+
+/**
+ * 用 sendfile 发送文件中从 offset 开始的 bytes 字节
+ * 使用显式的 64 位偏移量，不依赖文件位置，REST 超过 2GB 同样有效
+ * 返回值与 do_retr 中的 flag 含义相同
+ */
+static int retr_sendfile(session_t *sess, int fd, long long offset, long long bytes) {
+    off_t pos = offset;
+    size_t chunk = retr_chunk_size(sess);
+    while (bytes > 0) {
+        size_t num_this_time = rate_grant(sess, bytes > (long long)chunk ? chunk : bytes, 0);
+        ssize_t n = sendfile(sess->data_fd, fd, &pos, num_this_time);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 2;
+        } else if (n == 0) {
+            // 文件在传输过程中被截短
+            return 1;
+        }
+        rate_consume(sess, n, 0);
+        bytes -= n;
+    }
+    return 0;
+}
+
+/**
+ * 以 splice 零拷贝接收上传数据：套接字 -> 管道 -> 文件
+ * 数据不经过用户空间，写入位置由显式偏移量决定，REST 与 APPE 同样适用
+ * 返回值与 upload_common 中的 flag 含义相同，
+ * 套接字不支持 splice 时返回 -1，由调用者回退到 read/write
+ */
+static int upload_splice(session_t *sess, int fd) {
+    int pipefd[2];
+    int pipe_size = splice_pipe_open(pipefd);
+    if (pipe_size < 0) {
+        return -1;
+    }
+
+    loff_t pos = lseek(fd, 0, SEEK_CUR);
+    int flag = 0;
+    int first = 1;
+    while (1) {
+        size_t chunk = rate_grant(sess, pipe_size, 1);
+
+        ssize_t n = splice(sess->data_fd, NULL, pipefd[1], NULL, chunk,
+            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (first && errno == EINVAL) {
+                flag = -1;
+            } else {
+                flag = 2;
+            }
+            break;
+        } else if (n == 0) {
+            flag = 0;
+            break;
+        }
+        first = 0;
+
+        rate_consume(sess, n, 1);
+        if (sess->abor_received) {
+            flag = 2;
+            break;
+        }
+
+        // 把管道中的数据全部写入文件
+        while (n > 0) {
+            ssize_t w = splice(pipefd[0], NULL, fd, &pos, n, SPLICE_F_MOVE);
+            if (w == -1 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                flag = 1;
+                break;
+            }
+            n -= w;
+        }
+        if (flag != 0) {
+            break;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return flag;
+}
+
+// 发送 MODE B 的块头，后面还有数据时与数据合并成同一个报文段
+static int block_send_header(int fd, int desc, size_t len) {
+    unsigned char hdr[BLOCK_HEADER_SIZE] = {desc, len >> 8, len & 0xFF};
+    size_t off = 0;
+    while (off < sizeof(hdr)) {
+        ssize_t n = send(fd, hdr + off, sizeof(hdr) - off, len > 0 ? MSG_MORE : 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+/**
+ * 以 MODE B 的块发送一段数据，超过块的长度上限时拆成多个块
+ * desc 只加在最后一个块上，len 为 0 时发送一个没有数据的块
+ * 成功返回 0，失败返回 -1
+ */
+static int block_write(int fd, int desc, const char *buf, size_t len) {
+    do {
+        size_t n = len > BLOCK_MAX_DATA ? BLOCK_MAX_DATA : len;
+        if (block_send_header(fd, n == len ? desc : 0, n) < 0
+            || writen(fd, buf, n) != (ssize_t)n) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    } while (len > 0);
+    return 0;
+}
+
+/**
+ * 以 MODE B 发送文件：每个块先发送块头，块中的数据仍由 sendfile 发送
+ * 最后一个块带文件结束标记，空文件只发送一个空的结束块
+ * 返回值与 do_retr 中的 flag 含义相同
+ */
+static int retr_block(session_t *sess, int fd, long long offset, long long bytes) {
+    off_t pos = offset;
+    do {
+        size_t len = rate_grant(sess, bytes > BLOCK_MAX_DATA ? BLOCK_MAX_DATA : bytes, 0);
+        if (block_send_header(sess->data_fd, len == bytes ? BLOCK_DESC_EOF : 0, len) < 0) {
+            return 2;
+        }
+        // 块头已声明了长度，没有发完时数据连接不能再使用，由调用者关闭
+        size_t left = len;
+        while (left > 0) {
+            ssize_t n = sendfile(sess->data_fd, fd, &pos, left);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return 2;
+            } else if (n == 0) {
+                // 文件在传输过程中被截短
+                return 1;
+            }
+            left -= n;
+        }
+        rate_consume(sess, len, 0);
+        bytes -= len;
+    } while (bytes > 0);
+    return 0;
+}
+
+/**
+ * 以 MODE B 接收上传的文件，直到收到带文件结束标记的块
+ * 重启标记块中的数据不属于文件，直接丢弃；文件结构下记录结束标记没有意义，忽略
+ * 返回值与 upload_common 中的 flag 含义相同
+ */
+static int upload_block(session_t *sess, int fd) {
+    char buf[BLOCK_MAX_DATA];
+    while (1) {
+        unsigned char hdr[BLOCK_HEADER_SIZE];
+        if (readn(sess->data_fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+            // 没有收到结束标记之前数据连接就已关闭
+            return 2;
+        }
+        size_t count = ((size_t)hdr[1] << 8) | hdr[2];
+        while (count > 0) {
+            ssize_t n = read(sess->data_fd, buf, rate_grant(sess, count, 1));
+            if (n == -1 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                return 2;
+            }
+
+            rate_consume(sess, n, 1);
+            if (sess->abor_received) {
+                return 2;
+            }
+            if ( ! (hdr[0] & BLOCK_DESC_RESTART) && writen(fd, buf, n) != n) {
+                return 1;
+            }
+            count -= n;
+        }
+        if (hdr[0] & BLOCK_DESC_EOF) {
+            return 0;
+        }
+    }
+}
+
+// 压缩流的输入与输出缓冲区在会话中只分配一次
+static int zmode_buf_alloc(session_t *sess) {
+    if (sess->zbuf == NULL) {
+        sess->zbuf = (char *)malloc(2 * ZBUF_SIZE);
+    }
+    return sess->zbuf != NULL ? 0 : -1;
+}
+
+/**
+ * 为一次 MODE Z 发送准备压缩流
+ * 压缩流的内部状态有数百 KB，首次使用时创建，之后只重置并调整压缩级别
+ * 成功返回 0，失败返回 -1
+ */
+static int zmode_deflate_begin(session_t *sess, int level) {
+    if (zmode_buf_alloc(sess) < 0) {
+        return -1;
+    }
+    if (sess->zdeflate == NULL) {
+        z_stream *z = (z_stream *)calloc(1, sizeof(z_stream));
+        if (z == NULL || deflateInit(z, level) != Z_OK) {
+            free(z);
+            return -1;
+        }
+        sess->zdeflate = z;
+        return 0;
+    }
+    if (deflateReset(sess->zdeflate) != Z_OK
+        || deflateParams(sess->zdeflate, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+// 为一次 MODE Z 上传准备解压流，失败返回 NULL
+static z_stream* zmode_inflate_begin(session_t *sess) {
+    if (zmode_buf_alloc(sess) < 0) {
+        return NULL;
+    }
+    if (sess->zinflate == NULL) {
+        z_stream *z = (z_stream *)calloc(1, sizeof(z_stream));
+        if (z == NULL || inflateInit(z) != Z_OK) {
+            free(z);
+            return NULL;
+        }
+        sess->zinflate = z;
+    } else if (inflateReset(sess->zinflate) != Z_OK) {
+        return NULL;
+    }
+    return sess->zinflate;
+}
+
+static int zmode_level(void) {
+    return tunable_deflate_level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : (int)tunable_deflate_level;
+}
+
+/**
+ * 判断文件是否已经压缩过，按扩展名或文件开头的特征字节识别
+ * 这类文件再压缩几乎不会变小，以不压缩的存储块发送，不浪费 CPU
+ */
+static int zmode_stored(const char *name, int fd) {
+    static const char *exts[] = {
+        ".gz", ".tgz", ".bz2", ".tbz2", ".xz", ".txz", ".zst", ".lz4", ".lzma", ".z",
+        ".zip", ".jar", ".7z", ".rar", ".deb", ".rpm",
+        ".jpg", ".jpeg", ".png", ".gif", ".webp", ".mp3", ".mp4", ".mkv", ".avi", ".mov",
+        ".ogg", ".flac", NULL
+    };
+    static const struct {
+        const char *magic;
+        int len;
+    } magics[] = {
+        { "\x1f\x8b", 2 },              // gzip
+        { "BZh", 3 },                   // bzip2
+        { "\xfd" "7zXZ", 5 },           // xz
+        { "\x28\xb5\x2f\xfd", 4 },      // zstd
+        { "\x04\x22\x4d\x18", 4 },      // lz4
+        { "PK\x03\x04", 4 },            // zip
+        { "7z\xbc\xaf\x27\x1c", 6 },    // 7z
+        { "Rar!\x1a\x07", 6 },          // rar
+        { "\x89PNG", 4 },               // png
+        { "\xff\xd8\xff", 3 },          // jpeg
+        { "GIF8", 4 },                  // gif
+        { NULL, 0 }
+    };
+
+    const char *dot = strrchr(name, '.');
+    if (dot != NULL && strchr(dot, '/') == NULL) {
+        int i;
+        for (i = 0; exts[i] != NULL; i++) {
+            if (strcasecmp(dot, exts[i]) == 0) {
+                return 1;
+            }
+        }
+    }
+
+    unsigned char head[8];
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    int i;
+    for (i = 0; magics[i].magic != NULL; i++) {
+        if (n >= magics[i].len && memcmp(head, magics[i].magic, magics[i].len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 压缩一段数据并把产生的输出发送到数据连接，flush 为 Z_FINISH 时结束压缩流
+ * limited 为真时按下载限速发送，限速针对的是实际发送的压缩后的字节数
+ * 成功返回 0，失败返回 -1
+ */
+static int zmode_send(session_t *sess, const char *buf, size_t len, int flush, int limited) {
+    z_stream *z = sess->zdeflate;
+    char *out = sess->zbuf + ZBUF_SIZE;
+    z->next_in = (Bytef *)buf;
+    z->avail_in = len;
+    do {
+        z->next_out = (Bytef *)out;
+        z->avail_out = ZBUF_SIZE;
+        if (deflate(z, flush) == Z_STREAM_ERROR) {
+            return -1;
+        }
+        char *p = out;
+        size_t have = ZBUF_SIZE - z->avail_out;
+        while (have > 0) {
+            size_t n = limited ? rate_grant(sess, have, 0) : have;
+            if (writen(sess->data_fd, p, n) != (ssize_t)n) {
+                return -1;
+            }
+            if (limited) {
+                rate_consume(sess, n, 0);
+            }
+            p += n;
+            have -= n;
+        }
+    } while (z->avail_out == 0);
+    return 0;
+}
+
+/**
+ * 以 MODE Z 发送文件：按大块读入文件，压缩后发送，最后结束压缩流并由调用者关闭连接
+ * 返回值与 do_retr 中的 flag 含义相同
+ */
+static int retr_zmode(session_t *sess, int fd, long long offset, long long bytes) {
+    int stored = zmode_stored(sess->arg, fd);
+    // 预先压缩好的数据只能从头发送，REST 时实时压缩
+    if (offset == 0 && ! stored) {
+        int flag = zmode_precompressed(sess, fd, bytes);
+        if (flag != -1) {
+            return flag;
+        }
+    }
+
+    if (zmode_deflate_begin(sess, stored ? Z_NO_COMPRESSION : zmode_level()) < 0) {
+        return 1;
+    }
+    posix_fadvise(fd, offset, bytes, POSIX_FADV_SEQUENTIAL);
+
+    while (1) {
+        size_t want = bytes > ZBUF_SIZE ? ZBUF_SIZE : bytes;
+        ssize_t n = pread(fd, sess->zbuf, want, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n < 0 || (n == 0 && want > 0)) {
+            // 读文件出错，或文件在传输过程中被截短
+            return 1;
+        }
+        offset += n;
+        bytes -= n;
+        if (zmode_send(sess, sess->zbuf, n, bytes == 0 ? Z_FINISH : Z_NO_FLUSH, 1) < 0) {
+            return 2;
+        }
+        if (bytes == 0) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * 以 sendfile 发送预先压缩好的数据，依次尝试压缩缓存与源文件旁边的 .gz 文件
+ * 都不可用时返回 -1，由调用者实时压缩；缓存中没有时请求压缩进程在后台压缩，之后的下载直接使用
+ * 有 .gz 文件时同样请求压缩，使用缓存的下载不必再读一遍源文件计算校验和
+ */
+static int zmode_precompressed(session_t *sess, int fd, long long bytes) {
+    if (zcache_enabled() && bytes >= (long long)tunable_deflate_cache_min_size) {
+        int flag = zmode_cached(sess, fd);
+        if (flag != -1) {
+            return flag;
+        }
+        zcache_request(fd);
+    }
+    return zmode_sidecar(sess, fd);
+}
+
+/**
+ * 源文件旁边有不比它旧的 .gz 文件时，把其中的 deflate 数据装进 zlib 格式发送
+ * 两种格式的压缩数据相同，只是头尾不同：zlib 的头部是固定的两个字节，
+ * 尾部是源文件的 Adler-32 校验和，要读一遍源文件计算，但比压缩便宜得多
+ * 配置了压缩缓存时只在缓存建立之前使用，缓存中的数据已带有校验和
+ * .gz 文件不可用时返回 -1，否则返回值与 do_retr 中的 flag 含义相同
+ */
+static int zmode_sidecar(session_t *sess, int fd) {
+    char path[MAX_ARG + 4];
+    snprintf(path, sizeof(path), "%s.gz", sess->arg);
+    int gz = open(path, O_RDONLY | O_CLOEXEC);
+    if (gz == -1) {
+        return -1;
+    }
+    struct stat st;
+    struct stat gst;
+    long long start;
+    long long end;
+    unsigned long adler;
+    if (fstat(fd, &st) < 0 || fstat(gz, &gst) < 0 || ! S_ISREG(gst.st_mode)
+        || gst.st_mtim.tv_sec < st.st_mtim.tv_sec
+        || (gst.st_mtim.tv_sec == st.st_mtim.tv_sec && gst.st_mtim.tv_nsec < st.st_mtim.tv_nsec)
+        || zmode_gzip_range(gz, gst.st_size, st.st_size, &start, &end) < 0
+        || zmode_adler32(sess, fd, st.st_size, &adler) < 0) {
+        close(gz);
+        return -1;
     }
 
-    // 150
-    char text[1024] = {0};
-    if (sess->is_ascii) {
-        sprintf(text, "Opening ASCII mode data connection for %s (%lld bytes).",
-            sess->arg, (long long)sbuf.st_size);
-    } else {
-        sprintf(text, "Opening BINARY mode data connection for %s (%lld bytes).",
-            sess->arg, (long long)sbuf.st_size);
+    static const unsigned char zhdr[2] = {0x78, 0x9c};
+    ssize_t n;
+    do {
+        n = send(sess->data_fd, zhdr, sizeof(zhdr), MSG_MORE);
+    } while (n == -1 && errno == EINTR);
+    int flag = n == sizeof(zhdr) ? retr_sendfile(sess, gz, start, end - start) : 2;
+    if (flag == 0) {
+        unsigned char trailer[4] = {adler >> 24, (adler >> 16) & 0xFF, (adler >> 8) & 0xFF,
+            adler & 0xFF};
+        if (writen(sess->data_fd, trailer, sizeof(trailer)) != sizeof(trailer)) {
+            flag = 2;
+        }
     }
+    close(gz);
+    return flag;
+}
 
-    ftp_reply(sess, FTP_DATACONN, text);
+/**
+ * 解析只有一个成员的 gzip 文件的头部，取得其中 deflate 数据的范围 [start, end)
+ * 尾部记录的原始大小须与源文件一致，多个成员拼接成的文件一般通不过这一检查
+ */
+static int zmode_gzip_range(int gz, off_t gz_size, off_t src_size, long long *start,
+    long long *end) {
+    unsigned char buf[1024];
+    ssize_t n = pread(gz, buf, sizeof(buf), 0);
+    // 头部：ID1 ID2 CM FLG MTIME(4) XFL OS，CM 须为 deflate，FLG 的保留位须为 0
+    if (n < 18 || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 8 || (buf[3] & 0xE0)) {
+        return -1;
+    }
+    int flg = buf[3];
+    ssize_t pos = 10;
+    if (flg & 0x04) {
+        // FEXTRA
+        if (pos + 2 > n) {
+            return -1;
+        }
+        pos += 2 + (buf[pos] | (buf[pos + 1] << 8));
+    }
+    if (flg & 0x08) {
+        // FNAME
+        while (pos < n && buf[pos] != 0) {
+            pos++;
+        }
+        pos++;
+    }
+    if (flg & 0x10) {
+        // FCOMMENT
+        while (pos < n && buf[pos] != 0) {
+            pos++;
+        }
+        pos++;
+    }
+    if (flg & 0x02) {
+        // FHCRC
+        pos += 2;
+    }
+    if (pos > n || pos + 8 > gz_size) {
+        return -1;
+    }
 
-    // 上传文件
-    int flag = 0;
-    char buf[1024] = {0};
+    // 尾部：CRC32 与 ISIZE，ISIZE 为原始大小对 2^32 取模
+    unsigned char tail[4];
+    if (pread(gz, tail, sizeof(tail), gz_size - 4) != sizeof(tail)) {
+        return -1;
+    }
+    unsigned int isize = tail[0] | (tail[1] << 8) | (tail[2] << 16) | ((unsigned int)tail[3] << 24);
+    if (isize != (unsigned int)src_size) {
+        return -1;
+    }
+    *start = pos;
+    *end = gz_size - 8;
+    return 0;
+}
+
+static int zmode_adler32(session_t *sess, int fd, off_t size, unsigned long *adler) {
+    if (zmode_buf_alloc(sess) < 0) {
+        return -1;
+    }
+    uLong sum = adler32(0L, Z_NULL, 0);
+    off_t pos = 0;
+    while (pos < size) {
+        size_t want = size - pos > 2 * ZBUF_SIZE ? 2 * ZBUF_SIZE : size - pos;
+        ssize_t n = pread(fd, sess->zbuf, want, pos);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        sum = adler32(sum, (const Bytef *)sess->zbuf, n);
+        pos += n;
+    }
+    *adler = sum;
+    return 0;
+}
 
-    sess->bw_transfer_start_sec = get_time_sec();
-    sess->bw_transfer_start_usec = get_time_usec();
+// 通过 nobody 进程打开压缩缓存，缓存文件中是完整的 zlib 数据，直接发送
+static int zmode_cached(session_t *sess, int fd) {
+    priv_sock_send(sess->child_fd, PRIV_SOCK_ZCACHE_OPEN, 0, NULL, 0, fd);
+    priv_msg_t msg;
+    priv_sock_recv(sess->child_fd, &msg);
+    long long range[2];
+    if (msg.code != PRIV_SOCK_RESULT_OK || msg.fd == -1 || msg.len != sizeof(range)) {
+        if (msg.fd != -1) {
+            close(msg.fd);
+        }
+        return -1;
+    }
+    memcpy(range, msg.data, sizeof(range));
+    int flag = retr_sendfile(sess, msg.fd, range[0], range[1]);
+    close(msg.fd);
+    return flag;
+}
 
+/**
+ * 以 MODE Z 接收上传的文件，解压后写入文件
+ * 数据连接关闭时压缩流必须已经完整结束，否则视为传输不完整
+ * 返回值与 upload_common 中的 flag 含义相同
+ */
+static int upload_zmode(session_t *sess, int fd) {
+    z_stream *z = zmode_inflate_begin(sess);
+    if (z == NULL) {
+        return 1;
+    }
+    char *in = sess->zbuf;
+    char *out = sess->zbuf + ZBUF_SIZE;
+    int ret = Z_OK;
     while (1) {
-        ret = read(sess->data_fd, buf, sizeof(buf));
-        if (ret == -1) {
+        ssize_t n = read(sess->data_fd, in, rate_grant(sess, ZBUF_SIZE, 1));
+        if (n == -1) {
             if (errno == EINTR) {
                 continue;
-            } else {
-                flag = 2;
-                break;
             }
-        } else if (ret == 0) {
-            flag = 0;
-            break;
+            return 2;
+        } else if (n == 0) {
+            return ret == Z_STREAM_END ? 0 : 2;
         }
 
-        limit_rate(sess, ret, 1);
+        rate_consume(sess, n, 1);
         if (sess->abor_received) {
-            flag = 2;
-            break;
+            return 2;
         }
-
-        if (writen(fd, buf, ret) != ret) {
-            flag = 1;
-            break;
+        // 压缩流结束之后的数据不属于文件
+        if (ret == Z_STREAM_END) {
+            continue;
         }
-    }
-
-    // 关闭套接字
-    close(sess->data_fd);
-    sess->data_fd = -1;
-
-    close(fd);
 
-    if (flag == 0 && ! sess->abor_received) {
-        // 226
-        ftp_reply(sess, FTP_TRANSFEROK, "Transfer complete.");
-    } else if (flag == 1) {
-        // 426
-        ftp_reply(sess, FTP_BADSENDFILE, "Failure writting to local file.");
-    } else if (flag == 2) {
-        // 451
-        ftp_reply(sess, FTP_BADSENDNET, "Failure reading from network stream.");
+        z->next_in = (Bytef *)in;
+        z->avail_in = n;
+        do {
+            z->next_out = (Bytef *)out;
+            z->avail_out = ZBUF_SIZE;
+            ret = inflate(z, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                // 压缩数据损坏
+                return 2;
+            }
+            ssize_t have = ZBUF_SIZE - z->avail_out;
+            if (writen(fd, out, have) != have) {
+                return 1;
+            }
+        } while (z->avail_out == 0 && ret != Z_STREAM_END);
     }
-
-    check_abor(sess);
-    // 重新开启控制连接通道闹钟
-    start_cmdio_alarm();
 }
 
 void ftp_reply(session_t *sess, int status, const char *text) {
     char buf[1024] = {0};
     sprintf(buf, "%d %s\r\n", status, text);
-    writen(sess->ctrl_fd, buf, strlen(buf));
+    ftp_reply_text(sess, buf);
+    if (status < 200) {
+        // 1xx 之后就开始数据传输，客户端需要立即看到
+        ftp_flush_reply(sess);
+    }
 }
 
 void ftp_lreply(session_t *sess, int status, const char *text) {
     char buf[1024] = {0};
     sprintf(buf, "%d-%s\r\n", status, text);
-    writen(sess->ctrl_fd, buf, strlen(buf));
+    ftp_reply_text(sess, buf);
 }
 
-int port_active(session_t *sess) {
-    if (sess->port_addr != NULL) {
-        if (pasv_active(sess)) {
-            fprintf(stderr, "both port and pasv are actived\n");
-            exit(EXIT_FAILURE);
+/**
+ * 把缓冲的应答写到控制连接
+ */
+void ftp_flush_reply(session_t *sess) {
+    ftp_reply_send(sess, 0);
+}
+
+// 追加原样的应答文本，用于多行应答的中间行
+static void ftp_reply_text(session_t *sess, const char *text) {
+    size_t len = strlen(text);
+    if (len > REPLY_BUF_SIZE - sess->reply_len) {
+        ftp_reply_send(sess, 1);
+    }
+    if (len > REPLY_BUF_SIZE) {
+        len = REPLY_BUF_SIZE;
+    }
+    memcpy(sess->reply_buf + sess->reply_len, text, len);
+    sess->reply_len += len;
+}
+
+// @more 为真时后面还有应答，用 MSG_MORE 让内核把它们凑成尽量少的报文段
+static void ftp_reply_send(session_t *sess, int more) {
+    const char *p = sess->reply_buf;
+    size_t left = sess->reply_len;
+    while (left > 0) {
+        ssize_t n = send(sess->ctrl_fd, p, left, more ? MSG_MORE : 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // 对端已关闭，丢弃剩余的应答
+            break;
         }
-        return 1;
+        p += n;
+        left -= n;
     }
-    return 0;
+    sess->reply_len = 0;
+}
+
+// PORT 与 PASV 互相取代，两者不会同时有效
+int port_active(session_t *sess) {
+    return sess->port_addr != NULL;
 }
 
+// PASV 之后 PASV_ACCEPT 已经发出，由 FTP 服务进程自己记录，不必询问 nobody 进程
 int pasv_active(session_t *sess) {
-    priv_sock_send_cmd(sess->child_fd, PRIV_SOCK_PASV_ACTIVE);
-    int active = priv_sock_get_int(sess->child_fd);
-    if (active) {
-        if (port_active(sess)) {
-            fprintf(stderr, "both port and pasv are actived\n");
-            exit(EXIT_FAILURE);
-        }
-        return 1;
+    return sess->pasv_accepting;
+}
+
+// 放弃尚未使用的被动模式，读取 PASV_ACCEPT 的结果并丢弃已到达的数据连接
+static void pasv_cancel(session_t *sess) {
+    if ( ! sess->pasv_accepting) {
+        return;
+    }
+    priv_sock_send(sess->child_fd, PRIV_SOCK_PASV_CANCEL, 0, NULL, 0, -1);
+    if (get_pasv_fd(sess)) {
+        close(sess->data_fd);
+        sess->data_fd = -1;
     }
-    return 0;
 }
 
 
 int get_port_fd(session_t *sess) {
+    // 不要求从 20 端口连接时不需要特权，由 FTP 服务进程自己连接
+    if ( ! tunable_connect_from_port_20) {
+        int fd = tcp_client(sess->local_ip, 0);
+        if (fd == -1) {
+            return 0;
+        }
+        if (connect_timeout(fd, sess->port_addr, tunable_connect_timeout) < 0) {
+            close(fd);
+            return 0;
+        }
+        sess->data_fd = fd;
+        return 1;
+    }
+
     /*
-    向nobody发送PRIV_SOCK_GET_DATA_SOCK命令        1
-    向nobody发送一个整数port              4
-    向nobody发送一个字符串ip                       不定长
+    向nobody发送PRIV_SOCK_GET_DATA_SOCK命令，消息数据为 PORT 给出的地址
+    应答中附带已连接的数据套接字，只需一次往返
     */
-    priv_sock_send_cmd(sess->child_fd, PRIV_SOCK_GET_DATA_SOCK);
-    unsigned short port = ntohs(sess->port_addr->sin_port);
-    char *ip = inet_ntoa(sess->port_addr->sin_addr);
-    priv_sock_send_int(sess->child_fd, (int)port);
-    priv_sock_send_buf(sess->child_fd, ip, strlen(ip));
-    char res = priv_sock_get_result(sess->child_fd);
-    if (res == PRIV_SOCK_RESULT_BAD) {
+    priv_sock_send(sess->child_fd, PRIV_SOCK_GET_DATA_SOCK, 0,
+        sess->port_addr, sizeof(struct sockaddr_in), -1);
+    return get_data_result(sess);
+}
+
+// nobody 进程在数据连接到达时就已应答，通常不必等待
+int get_pasv_fd(session_t *sess) {
+    sess->pasv_accepting = 0;
+    return get_data_result(sess);
+}
+
+// 读取 GET_DATA_SOCK 或 PASV_ACCEPT 的应答，成功时取得数据连接
+static int get_data_result(session_t *sess) {
+    priv_msg_t msg;
+    priv_sock_recv(sess->child_fd, &msg);
+    if (msg.code != PRIV_SOCK_RESULT_OK || msg.fd == -1) {
+        if (msg.fd != -1) {
+            close(msg.fd);
+        }
         return 0;
-    } else if (res == PRIV_SOCK_RESULT_OK) {
-        sess->data_fd = priv_sock_recv_fd(sess->child_fd);
     }
+    sess->data_fd = msg.fd;
     return 1;
 }
 
-int get_pasv_fd(session_t *sess) {
-    priv_sock_send_cmd(sess->child_fd, PRIV_SOCK_PASV_ACCEPT);
-    char res = priv_sock_get_result(sess->child_fd);
-    if (res == PRIV_SOCK_RESULT_BAD) {
+// 取出块模式下上一次传输保留的数据连接，对方已经关闭时放弃
+static int data_reuse(session_t *sess) {
+    if (sess->data_keep_fd == -1) {
+        return 0;
+    }
+    int fd = sess->data_keep_fd;
+    sess->data_keep_fd = -1;
+    struct pollfd pfd = {fd, POLLRDHUP, 0};
+    if (poll(&pfd, 1, 0) > 0) {
+        close(fd);
         return 0;
-    } else if (res == PRIV_SOCK_RESULT_OK) {
-        sess->data_fd = priv_sock_recv_fd(sess->child_fd);
     }
+    sess->data_fd = fd;
     return 1;
 }
 
+// PORT、PASV 或切换回流模式之后，不再使用保留的数据连接
+static void data_discard(session_t *sess) {
+    if (sess->data_keep_fd != -1) {
+        close(sess->data_keep_fd);
+        sess->data_keep_fd = -1;
+    }
+}
+
+/**
+ * 一次传输结束后关闭数据连接
+ * 流模式以关闭连接表示文件结束；块模式由块描述符标记文件结束，
+ * keep 为真且没有收到 ABOR 时保留数据连接，供下一次传输使用，
+ * 传输出错或连接上可能还有未读的数据时应传入 0
+ */
+static void data_close(session_t *sess, int keep) {
+    if (keep && sess->is_block_mode && ! sess->abor_received) {
+        sess->data_keep_fd = sess->data_fd;
+    } else {
+        close(sess->data_fd);
+    }
+    sess->data_fd = -1;
+}
+
 int get_transfer_fd(session_t *sess) {
+    // 块模式下没有新的 PORT 或 PASV 时，沿用上一次传输保留的数据连接
+    if ( ! port_active(sess) && ! pasv_active(sess) && data_reuse(sess)) {
+        start_data_alarm();
+        return 1;
+    }
     if ( ! port_active(sess) && ! pasv_active(sess)) {
         ftp_reply(sess, FTP_BADSENDCONN, "Use PORT or PASV first.");
         return 0;
@@ -509,72 +2258,154 @@ int get_transfer_fd(session_t *sess) {
         if (get_port_fd(sess) == 0) {
             ret = 0;
         }
-    }
-    if (port_active(sess)) {
         free(sess->port_addr);
         sess->port_addr = NULL;
-    }
-
-    // 如果是服务器端被动模式
-    if (pasv_active(sess)) {
-        if (get_pasv_fd(sess) == 0) {
-            ret = 0;
-        }
+    } else if (get_pasv_fd(sess) == 0) {
+        // 如果是服务器端被动模式
+        ret = 0;
     }
 
     if (ret) {
         // 重新安装 SIGALRM 信号，并启动闹钟
         start_data_alarm();
+    } else {
+        ftp_reply(sess, FTP_BADSENDCONN, "Failed to establish connection.");
     }
 
     return ret;
 }
 
 static void do_user(session_t *sess) {
-    struct passwd *pw = getpwnam(sess->arg);
-    if (pw == NULL) {
-        // 用户不存在
+    sess->user[0] = '\0';
+    if (strlen(sess->arg) >= sizeof(sess->user)) {
         ftp_reply(sess, FTP_LOGINERR, "Login incorrect.");
         return;
     }
-    sess->uid = pw->pw_uid;
+    // 配置了虚拟用户数据库时不经过 NSS
+    if (userdb_enabled()) {
+        userdb_user_t vuser;
+        if (userdb_lookup(sess->arg, &vuser) < 0) {
+            ftp_reply(sess, FTP_LOGINERR, "Login incorrect.");
+            return;
+        }
+        sess->uid = vuser.uid;
+    } else {
+        struct passwd *pw = getpwnam(sess->arg);
+        if (pw == NULL) {
+            // 用户不存在
+            ftp_reply(sess, FTP_LOGINERR, "Login incorrect.");
+            return;
+        }
+        sess->uid = pw->pw_uid;
+    }
+    strcpy(sess->user, sess->arg);
     ftp_reply(sess, FTP_GIVEPWORD, "Please specify the password.");
 }
 
 static void do_pass(session_t *sess) {
-    struct passwd *pw = getpwuid(sess->uid);
-    if (pw == NULL) {
+    if (sess->user[0] == '\0') {
         // 用户不存在
         ftp_reply(sess, FTP_LOGINERR, "Login incorrect.");
         return;
     }
-    printf("name=[%s]\n", pw->pw_name);
-    struct spwd *sp = getspnam(pw->pw_name);
-    if (sp == NULL) {
-        ftp_reply(sess, FTP_LOGINERR, "Login incorrect.");
+    // 事件驱动引擎不等待验证结果，由它提交请求，结果到达后调用 ftp_login_result
+    if (sess->evloop_hosted && auth_queue_fd() != -1) {
+        sess->auth_pending = 1;
         return;
     }
+    // 配置了验证进程时由它们完成 crypt()，本进程只等待结果
+    ftp_login_result(sess, auth_check(sess->user, sess->arg));
+}
 
-    // 加密明文密码
-    char *encrypted_pass = crypt(sess->arg, sp->sp_pwdp);
-    // 验证密码
-    if (strcmp(encrypted_pass, sp->sp_pwdp) != 0) {
+/**
+ * 根据口令验证的结果完成 PASS 命令
+ */
+void ftp_login_result(session_t *sess, int ok) {
+    if ( ! ok) {
         ftp_reply(sess, FTP_LOGINERR, "Login incorrect.");
         return;
     }
 
+    sess->logged_in = 1;
+    // 事件驱动引擎不切换自己的身份，由它记录登录用户，之后的命令临时切换身份执行
+    if ( ! sess->evloop_hosted) {
+        ftp_session_login(sess);
+    }
+
+    ftp_reply(sess, FTP_LOGINOK, "Login successful.");
+}
+
+/**
+ * 取得 sess->user 对应的本地用户，记录 uid 与 gid，输出 home 目录
+ * 虚拟用户使用映射到的本地用户，并使用它自己的限速
+ * 成功返回 0，用户已不存在时返回 -1
+ * @home 输出参数，PATH_MAX 字节
+ */
+int ftp_session_identity(session_t *sess, char *home) {
+    userdb_user_t vuser;
+    if (userdb_enabled()) {
+        if (userdb_lookup(sess->user, &vuser) < 0) {
+            return -1;
+        }
+        sess->uid = vuser.uid;
+        sess->gid = vuser.gid;
+        strcpy(home, vuser.home);
+        if (vuser.upload_max_rate > 0) {
+            sess->bw_upload_rate_max = vuser.upload_max_rate;
+        }
+        if (vuser.download_max_rate > 0) {
+            sess->bw_download_rate_max = vuser.download_max_rate;
+        }
+    } else {
+        struct passwd *pw = getpwuid(sess->uid);
+        if (pw == NULL) {
+            return -1;
+        }
+        sess->gid = pw->pw_gid;
+        snprintf(home, PATH_MAX, "%s", pw->pw_dir);
+    }
+    return 0;
+}
+
+/**
+ * 将当前进程切换为 sess->user 对应的登陆用户
+ */
+void ftp_session_login(session_t *sess) {
+    char home[PATH_MAX];
+    if (ftp_session_identity(sess, home) < 0) {
+        ERR_EXIT("ftp_session_identity");
+    }
+
     signal(SIGURG, handle_sigurg);
     activate_sigurg(sess->ctrl_fd);
 
     // 修改当前进程用户为登陆用户
-    setegid(pw->pw_gid);
-    seteuid(pw->pw_uid);
-    // 改变工作目录为 home 目录
-    chdir(pw->pw_dir);
+    setegid(sess->gid);
+    seteuid(sess->uid);
+    if (sess->cwd_fd != -1) {
+        // 由事件驱动引擎移交过来的会话，回到它在引擎中的当前目录
+        fchdir(sess->cwd_fd);
+        close(sess->cwd_fd);
+        sess->cwd_fd = -1;
+    } else {
+        // 改变工作目录为 home 目录
+        chdir(home);
+    }
     // 修改 umask
     umask(tunable_local_umask);
+}
 
-    ftp_reply(sess, FTP_LOGINOK, "Login successful.");
+// 事件驱动引擎中的会话没有自己的进程，当前目录以描述符的形式随会话保存
+static void save_cwd(session_t *sess) {
+    if (sess->cwd_fd == -1) {
+        return;
+    }
+    // O_PATH 不要求目录可读，与 chdir 只要求可搜索一致
+    int fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1) {
+        close(sess->cwd_fd);
+        sess->cwd_fd = fd;
+    }
 }
 
 static void do_cwd(session_t *sess) {
@@ -582,6 +2413,7 @@ static void do_cwd(session_t *sess) {
         ftp_reply(sess, FTP_FILEFAIL, "Failed to change directory.");
         return;
     }
+    save_cwd(sess);
     ftp_reply(sess, FTP_CWDOK, "Directory successfully changed.");
 }
 
@@ -590,17 +2422,29 @@ static void do_cdup(session_t *sess) {
         ftp_reply(sess, FTP_FILEFAIL, "Failed to change directory.");
         return;
     }
+    save_cwd(sess);
     ftp_reply(sess, FTP_CWDOK, "Directory successfully changed.");
 }
 
 static void do_quit(session_t *sess) {
     ftp_reply(sess, FTP_GOODBYE, "Goodbye.");
+    if (sess->evloop_hosted) {
+        // 由事件驱动引擎负责关闭连接
+        sess->quit_received = 1;
+        return;
+    }
+    ftp_flush_reply(sess);
     exit(EXIT_SUCCESS);
 }
 
 static void do_port(session_t *sess) {
     unsigned int v[6];
     sscanf(sess->arg, "%u,%u,%u,%u,%u,%u", &v[2], &v[3], &v[4], &v[5], &v[0], &v[1]);
+    pasv_cancel(sess);
+    data_discard(sess);
+    if (sess->port_addr != NULL) {
+        free(sess->port_addr);
+    }
     sess->port_addr = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
     memset(sess->port_addr, 0, sizeof(struct sockaddr_in));
     sess->port_addr->sin_family = AF_INET;
@@ -616,14 +2460,30 @@ static void do_port(session_t *sess) {
 }
 
 static void do_pasv(session_t *sess) {
-    char ip[16] = {0};
-    getlocalip(ip);
-    
-    priv_sock_send_cmd(sess->child_fd, PRIV_SOCK_PASV_LISTEN);
-    unsigned short port = (int)priv_sock_get_int(sess->child_fd);
+    pasv_cancel(sess);
+    data_discard(sess);
+    if (sess->port_addr != NULL) {
+        free(sess->port_addr);
+        sess->port_addr = NULL;
+    }
+
+    // PASV_ACCEPT 不必等待 PASV_LISTEN 的应答，两条消息连续发出，只需一次往返
+    // nobody 进程随后在后台接受数据连接
+    priv_sock_send(sess->child_fd, PRIV_SOCK_PASV_LISTEN, 0, NULL, 0, -1);
+    priv_sock_send(sess->child_fd, PRIV_SOCK_PASV_ACCEPT, 0, NULL, 0, -1);
+    sess->pasv_accepting = 1;
+    priv_msg_t msg;
+    priv_sock_recv(sess->child_fd, &msg);
+    if (msg.code != PRIV_SOCK_RESULT_OK) {
+        // 没有监听套接字，PASV_ACCEPT 已立即以失败应答
+        get_pasv_fd(sess);
+        ftp_reply(sess, FTP_BADSENDCONN, "No free passive port, try again later.");
+        return;
+    }
+    unsigned short port = (unsigned short)msg.arg;
 
-    unsigned int v[4];
-    sscanf(ip, "%u.%u.%u.%u", &v[0], &v[1], &v[2], &v[3]);
+    unsigned int ip = ntohl(pasvpool_reply_ip(sess->local_ip));
+    unsigned int v[4] = {ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF};
     char text[1024] = {0};
     sprintf(text, "Entering Passive Mode (%u,%u,%u,%u,%u,%u).", 
         v[0], v[1], v[2], v[3], port>>8, port&0xFF);
@@ -644,11 +2504,33 @@ static void do_type(session_t *sess) {
 }
 
 static void do_stru(session_t *sess) {
-
+    // 只支持文件结构
+    if (strcmp(sess->arg, "F") == 0) {
+        ftp_reply(sess, FTP_STRUOK, "Structure set to F.");
+    } else {
+        ftp_reply(sess, FTP_BADSTRU, "Bad STRU command.");
+    }
 }
 
 static void do_mode(session_t *sess) {
-
+    if (strcmp(sess->arg, "S") == 0) {
+        sess->is_block_mode = 0;
+        sess->is_deflate_mode = 0;
+        data_discard(sess);
+        ftp_reply(sess, FTP_MODEOK, "Mode set to S.");
+    } else if (strcmp(sess->arg, "B") == 0) {
+        sess->is_block_mode = 1;
+        sess->is_deflate_mode = 0;
+        ftp_reply(sess, FTP_MODEOK, "Mode set to B.");
+    } else if (strcmp(sess->arg, "Z") == 0 && tunable_deflate_level > 0) {
+        // MODE Z 与流模式一样以关闭连接标记文件结束，不保留数据连接
+        sess->is_block_mode = 0;
+        sess->is_deflate_mode = 1;
+        data_discard(sess);
+        ftp_reply(sess, FTP_MODEOK, "Mode set to Z.");
+    } else {
+        ftp_reply(sess, FTP_BADMODE, "Bad MODE command.");
+    }
 }
 
 static void do_retr(session_t *sess) {
@@ -663,6 +2545,8 @@ static void do_retr(session_t *sess) {
     // 打开文件
     int fd = open(sess->arg, O_RDONLY);
     if (fd == -1) {
+        // 尚未发送任何数据，块模式下的数据连接仍可继续使用
+        data_close(sess, 1);
         ftp_reply(sess, FTP_FILEFAIL, "Failed to open file.");
         return;
     }
@@ -670,6 +2554,9 @@ static void do_retr(session_t *sess) {
     // 加锁
     int ret = lock_file_read(fd);
     if (ret == -1) {
+        close(fd);
+        // 尚未发送任何数据，块模式下的数据连接仍可继续使用
+        data_close(sess, 1);
         ftp_reply(sess, FTP_FILEFAIL, "Failed to open file.");
         return;
     }
@@ -677,19 +2564,14 @@ static void do_retr(session_t *sess) {
     // 判断是否普通文件
     struct stat sbuf;
     ret = fstat(fd, &sbuf);
-    if ( ! S_ISREG(sbuf.st_mode)) {
+    if (ret == -1 || ! S_ISREG(sbuf.st_mode)) {
+        close(fd);
+        // 尚未发送任何数据，块模式下的数据连接仍可继续使用
+        data_close(sess, 1);
         ftp_reply(sess, FTP_FILEFAIL, "Failed to open file.");
         return;
     }
 
-    if (offset != 0) {
-        ret = lseek(fd, offset, SEEK_SET);
-        if (ret == -1) {
-            ftp_reply(sess, FTP_FILEFAIL, "Failed to open file.");
-            return;
-        }
-    }
-
     char text[1024] = {0};
     if (sess->is_ascii) {
         sprintf(text, "Opening ASCII mode data connection for %s (%lld bytes).",
@@ -734,28 +2616,25 @@ static void do_retr(session_t *sess) {
         byte_to_send -= offset;
     }
 
-    sess->bw_transfer_start_sec = get_time_sec();
-    sess->bw_transfer_start_usec = get_time_usec();
+    rate_start(sess);
 
-    while (byte_to_send) {
-        int num_this_time = byte_to_send > 4096 ? 4096 : byte_to_send;
-        ret = sendfile(sess->data_fd, fd, NULL, num_this_time);
-        if (ret == -1) {
-            flag = 2;
-            break;
-        }
-        limit_rate(sess, ret, 0);
-        byte_to_send -= ret;
-    }
-    if (byte_to_send == 0) {
-        flag = 0;
+    // 块模式的每个块都要先发送块头，MODE Z 要先压缩，都不使用 io_uring 的 splice 链
+    uring_t *ring = sess->is_block_mode || sess->is_deflate_mode ? NULL : get_data_uring(sess);
+    if (sess->is_block_mode) {
+        flag = retr_block(sess, fd, offset, byte_to_send);
+    } else if (sess->is_deflate_mode) {
+        flag = retr_zmode(sess, fd, offset, byte_to_send);
+    } else if (ring != NULL) {
+        flag = retr_uring(sess, ring, fd, offset, byte_to_send);
+    } else {
+        flag = retr_sendfile(sess, fd, offset, byte_to_send);
     }
 
-    // 关闭套接字
-    close(sess->data_fd);
-    sess->data_fd = -1;
+    // 关闭套接字，块模式下传输成功时保留
+    data_close(sess, flag == 0);
 
     close(fd);
+    rate_stop(sess);
     
     if (flag == 0 && ! sess->abor_received) {
         // 226
@@ -789,11 +2668,16 @@ static void do_list(session_t *sess) {
     // 150
     ftp_reply(sess, FTP_DATACONN, "Here comes the directory listing.");
     // 传输列表
-    list_common(sess, 1);
-    // 关闭连接套接字
-    close(sess->data_fd);
-    // 226
-    ftp_reply(sess, FTP_TRANSFEROK, "Directory send OK.");
+    int ok = list_common(sess, 1);
+    // 关闭连接套接字，块模式下列表完整发送时保留
+    data_close(sess, ok);
+    if (ok) {
+        // 226
+        ftp_reply(sess, FTP_TRANSFEROK, "Directory send OK.");
+    } else {
+        // 426
+        ftp_reply(sess, FTP_BADSENDNET, "Failure writting to network stream.");
+    }
 }
 
 static void do_nlst(session_t *sess) {
@@ -804,11 +2688,82 @@ static void do_nlst(session_t *sess) {
     // 150
     ftp_reply(sess, FTP_DATACONN, "Here comes the directory listing.");
     // 传输列表
-    list_common(sess, 0);
-    // 关闭连接套接字
-    close(sess->data_fd);
-    // 226
-    ftp_reply(sess, FTP_TRANSFEROK, "Directory send OK.");
+    int ok = list_common(sess, 0);
+    // 关闭连接套接字，块模式下列表完整发送时保留
+    data_close(sess, ok);
+    if (ok) {
+        // 226
+        ftp_reply(sess, FTP_TRANSFEROK, "Directory send OK.");
+    } else {
+        // 426
+        ftp_reply(sess, FTP_BADSENDNET, "Failure writting to network stream.");
+    }
+}
+
+static void do_mlsd(session_t *sess) {
+    if (get_transfer_fd(sess) == 0) {
+        return;
+    }
+
+    const char *path = sess->arg[0] != '\0' ? sess->arg : ".";
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        data_close(sess, 1);
+        ftp_reply(sess, FTP_FILEFAIL, "Could not open directory.");
+        return;
+    }
+
+    // 150
+    ftp_reply(sess, FTP_DATACONN, "Here comes the directory listing.");
+    int ok = mlsd_common(sess, dirfd, path);
+    close(dirfd);
+    data_close(sess, ok);
+    if (ok) {
+        // 226
+        ftp_reply(sess, FTP_TRANSFEROK, "Directory send OK.");
+    } else {
+        // 426
+        ftp_reply(sess, FTP_BADSENDNET, "Failure writting to network stream.");
+    }
+}
+
+static void do_mlst(session_t *sess) {
+    const char *path = sess->arg[0] != '\0' ? sess->arg : ".";
+    struct statx stx;
+    if (list_statx(AT_FDCWD, path, 1, &stx) < 0) {
+        ftp_reply(sess, FTP_FILEFAIL, "Could not get file information.");
+        return;
+    }
+
+    // 删除与改名取决于条目所在的目录
+    char parent[MAX_ARG + 4] = {0};
+    if (S_ISDIR(stx.stx_mode)) {
+        sprintf(parent, "%s/..", path);
+    } else {
+        strcpy(parent, path);
+        char *slash = strrchr(parent, '/');
+        if (slash == NULL) {
+            strcpy(parent, ".");
+        } else if (slash == parent) {
+            parent[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+    mlsx_ctx_t ctx;
+    mlsx_ctx_init(&ctx, parent);
+
+    char text[MLSX_FACTS_MAX + MAX_ARG + 4] = {0};
+    text[0] = ' ';
+    char *p = mlsx_format_facts(text + 1, &stx, &ctx);
+    sprintf(p, "%s\r\n", path);
+    mlsx_ctx_free(&ctx);
+
+    char head[MAX_ARG + 16] = {0};
+    sprintf(head, "Listing %s", path);
+    ftp_lreply(sess, FTP_MLSTOK, head);
+    ftp_reply_text(sess, text);
+    ftp_reply(sess, FTP_MLSTOK, "End");
 }
 
 static void do_rest(session_t *sess) {
@@ -867,6 +2822,9 @@ static void do_dele(session_t *sess) {
 }
 
 static void do_rnfr(session_t *sess) {
+    if (sess->rnfr_name != NULL) {
+        free(sess->rnfr_name);
+    }
     sess->rnfr_name = (char *)malloc(strlen(sess->arg) + 1);
     memset(sess->rnfr_name, 0, strlen(sess->arg) + 1);
     strcpy(sess->rnfr_name, sess->arg);
@@ -909,14 +2867,18 @@ static void do_syst(session_t *sess) {
 
 static void do_feat(session_t *sess) {
     ftp_lreply(sess, FTP_FEAT, "Features:");
-    writen(sess->ctrl_fd, " EPRT\r\n", strlen(" EPRT\r\n"));
-    writen(sess->ctrl_fd, " EPSV\r\n", strlen(" EPSV\r\n"));
-    writen(sess->ctrl_fd, " MDTM\r\n", strlen(" MDTM\r\n"));
-    writen(sess->ctrl_fd, " PASV\r\n", strlen(" PASV\r\n"));
-    writen(sess->ctrl_fd, " REST STREAM\r\n", strlen(" REST STREAM\r\n"));
-    writen(sess->ctrl_fd, " SIZE\r\n", strlen(" SIZE\r\n"));
-    writen(sess->ctrl_fd, " TVFS\r\n", strlen(" TVFS\r\n"));
-    writen(sess->ctrl_fd, " UTF8\r\n", strlen(" UTF8\r\n"));
+    int i;
+    for (i = 0; i < CMDID_COUNT; i++) {
+        // deflate_level 为 0 时不支持 MODE Z
+        if (i == CMDID_MODE && tunable_deflate_level == 0) {
+            continue;
+        }
+        if (ctrl_cmds[i].feat != NULL) {
+            char text[64] = {0};
+            sprintf(text, " %s\r\n", ctrl_cmds[i].feat);
+            ftp_reply_text(sess, text);
+        }
+    }
     ftp_reply(sess, FTP_FEAT, "End");
 }
 
@@ -935,37 +2897,59 @@ static void do_size(session_t *sess) {
     ftp_reply(sess, FTP_SIZEOK, text);
 }
 
+static void do_mdtm(session_t *sess) {
+    struct stat buf;
+    if (stat(sess->arg, &buf) < 0 || ! S_ISREG(buf.st_mode)) {
+        ftp_reply(sess, FTP_FILEFAIL, "Could not get file modification time.");
+        return;
+    }
+    struct tm tm;
+    gmtime_r(&buf.st_mtime, &tm);
+    char text[32] = {0};
+    strftime(text, sizeof(text), "%Y%m%d%H%M%S", &tm);
+    ftp_reply(sess, FTP_MDTMOK, text);
+}
+
 static void do_stat(session_t *sess) {
     ftp_lreply(sess, FTP_STATOK, "FTP server status:");
     if (sess->bw_upload_rate_max == 0) {
         char text[1024] = {0};
         sprintf(text, "     No session upload bandwidth limit\r\n");
-        writen(sess->ctrl_fd, text, strlen(text));
+        ftp_reply_text(sess, text);
     } else if (sess->bw_upload_rate_max > 0) {
         char text[1024] = {0};
         sprintf(text, "     Session upload bandwidth limit in byte/s is %u\r\n",
             sess->bw_upload_rate_max);
-        writen(sess->ctrl_fd, text, strlen(text));
+        ftp_reply_text(sess, text);
     }
 
     if (sess->bw_download_rate_max == 0) {
         char text[1024];
         sprintf(text,
             "     No session download bandwidth limit\r\n");
-        writen(sess->ctrl_fd, text, strlen(text));
+        ftp_reply_text(sess, text);
     } else if (sess->bw_download_rate_max > 0) {
         char text[1024];
         sprintf(text,
             "     Session download bandwidth limit in byte/s is %u\r\n",
             sess->bw_download_rate_max);
-        writen(sess->ctrl_fd, text, strlen(text));
+        ftp_reply_text(sess, text);
     }
 
     char text[1024] = {0};
     sprintf(text,
         "     At session startup, client count was %u\r\n",
         sess->num_clients);
-    writen(sess->ctrl_fd, text, strlen(text));
+    ftp_reply_text(sess, text);
+
+    dircache_stats_t stats;
+    if (dircache_get_stats(&stats)) {
+        sprintf(text,
+            "     Directory cache: %llu hits, %llu misses, %llu evictions, "
+            "%llu listings in %llu bytes\r\n",
+            stats.hits, stats.misses, stats.evictions, stats.entries, stats.bytes);
+        ftp_reply_text(sess, text);
+    }
     
     ftp_reply(sess, FTP_STATOK, "End of status");
 }
@@ -974,20 +2958,30 @@ static void do_noop(session_t *sess) {
     ftp_reply(sess, FTP_NOOPOK, "NOOP ok.");
 }
 
+static int cmd_name_cmp(const void *a, const void *b) {
+    return strcmp((*(const ftpcmd_t **)a)->cmd, (*(const ftpcmd_t **)b)->cmd);
+}
+
 static void do_help(session_t *sess) {
+    // 按字母顺序列出命令表中的所有命令，每行 14 个
+    const ftpcmd_t *cmds[CMDID_COUNT];
+    int i;
+    for (i = 0; i < CMDID_COUNT; i++) {
+        cmds[i] = &ctrl_cmds[i];
+    }
+    qsort(cmds, CMDID_COUNT, sizeof(cmds[0]), cmd_name_cmp);
+
     ftp_lreply(sess, FTP_HELP, "The following commands are recognized.");
-    writen(sess->ctrl_fd,
-        " ABOR ACCT ALLO APPE CDUP CWD  DELE EPRT EPSV FEAT HELP LIST MDTM MKD\r\n",
-        strlen(" ABOR ACCT ALLO APPE CDUP CWD  DELE EPRT EPSV FEAT HELP LIST MDTM MKD\r\n"));
-    writen(sess->ctrl_fd,
-        " MODE NLST NOOP OPTS PASS PASV PORT PWD  QUIT REIN REST RETR RMD  RNFR\r\n",
-        strlen(" MODE NLST NOOP OPTS PASS PASV PORT PWD  QUIT REIN REST RETR RMD  RNFR\r\n"));
-    writen(sess->ctrl_fd,
-        " RNTO SITE SIZE SMNT STAT STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD\r\n",
-        strlen(" RNTO SITE SIZE SMNT STAT STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD\r\n"));
-    writen(sess->ctrl_fd,
-        " XPWD XRMD\r\n",
-        strlen(" XPWD XRMD\r\n"));
+    char text[128] = {0};
+    int len = 0;
+    for (i = 0; i < CMDID_COUNT; i++) {
+        len += sprintf(text + len, " %-4s", cmds[i]->cmd);
+        if (i % 14 == 13 || i == CMDID_COUNT - 1) {
+            strcpy(text + len, "\r\n");
+            ftp_reply_text(sess, text);
+            len = 0;
+        }
+    }
     ftp_reply(sess, FTP_HELP, "Help OK.");
 }
 
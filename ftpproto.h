@@ -5,5 +5,12 @@
 
 void handle_child(session_t *sess);
 void ftp_reply(session_t *sess, int status, const char *text);
+void ftp_flush_reply(session_t *sess);
+
+void ftp_parse_command(session_t *sess);
+int ftp_dispatch_command(session_t *sess, int inline_only);
+int ftp_session_identity(session_t *sess, char *home);
+void ftp_session_login(session_t *sess);
+void ftp_login_result(session_t *sess, int ok);
 
 #endif
\ No newline at end of file
@@ -5,20 +5,42 @@
 #include "parseconf.h"
 #include "ftpproto.h"
 #include "ftpcodes.h"
-#include "hash.h"
+#include "evloop.h"
+#include "conntab.h"
+#include "bwshare.h"
+#include "dircache.h"
+#include "pasvpool.h"
+#include "broker.h"
+#include "auth.h"
+#include "userdb.h"
+#include "zcache.h"
+#include <sys/prctl.h>
+#include <syslog.h>
 
-extern session_t *p_sess;
-static unsigned int s_children;
+// 运行不到 WORKER_MIN_UPTIME 秒就退出的工作进程视为启动失败，
+// 连续失败时重启前的等待时间从 1 秒起逐次加倍，最多 WORKER_MAX_DELAY 秒
+#define WORKER_MIN_UPTIME   10
+#define WORKER_MAX_DELAY    60
+
+typedef struct worker {
+    pid_t pid;              // 等待重启时为 0
+    time_t started;
+    time_t restart_at;
+    unsigned int delay;     // 上一次重启前等待的秒数
+} worker_t;
 
-static hash_t *s_ip_count_hash;
-static hash_t *s_pid_ip_hash;
+extern session_t *p_sess;
 
-void check_limits(session_t *sess);
-void handle_sigchld(int sig);
-unsigned int hash_func(unsigned int buckets, void *key);
+int check_limits(session_t *sess);
 
-unsigned int handle_ip_count(void *ip);
-void drop_ip_count(void *ip);
+static pid_t start_worker(int *listenfds, unsigned int num_workers, unsigned int index,
+    session_t *sess);
+static void worker_exited(worker_t *w, unsigned int index, int status);
+static int restart_workers(worker_t *workers, int *listenfds, unsigned int num_workers,
+    session_t *sess);
+static void handle_restart_alarm(int sig);
+static void handle_worker(int listenfd, session_t *sess);
+static void accept_sessions(int listenfd, int sigfd, session_t *sess);
 
 int main() {
     if (getuid() != 0) {
@@ -28,8 +50,28 @@ int main() {
 
     parseconf_load_file(MINIFTP_CONF);
 
+    // 工作进程数，默认每个 CPU 一个
+    unsigned int num_workers = tunable_listen_workers;
+    if (num_workers == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = ncpu > 0 ? (unsigned int)ncpu : 1;
+    }
+
+    // 每个工作进程使用各自的 SO_REUSEPORT 监听套接字，由内核分摊新连接
+    // 在成为守护进程之前创建，配置错误时能在终端看到出错信息
+    int *listenfds = (int *)malloc(num_workers * sizeof(int));
+    unsigned int i;
+    for (i = 0; i < num_workers; i++) {
+        listenfds[i] = tcp_server_reuseport(tunable_listen_address, tunable_listen_port);
+    }
+    pasvpool_init();
+    userdb_init();
+    // nobody 用户只查询一次，之后创建的进程都继承查询结果
+    get_nobody(NULL, NULL);
+
     // 成为守护进程
     daemon(0, 0);
+    openlog("miniftpd", LOG_PID, LOG_DAEMON);
 
     /*printf("tunable_pasv_enable=%d\n", tunable_pasv_enable);
     printf("tunable_port_enable=%d\n", tunable_port_enable);
@@ -52,17 +94,19 @@ int main() {
     */
     session_t sess = {
         // 控制连接
-        0, -1, "", "", "",
+        0, 0, "", -1, {"", 0, 0, 0}, NULL, "", "", 0, "", 0,
         // 数据连接 
-        NULL, -1, -1, 0,
+        NULL, -1, -1, -1, 0, 0, -1, 0, -1, -1, 0, NULL, 0, NULL, 0, NULL, NULL, NULL,
         // 限速
-        0, 0, 0, 0,
+        0, 0, {0, 0, 0, 0}, {0, 0, 0, 0}, {{NULL, NULL, NULL}, 0, 0, -1},
         // 父子通道
         -1, -1,
         // FTP 协议状态
-        0, 0, NULL, 0,
+        0, 0, 0, 0, NULL, 0, 0,
         // 连接数限制
-        0, 0
+        0, 0, 0, 0, -1,
+        // 事件驱动模式
+        0, 0, -1, -1, 0
     };
 
     p_sess = &sess;
@@ -70,112 +114,218 @@ int main() {
     sess.bw_upload_rate_max = tunable_upload_max_rate;
     sess.bw_download_rate_max = tunable_download_max_rate;
 
-    s_ip_count_hash = hash_alloc(256, hash_func);
-    s_pid_ip_hash = hash_alloc(256, hash_func);
-
-    signal(SIGCHLD, handle_sigchld);
-    int listenfd = tcp_server(NULL, 5188);
-    int conn;
-    pid_t pid;
-    struct sockaddr_in addr;
+    // 所有工作进程共享连接计数、聚合限速、目录列表缓存、nobody 进程、压缩进程与验证进程
+    // 验证进程最后创建，其他以 nobody 身份运行的进程不会继承请求队列
+    conntab_init();
+    bwshare_init();
+    dircache_init();
+    broker_init();
+    zcache_init();
+    auth_init();
 
-    while (1) {
-        conn = accept_timeout(listenfd, &addr, 0);
-        if (conn == -1) {
-            ERR_EXIT("accept_timeout");
-        }
+    // 工作进程意外退出后，它的会话进程由主进程收养，退出时才能注销它们的连接
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+        ERR_EXIT("prctl");
+    }
 
+    worker_t *workers = (worker_t *)calloc(num_workers, sizeof(worker_t));
+    for (i = 0; i < num_workers; i++) {
+        workers[i].pid = start_worker(listenfds, num_workers, i, &sess);
+        workers[i].started = time(NULL);
+    }
 
-        unsigned int ip = addr.sin_addr.s_addr;
+    // 有工作进程等待重启时每秒打断一次 wait，不设 SA_RESTART
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_restart_alarm;
+    sigaction(SIGALRM, &sa, NULL);
 
-        ++s_children;
-        sess.num_clients = s_children;
-        sess.num_this_ip = handle_ip_count(&ip);
+    // 主进程只负责重启意外退出的工作进程、目录缓存的监视进程、共享的 nobody 进程、压缩进程与验证进程，
+    // 并回收收养的会话进程
+    while (1) {
+        // 到期的先重启，仍有等待的工作进程时由闹钟打断 wait
+        alarm(restart_workers(workers, listenfds, num_workers, &sess) ? 1 : 0);
 
-        pid = fork();
+        int status;
+        pid_t pid = wait(&status);
         if (pid == -1) {
-            --s_children;
-            ERR_EXIT("fork");
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR_EXIT("wait");
         }
-        if (pid == 0) {
-            close(listenfd);
-            sess.ctrl_fd = conn;
-            check_limits(&sess);
-            signal(SIGCHLD, SIG_IGN);
-            begin_session(&sess);
-        } else {
-            hash_add_entry(s_pid_ip_hash, &pid, sizeof(pid),
-                &ip, sizeof(unsigned int));
-            close(conn);
+        if (dircache_reap(pid) || broker_reap(pid) || zcache_reap(pid) || auth_reap(pid)) {
+            continue;
+        }
+        // 意外退出的工作进程托管的连接，以及它遗留的会话进程的连接
+        conntab_sweep(pid);
+        for (i = 0; i < num_workers; i++) {
+            if (workers[i].pid == pid) {
+                worker_exited(&workers[i], i, status);
+                break;
+            }
         }
     }
 
     return 0;
 }
 
-void check_limits(session_t *sess) {
-    if (tunable_max_clients > 0 && sess->num_clients > tunable_max_clients) {
-        ftp_reply(sess, FTP_TOO_MANY_USERS, 
-            "There are too many connected users, please try later.");
-        exit(EXIT_FAILURE);
+static pid_t start_worker(int *listenfds, unsigned int num_workers, unsigned int index,
+    session_t *sess) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        ERR_EXIT("fork");
     }
+    if (pid == 0) {
+        signal(SIGALRM, SIG_DFL);
+        unsigned int i;
+        for (i = 0; i < num_workers; i++) {
+            if (i != index) {
+                close(listenfds[i]);
+            }
+        }
+        handle_worker(listenfds[index], sess);
+        exit(EXIT_SUCCESS);
+    }
+    return pid;
+}
 
-    if (tunable_max_per_ip > 0 && sess->num_this_ip > tunable_max_per_ip) {
-        ftp_reply(sess, FTP_IP_LIMIT, 
-            "There are too many connections from your internet address.");
-        exit(EXIT_FAILURE);
+/**
+ * 记录工作进程的退出，安排重启的时间
+ * 启动后很快就退出的工作进程多半会再次失败，推迟重启，避免主进程不停地创建进程
+ */
+static void worker_exited(worker_t *w, unsigned int index, int status) {
+    time_t now = time(NULL);
+    if (now - w->started >= WORKER_MIN_UPTIME) {
+        w->delay = 0;
+    } else {
+        w->delay = w->delay == 0 ? 1 : w->delay * 2;
+        if (w->delay > WORKER_MAX_DELAY) {
+            w->delay = WORKER_MAX_DELAY;
+        }
+    }
+    w->pid = 0;
+    w->restart_at = now + w->delay;
+
+    if (WIFSIGNALED(status)) {
+        syslog(LOG_ERR, "worker %u killed by signal %d after %ld s, restarting in %u s",
+            index, WTERMSIG(status), (long)(now - w->started), w->delay);
+    } else {
+        syslog(LOG_ERR, "worker %u exited with status %d after %ld s, restarting in %u s",
+            index, WEXITSTATUS(status), (long)(now - w->started), w->delay);
     }
 }
 
-void handle_sigchld(int sig) {
-    pid_t pid;
-    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-        --s_children;
-        unsigned int *ip = hash_lookup_entry(s_pid_ip_hash, &pid, sizeof(pid));
-        if (ip == NULL) {
+// 重启到期的工作进程，返回仍在等待重启的工作进程数
+static int restart_workers(worker_t *workers, int *listenfds, unsigned int num_workers,
+    session_t *sess) {
+    time_t now = time(NULL);
+    int waiting = 0;
+    unsigned int i;
+    for (i = 0; i < num_workers; i++) {
+        if (workers[i].pid != 0) {
             continue;
         }
-        drop_ip_count(ip);
-        hash_free_entry(s_pid_ip_hash, &pid, sizeof(pid));
+        if (workers[i].restart_at > now) {
+            waiting++;
+            continue;
+        }
+        workers[i].pid = start_worker(listenfds, num_workers, i, sess);
+        workers[i].started = now;
     }
+    return waiting;
 }
 
-unsigned int hash_func(unsigned int buckets, void *key) {
-    unsigned int *number = (unsigned int *)key;
-    return (*number) % buckets;
+// 闹钟可能在进入 wait 之前响起，继续每秒响一次，直到主循环确认没有等待重启的工作进程
+static void handle_restart_alarm(int sig) {
+    alarm(1);
 }
 
-unsigned int handle_ip_count(void *ip) {
-    unsigned int count;
-    unsigned int *p_count = (unsigned int *)hash_lookup_entry(s_ip_count_hash,
-        ip, sizeof(unsigned int));
-    if (p_count == NULL) {
-        count = 1;
-        hash_add_entry(s_ip_count_hash, ip, sizeof(unsigned int), 
-            &count, sizeof(unsigned int));
-    } else {
-        count = *p_count;
-        count++;
-        *p_count = count;
+static void handle_worker(int listenfd, session_t *sess) {
+    if (tunable_event_driven_enable) {
+        // 事件驱动模式，不再返回
+        evloop_run(listenfd, sess);
+    }
+
+    // 用 signalfd 同步回收会话进程，连接计数在主循环中注销
+    int sigfd = conntab_reaper_open();
+    activate_nonblock(listenfd);
+
+    struct pollfd fds[2];
+    fds[0].fd = listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sigfd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR_EXIT("poll");
+        }
+        if (fds[1].revents & POLLIN) {
+            conntab_reap(sigfd);
+        }
+        if (fds[0].revents & POLLIN) {
+            accept_sessions(listenfd, sigfd, sess);
+        }
     }
-    return count;
 }
 
-void drop_ip_count(void *ip) {
-    unsigned int count;
-    unsigned int *p_count = (unsigned int *)hash_lookup_entry(s_ip_count_hash,
-        ip, sizeof(unsigned));
-    if (p_count == NULL) {
-        return;
+// 取完所有已到达的连接，超出限制的连接在创建会话进程之前就拒绝
+static void accept_sessions(int listenfd, int sigfd, session_t *sess) {
+    while (1) {
+        struct sockaddr_in addr;
+        int conn = accept_timeout(listenfd, &addr, 0);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // EAGAIN：已取完所有连接
+            return;
+        }
+
+        unsigned int ip = addr.sin_addr.s_addr;
+        sess->client_ip = ip;
+        sess->ctrl_fd = conn;
+
+        sess->conntab_id = conntab_add(ip, &sess->num_clients, &sess->num_this_ip);
+        if ( ! check_limits(sess)) {
+            ftp_flush_reply(sess);
+            conntab_remove(ip, sess->conntab_id);
+            close(conn);
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            conntab_remove(ip, sess->conntab_id);
+            ERR_EXIT("fork");
+        }
+        if (pid == 0) {
+            close(listenfd);
+            conntab_reaper_release(sigfd);
+            begin_session(sess);
+        } else {
+            conntab_track(pid, ip, sess->conntab_id);
+            close(conn);
+        }
     }
+}
 
-    count = *p_count;
-    if (count <= 0) {
-        return;
+// 超出连接数限制时回复客户端并返回 0
+int check_limits(session_t *sess) {
+    if (tunable_max_clients > 0 && sess->num_clients > tunable_max_clients) {
+        ftp_reply(sess, FTP_TOO_MANY_USERS, 
+            "There are too many connected users, please try later.");
+        return 0;
     }
-    --count;
-    *p_count = count;
-    if (count == 0) {
-        hash_free_entry(s_ip_count_hash, ip, sizeof(unsigned int));
+
+    if (tunable_max_per_ip > 0 && sess->num_this_ip > tunable_max_per_ip) {
+        ftp_reply(sess, FTP_IP_LIMIT, 
+            "There are too many connections from your internet address.");
+        return 0;
     }
-}
\ No newline at end of file
+    return 1;
+}
@@ -12,6 +12,10 @@ parseconf_bool_array[] =
 {
     { "pasv_enable", &tunable_pasv_enable },
     { "port_enable", &tunable_port_enable },
+    { "event_driven_enable", &tunable_event_driven_enable },
+    { "io_uring_enable", &tunable_io_uring_enable },
+    { "list_stat_ordered", &tunable_list_stat_ordered },
+    { "connect_from_port_20", &tunable_connect_from_port_20 },
     { NULL, NULL }
 };
 
@@ -23,6 +27,7 @@ static struct parseconf_uint_setting
 parseconf_uint_array[] =
 {
     { "listen_port", &tunable_listen_port },
+    { "listen_workers", &tunable_listen_workers },
     { "max_clients", &tunable_max_clients },
     { "max_per_ip", &tunable_max_per_ip },
     { "accept_timeout", &tunable_accept_timeout },
@@ -32,6 +37,20 @@ parseconf_uint_array[] =
     { "local_umask", &tunable_local_umask },
     { "upload_max_rate", &tunable_upload_max_rate },
     { "download_max_rate", &tunable_download_max_rate },
+    { "rate_burst", &tunable_rate_burst },
+    { "global_max_rate", &tunable_global_max_rate },
+    { "per_ip_max_rate", &tunable_per_ip_max_rate },
+    { "per_user_max_rate", &tunable_per_user_max_rate },
+    { "dir_cache_size", &tunable_dir_cache_size },
+    { "list_stat_parallel", &tunable_list_stat_parallel },
+    { "pasv_min_port", &tunable_pasv_min_port },
+    { "pasv_max_port", &tunable_pasv_max_port },
+    { "broker_processes", &tunable_broker_processes },
+    { "auth_workers", &tunable_auth_workers },
+    { "auth_cache_ttl", &tunable_auth_cache_ttl },
+    { "deflate_level", &tunable_deflate_level },
+    { "deflate_cache_size", &tunable_deflate_cache_size },
+    { "deflate_cache_min_size", &tunable_deflate_cache_min_size },
     { NULL, NULL }
 };
 
@@ -43,6 +62,9 @@ static struct parseconf_str_setting
 parseconf_str_array[] =
 {
     { "listen_address", &tunable_listen_address },
+    { "pasv_address", &tunable_pasv_address },
+    { "user_db_file", &tunable_user_db_file },
+    { "deflate_cache_dir", &tunable_deflate_cache_dir },
     { NULL, NULL }
 };
 
@@ -0,0 +1,156 @@
+#include "pasvpool.h"
+#include "common.h"
+#include "tunable.h"
+#include "sysutil.h"
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+// 端口范围的上限，每个端口占用每个会话进程的一个文件描述符
+#define PASVPOOL_MAX_PORTS  4096
+
+// 每个端口的占用者为 nobody 进程的 pid，0 表示空闲
+// 占用者异常退出时来不及归还，分配时发现占用者已不存在也视为空闲
+typedef struct pasvpool_shm {
+    volatile int lock;
+    unsigned int next;
+    pid_t owners[PASVPOOL_MAX_PORTS];
+} pasvpool_shm_t;
+
+static pasvpool_shm_t *s_shm;
+static int s_fds[PASVPOOL_MAX_PORTS];
+static unsigned int s_nports;
+static unsigned int s_pasv_ip;
+
+static void pasvpool_reserve_fds(unsigned int n);
+static void pasvpool_drain(int fd);
+
+/**
+ * 解析 pasv_address，并绑定端口池中的所有端口
+ * 须在成为守护进程之前调用，配置错误时能在终端看到出错信息
+ */
+void pasvpool_init(void) {
+    if (tunable_pasv_address != NULL) {
+        struct in_addr addr;
+        if (inet_aton(tunable_pasv_address, &addr) == 0) {
+            struct hostent *hp = gethostbyname(tunable_pasv_address);
+            if (hp == NULL) {
+                fprintf(stderr, "cannot resolve pasv_address %s\n", tunable_pasv_address);
+                exit(EXIT_FAILURE);
+            }
+            addr = *(struct in_addr *)hp->h_addr;
+        }
+        s_pasv_ip = addr.s_addr;
+    }
+
+    if (tunable_pasv_min_port == 0 && tunable_pasv_max_port == 0) {
+        return;
+    }
+    if (tunable_pasv_min_port == 0 || tunable_pasv_max_port > 65535
+        || tunable_pasv_min_port > tunable_pasv_max_port
+        || tunable_pasv_max_port - tunable_pasv_min_port + 1 > PASVPOOL_MAX_PORTS) {
+        fprintf(stderr, "invalid passive port range %u-%u (at most %d ports)\n",
+            tunable_pasv_min_port, tunable_pasv_max_port, PASVPOOL_MAX_PORTS);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned int n = tunable_pasv_max_port - tunable_pasv_min_port + 1;
+    pasvpool_reserve_fds(n);
+
+    s_shm = (pasvpool_shm_t *)mmap(NULL, sizeof(pasvpool_shm_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s_shm == MAP_FAILED) {
+        ERR_EXIT("mmap");
+    }
+    for (s_nports = 0; s_nports < n; s_nports++) {
+        s_fds[s_nports] = tcp_server(tunable_listen_address,
+            (unsigned short)(tunable_pasv_min_port + s_nports));
+        // 连接在 accept 之前被重置时 accept 不能阻塞，丢弃旧连接时也靠它结束
+        activate_nonblock(s_fds[s_nports]);
+    }
+}
+
+int pasvpool_enabled(void) {
+    return s_shm != NULL;
+}
+
+/**
+ * 为当前的 nobody 进程分配一个空闲端口
+ * 成功返回端口的编号，用于归还；没有空闲端口时返回 -1
+ * @fd 输出监听套接字，由端口池持有，不能关闭
+ * @port 输出端口号
+ */
+int pasvpool_acquire(int *fd, unsigned short *port) {
+    pid_t self = getpid();
+    int slot = -1;
+
+    // 从上次分配的位置之后开始查找，刚归还的端口不会马上再次分配
+    shm_lock(&s_shm->lock);
+    unsigned int i;
+    for (i = 0; i < s_nports; i++) {
+        unsigned int k = (s_shm->next + i) % s_nports;
+        pid_t owner = s_shm->owners[k];
+        if (owner == 0 || (kill(owner, 0) == -1 && errno == ESRCH)) {
+            s_shm->owners[k] = self;
+            s_shm->next = k + 1;
+            slot = (int)k;
+            break;
+        }
+    }
+    shm_unlock(&s_shm->lock);
+
+    if (slot == -1) {
+        return -1;
+    }
+    // 监听套接字在各会话之间复用，丢弃上一个会话之后才到达的连接
+    pasvpool_drain(s_fds[slot]);
+    *fd = s_fds[slot];
+    *port = (unsigned short)(tunable_pasv_min_port + slot);
+    return slot;
+}
+
+void pasvpool_release(int slot) {
+    shm_lock(&s_shm->lock);
+    s_shm->owners[slot] = 0;
+    shm_unlock(&s_shm->lock);
+}
+
+/**
+ * FTP 服务进程不接受数据连接，关闭继承来的监听套接字
+ */
+void pasvpool_close(void) {
+    unsigned int i;
+    for (i = 0; i < s_nports; i++) {
+        close(s_fds[i]);
+    }
+    s_nports = 0;
+}
+
+/**
+ * PASV 应答中的地址，网络字节序
+ * @local_ip 控制连接的本地地址，未配置 pasv_address 时使用
+ */
+unsigned int pasvpool_reply_ip(unsigned int local_ip) {
+    return s_pasv_ip != 0 ? s_pasv_ip : local_ip;
+}
+
+// 端口池与监听套接字同时需要 n 个文件描述符，软限制不足时提高到硬限制
+static void pasvpool_reserve_fds(unsigned int n) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        ERR_EXIT("getrlimit");
+    }
+    rlim_t need = n + 256;
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < need) {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > need) ? need : rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            ERR_EXIT("setrlimit");
+        }
+    }
+}
+
+static void pasvpool_drain(int fd) {
+    int conn;
+    while ((conn = accept(fd, NULL, NULL)) != -1) {
+        close(conn);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef _PASV_POOL_H_
+#define _PASV_POOL_H_
+
+// 被动模式的端口池与应答地址
+// 配置了 pasv_min_port 与 pasv_max_port 时，主进程在启动时绑定并监听范围内的所有端口，
+// 会话进程通过继承得到这些监听套接字；共享内存中记录每个端口由哪个 nobody 进程占用，
+// PASV 时取一个空闲端口，数据连接建立后归还，不必每次 PASV 都创建并绑定套接字
+// pasv_address 在启动时解析一次，未配置时使用控制连接的本地地址
+
+void pasvpool_init(void);
+int pasvpool_enabled(void);
+int pasvpool_acquire(int *fd, unsigned short *port);
+void pasvpool_release(int slot);
+void pasvpool_close(void);
+
+unsigned int pasvpool_reply_ip(unsigned int local_ip);
+
+#endif /* _PASV_POOL_H_ */
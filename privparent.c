@@ -2,13 +2,49 @@
 #include "privsock.h"
 #include "sysutil.h"
 #include "tunable.h"
+#include "pasvpool.h"
+#include "zcache.h"
+#include <sys/epoll.h>
+#include <stdint.h>
+
+// 共享 nobody 进程中的一个会话，只有特权操作用到的字段有效
+typedef struct broker_conn {
+    session_t sess;
+    // 已加入 epoll 的被动模式监听套接字与主动模式连接
+    int watched_fd;
+    int watched_connect_fd;
+    int closed;
+    struct broker_conn *prev;
+    struct broker_conn *next;
+} broker_conn_t;
+
+#define BROKER_MAX_EVENTS   64
+// epoll 事件中的指针带上这些标记表示监听套接字或主动模式连接，否则是会话的通道
+#define BROKER_LISTEN_TAG   ((uintptr_t)1)
+#define BROKER_CONNECT_TAG  ((uintptr_t)2)
+#define BROKER_TAG_MASK     (BROKER_LISTEN_TAG | BROKER_CONNECT_TAG)
 
 static int capset(cap_user_header_t hdrp, const cap_user_data_t datap);
 static void minimize_privilege();
-static void privop_pasv_get_data_sock(session_t *sess);
-static void privop_pasv_active(session_t *sess);
+static void privop_dispatch(session_t *sess, priv_msg_t *msg);
+static void privop_pasv_get_data_sock(session_t *sess, priv_msg_t *msg);
 static void privop_pasv_listen(session_t *sess);
 static void privop_pasv_accept(session_t *sess);
+static void privop_pasv_cancel(session_t *sess);
+static void privop_zcache_open(session_t *sess, priv_msg_t *msg);
+static int privop_wait_timeout(session_t *sess);
+static void port_conn_ready(session_t *sess);
+static void port_send_result(session_t *sess, int ok);
+static void pasv_conn_ready(session_t *sess);
+static void pasv_send_result(session_t *sess);
+static void pasv_listen_close(session_t *sess);
+static int pasv_listen_socket(unsigned int ip, unsigned short *port);
+static void privop_expire(session_t *sess);
+static void broker_add_session(int epfd, int reg_fd, broker_conn_t **conns);
+static void broker_watch(int epfd, broker_conn_t *conn);
+static int broker_watch_fd(int epfd, broker_conn_t *conn, int *watched, int fd,
+    uint32_t events, uintptr_t tag);
+static void broker_drop(int epfd, broker_conn_t *conn);
 
 static int capset(cap_user_header_t hdrp, const cap_user_data_t datap) {
     return syscall(__NR_capset, hdrp, datap);
@@ -16,14 +52,15 @@ static int capset(cap_user_header_t hdrp, const cap_user_data_t datap) {
 
 static void minimize_privilege() {
     // 把当前进程用户设置为 nobody 用户
-    struct passwd *pw = getpwnam("nobody");
-    if (pw == NULL) {
+    uid_t uid;
+    gid_t gid;
+    if (get_nobody(&uid, &gid) < 0) {
         return;
     }
-    if (setegid(pw->pw_gid) < 0) {
+    if (setegid(gid) < 0) {
         ERR_EXIT("setegid");
     }
-    if (seteuid(pw->pw_uid) < 0) {
+    if (seteuid(uid) < 0) {
         ERR_EXIT("seteuid");
     }
 
@@ -47,96 +84,476 @@ static void minimize_privilege() {
 void handle_parent(session_t *sess) {
     minimize_privilege();
 
-    char cmd;
+    priv_msg_t msg;
+    struct pollfd fds[3];
     while (1) {
-        //read(sess->parent_fd, &cmd, 1);
-        cmd = priv_sock_get_cmd(sess->parent_fd);
-        // 解析内部命令
-        // 处理内部命令
-        switch(cmd) {
-            case PRIV_SOCK_GET_DATA_SOCK:
-                privop_pasv_get_data_sock(sess);
-                break;
-            case PRIV_SOCK_PASV_ACTIVE:
-                privop_pasv_active(sess);
-                break;
-            case PRIV_SOCK_PASV_LISTEN:
-                privop_pasv_listen(sess);
-                break;
-            case PRIV_SOCK_PASV_ACCEPT:
-                privop_pasv_accept(sess);
-                break;
+        // 等待内部命令的同时接受被动模式的数据连接，连接一到达就接受，
+        // 传输命令到来时 FTP 服务进程可以直接取得数据连接
+        // 主动模式的连接也在这里等待完成
+        fds[0].fd = sess->parent_fd;
+        fds[0].events = POLLIN;
+        int nfds = 1;
+        int listen_idx = -1;
+        int connect_idx = -1;
+        if (sess->pasv_listen_fd != -1) {
+            listen_idx = nfds++;
+            fds[listen_idx].fd = sess->pasv_listen_fd;
+            fds[listen_idx].events = POLLIN;
+        }
+        if (sess->port_connect_fd != -1) {
+            connect_idx = nfds++;
+            fds[connect_idx].fd = sess->port_connect_fd;
+            fds[connect_idx].events = POLLOUT;
+        }
+        int ret = poll(fds, nfds, privop_wait_timeout(sess));
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR_EXIT("poll");
+        }
+        if (ret == 0) {
+            privop_expire(sess);
+            continue;
+        }
+        if (listen_idx != -1 && (fds[listen_idx].revents & POLLIN)) {
+            pasv_conn_ready(sess);
+        }
+        if (connect_idx != -1 && fds[connect_idx].revents != 0) {
+            port_conn_ready(sess);
+        }
+        if ( ! (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
         }
+
+        priv_sock_recv(sess->parent_fd, &msg);
+        privop_dispatch(sess, &msg);
     }
 }
 
-static void privop_pasv_get_data_sock(session_t *sess){
+/**
+ * 共享的 nobody 进程，为登记到 reg_fd 上的所有会话执行特权操作
+ * 各会话的通道与被动模式监听套接字都加入同一个 epoll，
+ * 会话的 FTP 服务进程退出时只清理该会话，不影响其他会话
+ */
+void handle_broker(int reg_fd) {
+    minimize_privilege();
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        ERR_EXIT("epoll_create1");
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, reg_fd, &ev) == -1) {
+        ERR_EXIT("epoll_ctl");
+    }
+
+    broker_conn_t *conns = NULL;
+    struct epoll_event events[BROKER_MAX_EVENTS];
+    long last_scan = get_time_sec();
+    while (1) {
+        // 有会话时每秒醒来一次，检查等待数据连接的超时
+        int n = epoll_wait(epfd, events, BROKER_MAX_EVENTS, conns != NULL ? 1000 : -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR_EXIT("epoll_wait");
+        }
+
+        int i;
+        for (i = 0; i < n; i++) {
+            uintptr_t tag = (uintptr_t)events[i].data.ptr;
+            broker_conn_t *conn = (broker_conn_t *)(tag & ~BROKER_TAG_MASK);
+            if (conn == NULL) {
+                broker_add_session(epfd, reg_fd, &conns);
+                continue;
+            }
+            // 同一批事件中已断开的会话
+            if (conn->closed) {
+                continue;
+            }
+            if (tag & BROKER_LISTEN_TAG) {
+                pasv_conn_ready(&conn->sess);
+            } else if (tag & BROKER_CONNECT_TAG) {
+                port_conn_ready(&conn->sess);
+            } else {
+                priv_msg_t msg;
+                if (priv_sock_try_recv(conn->sess.parent_fd, &msg) < 0) {
+                    broker_drop(epfd, conn);
+                    continue;
+                }
+                privop_dispatch(&conn->sess, &msg);
+            }
+            broker_watch(epfd, conn);
+        }
+
+        long now = get_time_sec();
+        broker_conn_t *conn = conns;
+        while (conn != NULL) {
+            broker_conn_t *next = conn->next;
+            if (conn->closed) {
+                if (conn->prev != NULL) {
+                    conn->prev->next = next;
+                } else {
+                    conns = next;
+                }
+                if (next != NULL) {
+                    next->prev = conn->prev;
+                }
+                free(conn);
+            } else if (now != last_scan && privop_wait_timeout(&conn->sess) == 0) {
+                privop_expire(&conn->sess);
+                broker_watch(epfd, conn);
+            }
+            conn = next;
+        }
+        last_scan = now;
+    }
+}
+
+// 解析并处理一条内部命令
+static void privop_dispatch(session_t *sess, priv_msg_t *msg) {
+    switch(msg->code) {
+        case PRIV_SOCK_GET_DATA_SOCK:
+            privop_pasv_get_data_sock(sess, msg);
+            break;
+        case PRIV_SOCK_PASV_LISTEN:
+            privop_pasv_listen(sess);
+            break;
+        case PRIV_SOCK_PASV_ACCEPT:
+            privop_pasv_accept(sess);
+            break;
+        case PRIV_SOCK_PASV_CANCEL:
+            privop_pasv_cancel(sess);
+            break;
+        case PRIV_SOCK_ZCACHE_OPEN:
+            privop_zcache_open(sess, msg);
+            break;
+    }
+    if (msg->fd != -1) {
+        close(msg->fd);
+    }
+}
+
+static void privop_pasv_get_data_sock(session_t *sess, priv_msg_t *msg){
     /*
     nobody进程接收PRIV_SOCK_GET_DATA_SOCK命令
-    进一步接收一个整数，也就是port
-    接收一个字符串，也就是ip
+    消息数据为客户端 PORT 命令给出的地址
     */
-    unsigned short port = (unsigned short)priv_sock_get_int(sess->parent_fd);
-    char ip[16] = {0};
-    priv_sock_recv_buf(sess->parent_fd, ip, sizeof(ip));
+    struct sockaddr_in addr;
+    if (msg->len != sizeof(addr)) {
+        priv_sock_send(sess->parent_fd, PRIV_SOCK_RESULT_BAD, 0, NULL, 0, -1);
+        return;
+    }
+    memcpy(&addr, msg->data, sizeof(addr));
 
+    // 从控制连接的本地地址的 20 端口发起连接，不等待连接完成，完成或超时时再应答
+    sess->port_connect_fd = tcp_client(sess->local_ip, 20);
+    if (sess->port_connect_fd == -1) {
+        port_send_result(sess, 0);
+        return;
+    }
+    activate_nonblock(sess->port_connect_fd);
+    if (connect(sess->port_connect_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        port_send_result(sess, 1);
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        port_send_result(sess, 0);
+        return;
+    }
+    sess->port_deadline = tunable_connect_timeout > 0 ? get_time_sec() + tunable_connect_timeout : 0;
+}
+
+static void privop_pasv_listen(session_t *sess){
+    // FTP 服务进程在再次 PASV 之前已发出 PASV_CANCEL，这里只是保险
+    privop_pasv_cancel(sess);
+
+    // 端口池中没有空闲端口时应答失败
+    unsigned short port = 0;
+    if (pasvpool_enabled()) {
+        int fd;
+        sess->pasv_pool_slot = pasvpool_acquire(&fd, &port);
+        if (sess->pasv_pool_slot != -1) {
+            sess->pasv_listen_fd = fd;
+        }
+    } else {
+        sess->pasv_listen_fd = pasv_listen_socket(sess->local_ip, &port);
+    }
+
+    priv_sock_send(sess->parent_fd, port != 0 ? PRIV_SOCK_RESULT_OK : PRIV_SOCK_RESULT_BAD,
+        (int)port, NULL, 0, -1);
+}
+
+/**
+ * 在控制连接的本地地址上监听一个临时端口，失败时返回 -1
+ * 描述符用尽或绑定失败只让这次 PASV 失败，共享的 nobody 进程不能因此退出
+ */
+static int pasv_listen_socket(unsigned int ip, unsigned short *port) {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        return -1;
+    }
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_addr.s_addr = ip;
+    addr.sin_port = 0;
+    socklen_t addrlen = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0
+        || getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
 
-    int fd = tcp_client(20);
-    if (fd == -1) {
-        priv_sock_send_result(sess->parent_fd, PRIV_SOCK_RESULT_BAD);
+// 数据连接已到达时立即应答，否则从现在开始计算等待的超时
+static void privop_pasv_accept(session_t *sess){
+    sess->pasv_accepting = 1;
+    if (sess->pasv_conn_fd != -1 || sess->pasv_listen_fd == -1) {
+        pasv_send_result(sess);
         return;
     }
-    if (connect_timeout(fd, &addr, tunable_connect_timeout) < 0) {
-        close(fd);
-        priv_sock_send_result(sess->parent_fd, PRIV_SOCK_RESULT_BAD);
+    sess->pasv_deadline = tunable_accept_timeout > 0 ? get_time_sec() + tunable_accept_timeout : 0;
+}
+
+// 放弃这次被动模式，尚未应答的 PASV_ACCEPT 以失败应答
+static void privop_pasv_cancel(session_t *sess){
+    pasv_listen_close(sess);
+    if (sess->pasv_conn_fd != -1) {
+        close(sess->pasv_conn_fd);
+        sess->pasv_conn_fd = -1;
+    }
+    if (sess->pasv_accepting) {
+        pasv_send_result(sess);
+    }
+}
+
+// 缓存目录只有 nobody 可以访问，由这里打开缓存文件交给 FTP 服务进程
+static void privop_zcache_open(session_t *sess, priv_msg_t *msg) {
+    long long range[2];
+    int fd = msg->fd != -1 ? zcache_open(msg->fd, &range[0], &range[1]) : -1;
+    if (fd == -1) {
+        priv_sock_send(sess->parent_fd, PRIV_SOCK_RESULT_BAD, 0, NULL, 0, -1);
         return;
     }
-    priv_sock_send_result(sess->parent_fd, PRIV_SOCK_RESULT_OK);
-    priv_sock_send_fd(sess->parent_fd, fd);
+    priv_sock_send(sess->parent_fd, PRIV_SOCK_RESULT_OK, 0, range, sizeof(range), fd);
     close(fd);
 }
 
-static void privop_pasv_active(session_t *sess){
-    int active;
-    if (sess->pasv_listen_fd != -1) {
-        active = 1;
-    } else {
-        active = 0;
+// poll 的超时，单位毫秒，不在等待数据连接时为 -1
+static int privop_wait_timeout(session_t *sess) {
+    long deadline = 0;
+    if (sess->pasv_accepting && sess->pasv_listen_fd != -1) {
+        deadline = sess->pasv_deadline;
+    }
+    if (sess->port_connect_fd != -1 && sess->port_deadline != 0
+        && (deadline == 0 || sess->port_deadline < deadline)) {
+        deadline = sess->port_deadline;
     }
-    priv_sock_send_int(sess->parent_fd, active);
+    if (deadline == 0) {
+        return -1;
+    }
+    long left = deadline - get_time_sec();
+    return left > 0 ? (int)(left * 1000) : 0;
 }
 
-static void privop_pasv_listen(session_t *sess){
-    char ip[16] = {0};
-    getlocalip(ip);
+// 主动模式的连接已完成或出错
+static void port_conn_ready(session_t *sess) {
+    // 同一批 epoll 事件中连接可能已被换掉，尚未完成时 SO_ERROR 也为 0，须再确认一次
+    struct pollfd pfd;
+    pfd.fd = sess->port_connect_fd;
+    pfd.events = POLLOUT;
+    if (pfd.fd == -1 || poll(&pfd, 1, 0) != 1) {
+        return;
+    }
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    if (getsockopt(sess->port_connect_fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+        err = errno;
+    }
+    port_send_result(sess, err == 0);
+}
+
+// 应答 GET_DATA_SOCK，成功时附带已连接的数据套接字
+static void port_send_result(session_t *sess, int ok) {
+    if (ok) {
+        deactivate_nonblock(sess->port_connect_fd);
+        priv_sock_send(sess->parent_fd, PRIV_SOCK_RESULT_OK, 0, NULL, 0, sess->port_connect_fd);
+    } else {
+        priv_sock_send(sess->parent_fd, PRIV_SOCK_RESULT_BAD, 0, NULL, 0, -1);
+    }
+    if (sess->port_connect_fd != -1) {
+        close(sess->port_connect_fd);
+        sess->port_connect_fd = -1;
+    }
+    sess->port_deadline = 0;
+}
 
-    sess->pasv_listen_fd = tcp_server(ip, 0);
+static void pasv_conn_ready(session_t *sess) {
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
-    if (getsockname(sess->pasv_listen_fd, (struct sockaddr *)&addr, &addrlen) < 0) {
-        ERR_EXIT("getsockname");
+    int fd = accept(sess->pasv_listen_fd, (struct sockaddr *)&addr, &addrlen);
+    if (fd == -1) {
+        // 连接在接受之前已被重置
+        return;
+    }
+    // 端口池的端口号是固定的，只接受来自控制连接对端的数据连接，其他连接不影响继续等待
+    if (addr.sin_addr.s_addr != sess->client_ip) {
+        close(fd);
+        return;
     }
-    unsigned short port = ntohs(addr.sin_port);
 
-    priv_sock_send_int(sess->parent_fd, (int)port);
+    pasv_listen_close(sess);
+    sess->pasv_conn_fd = fd;
+    if (sess->pasv_accepting) {
+        pasv_send_result(sess);
+    }
 }
 
-static void privop_pasv_accept(session_t *sess){
-    int fd = accept_timeout(sess->pasv_listen_fd, NULL, tunable_accept_timeout);
-    close(sess->pasv_listen_fd);
+// 应答 PASV_ACCEPT，没有数据连接时为失败
+static void pasv_send_result(session_t *sess) {
+    sess->pasv_accepting = 0;
+    if (sess->pasv_conn_fd == -1) {
+        priv_sock_send(sess->parent_fd, PRIV_SOCK_RESULT_BAD, 0, NULL, 0, -1);
+        return;
+    }
+
+    priv_sock_send(sess->parent_fd, PRIV_SOCK_RESULT_OK, 0, NULL, 0, sess->pasv_conn_fd);
+    close(sess->pasv_conn_fd);
+    sess->pasv_conn_fd = -1;
+}
+
+// 关闭监听套接字，端口池中的套接字只归还不关闭
+static void pasv_listen_close(session_t *sess) {
+    if (sess->pasv_listen_fd == -1) {
+        return;
+    }
+    if (sess->pasv_pool_slot != -1) {
+        pasvpool_release(sess->pasv_pool_slot);
+        sess->pasv_pool_slot = -1;
+    } else {
+        close(sess->pasv_listen_fd);
+    }
     sess->pasv_listen_fd = -1;
+}
 
-    if (fd == -1) {
-        priv_sock_send_result(sess->parent_fd, PRIV_SOCK_RESULT_BAD);
+// 等待数据连接或主动模式连接超时
+static void privop_expire(session_t *sess) {
+    long now = get_time_sec();
+    if (sess->port_connect_fd != -1 && sess->port_deadline != 0 && now >= sess->port_deadline) {
+        port_send_result(sess, 0);
+    }
+    if (sess->pasv_accepting && sess->pasv_listen_fd != -1 && sess->pasv_deadline != 0
+        && now >= sess->pasv_deadline) {
+        pasv_listen_close(sess);
+        pasv_send_result(sess);
+    }
+}
+
+/**
+ * 接收一个会话的登记，消息数据为客户端与本地地址，附带会话的通道
+ * 描述符用尽（MSG_CTRUNC）、消息错误或内存不足时只丢弃这次登记，
+ * 该会话的 FTP 服务进程发现通道关闭后退出，其他会话不受影响
+ */
+static void broker_add_session(int epfd, int reg_fd, broker_conn_t **conns) {
+    priv_msg_t msg;
+    unsigned int addrs[2];
+    if (priv_sock_try_recv(reg_fd, &msg) < 0) {
         return;
     }
+    if (msg.code != PRIV_SOCK_REGISTER || msg.len != sizeof(addrs) || msg.fd == -1) {
+        if (msg.fd != -1) {
+            close(msg.fd);
+        }
+        return;
+    }
+    memcpy(addrs, msg.data, sizeof(addrs));
 
-    priv_sock_send_result(sess->parent_fd, PRIV_SOCK_RESULT_OK);
-    priv_sock_send_fd(sess->parent_fd, fd);
-    close(fd);
+    broker_conn_t *conn = (broker_conn_t *)calloc(1, sizeof(broker_conn_t));
+    if (conn == NULL) {
+        close(msg.fd);
+        return;
+    }
+    conn->sess.parent_fd = msg.fd;
+    conn->sess.client_ip = addrs[0];
+    conn->sess.local_ip = addrs[1];
+    conn->sess.pasv_listen_fd = -1;
+    conn->sess.pasv_pool_slot = -1;
+    conn->sess.pasv_conn_fd = -1;
+    conn->sess.port_connect_fd = -1;
+    conn->watched_fd = -1;
+    conn->watched_connect_fd = -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sess.parent_fd, &ev) == -1) {
+        close(conn->sess.parent_fd);
+        free(conn);
+        return;
+    }
+    conn->next = *conns;
+    if (*conns != NULL) {
+        (*conns)->prev = conn;
+    }
+    *conns = conn;
+}
+
+// 处理完一个事件后，使 epoll 中的套接字与会话当前的监听套接字、主动模式连接一致
+static void broker_watch(int epfd, broker_conn_t *conn) {
+    // 不能等待数据连接时只放弃这个会话
+    if (broker_watch_fd(epfd, conn, &conn->watched_fd, conn->sess.pasv_listen_fd,
+            EPOLLIN, BROKER_LISTEN_TAG) < 0
+        || broker_watch_fd(epfd, conn, &conn->watched_connect_fd, conn->sess.port_connect_fd,
+            EPOLLOUT, BROKER_CONNECT_TAG) < 0) {
+        broker_drop(epfd, conn);
+    }
+}
+
+/**
+ * 被关闭的套接字已由内核从 epoll 中移除，DEL 失败可以忽略；
+ * 关闭后新建的套接字可能得到相同的描述符，因此总是尝试 ADD
+ * ADD 失败返回 -1
+ */
+static int broker_watch_fd(int epfd, broker_conn_t *conn, int *watched, int fd,
+    uint32_t events, uintptr_t tag) {
+    if (*watched != -1 && *watched != fd) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, *watched, NULL);
+    }
+    *watched = -1;
+    if (fd != -1) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = (void *)((uintptr_t)conn | tag);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    *watched = fd;
+    return 0;
+}
+
+// FTP 服务进程已退出，释放会话占用的端口与描述符，内存在本批事件处理完后释放
+static void broker_drop(int epfd, broker_conn_t *conn) {
+    session_t *sess = &conn->sess;
+    if (sess->pasv_listen_fd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, sess->pasv_listen_fd, NULL);
+    }
+    pasv_listen_close(sess);
+    if (sess->pasv_conn_fd != -1) {
+        close(sess->pasv_conn_fd);
+        sess->pasv_conn_fd = -1;
+    }
+    if (sess->port_connect_fd != -1) {
+        close(sess->port_connect_fd);
+        sess->port_connect_fd = -1;
+    }
+    close(sess->parent_fd);
+    conn->closed = 1;
 }
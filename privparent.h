@@ -5,5 +5,6 @@
 #include "common.h"
 
 void handle_parent(session_t *sess);
+void handle_broker(int reg_fd);
 
 #endif
\ No newline at end of file
@@ -1,10 +1,11 @@
 #include "privsock.h"
 #include "common.h"
 #include "sysutil.h"
+#include <stddef.h>
 
 void priv_sock_init(session_t *sess) {
     int sockfds[2];
-    if (socketpair(PF_UNIX, SOCK_STREAM, 0, sockfds) < 0) {
+    if (socketpair(PF_UNIX, SOCK_SEQPACKET, 0, sockfds) < 0) {
         ERR_EXIT("socketpair");
     }
     sess->parent_fd = sockfds[0];
@@ -36,88 +37,96 @@ void priv_sock_set_child_context(session_t *sess) {
     }
 }
 
-
-void priv_sock_send_cmd(int fd, char cmd) {
-    int ret = writen(fd, &cmd, sizeof(cmd));
-    if (ret != sizeof(cmd)) {
-        fprintf(stderr, "priv_sock_send_cmd error\n");
-        exit(EXIT_FAILURE);
-    }
-}
-
-char priv_sock_get_cmd(int fd) {
-    char res;
-    int ret = readn(fd, &res, sizeof(res));
-    if (ret != sizeof(res)) {
-        fprintf(stderr, "priv_sock_get_cmd error\n");
-        exit(EXIT_FAILURE);
-    }
-    return res;
-}
-
-void priv_sock_send_result(int fd, char res) {
-    int ret = writen(fd, &res, sizeof(res));
-    if (ret != sizeof(res)) {
-        fprintf(stderr, "priv_sock_send_result error\n");
+// 消息在套接字上的格式，不含 fd
+#define PRIV_MSG_HEADER_SIZE    offsetof(priv_msg_t, data)
+
+/**
+ * 发送一条消息，对方已关闭时返回 -1，由之后的接收发现并处理
+ * @data 参数数据，不超过 PRIV_MSG_MAX_DATA 字节，可以为 NULL
+ * @fd 随消息传递的描述符，-1 表示没有
+ */
+int priv_sock_send(int sock_fd, char code, int arg, const void *data, unsigned int len, int fd) {
+    if (len > PRIV_MSG_MAX_DATA) {
+        fprintf(stderr, "priv_sock_send error\n");
         exit(EXIT_FAILURE);
     }
-}
-
-char priv_sock_get_result(int fd) {
-    char res;
-    int ret = readn(fd, &res, sizeof(res));
-    if (ret != sizeof(res)) {
-        fprintf(stderr, "priv_sock_get_result error\n");
-        exit(EXIT_FAILURE);
+    priv_msg_t msg;
+    memset(&msg, 0, PRIV_MSG_HEADER_SIZE);
+    msg.code = code;
+    msg.arg = arg;
+    msg.len = len;
+    if (len > 0) {
+        memcpy(msg.data, data, len);
     }
-    return res;
-}
-
 
-void priv_sock_send_int(int fd, int the_int) {
-    int ret = writen(fd, &the_int, sizeof(the_int));
-    if (ret != sizeof(the_int)) {
-        fprintf(stderr, "priv_sock_send_int error\n");
-        exit(EXIT_FAILURE);
+    struct iovec vec;
+    vec.iov_base = &msg;
+    vec.iov_len = PRIV_MSG_HEADER_SIZE + len;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &vec;
+    hdr.msg_iovlen = 1;
+
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+    if (fd != -1) {
+        hdr.msg_control = cmsgbuf;
+        hdr.msg_controllen = sizeof(cmsgbuf);
+        struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&hdr);
+        p_cmsg->cmsg_level = SOL_SOCKET;
+        p_cmsg->cmsg_type = SCM_RIGHTS;
+        p_cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(p_cmsg), &fd, sizeof(int));
     }
-}
 
-int priv_sock_get_int(int fd) {
-    int the_int;
-    int ret = readn(fd, &the_int, sizeof(the_int));
-    if (ret != sizeof(the_int)) {
-        fprintf(stderr, "priv_sock_get_int error\n");
-        exit(EXIT_FAILURE);
-    }
-    return the_int;
+    int ret;
+    do {
+        ret = sendmsg(sock_fd, &hdr, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+    return ret == (int)vec.iov_len ? 0 : -1;
 }
 
-void priv_sock_send_buf(int fd, const char *buf, unsigned int len) {
-    priv_sock_send_int(fd, (int)len);
-    int ret = writen(fd, buf, len);
-    if (ret != len) {
-        fprintf(stderr, "priv_sock_send_buf error\n");
+/**
+ * 接收一条消息，对方已关闭或消息格式错误时退出进程
+ */
+void priv_sock_recv(int sock_fd, priv_msg_t *msg) {
+    if (priv_sock_try_recv(sock_fd, msg) < 0) {
+        fprintf(stderr, "priv_sock_recv error\n");
         exit(EXIT_FAILURE);
     }
 }
 
-void priv_sock_recv_buf(int fd, char *buf, unsigned int len) {
-    unsigned int recv_len = (unsigned int)priv_sock_get_int(fd);
-    if (recv_len > len) {
-        fprintf(stderr, "priv_sock_recv_buf error\n");
-        exit(EXIT_FAILURE);
+/**
+ * 接收一条消息，对方已关闭或消息格式错误时返回 -1
+ * 共享的 nobody 进程用它处理单个会话的断开
+ */
+int priv_sock_try_recv(int sock_fd, priv_msg_t *msg) {
+    struct iovec vec;
+    vec.iov_base = msg;
+    vec.iov_len = PRIV_MSG_HEADER_SIZE + PRIV_MSG_MAX_DATA;
+    char cmsgbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &vec;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = cmsgbuf;
+    hdr.msg_controllen = sizeof(cmsgbuf);
+
+    int ret;
+    do {
+        ret = recvmsg(sock_fd, &hdr, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+    msg->fd = -1;
+    struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&hdr);
+    if (ret > 0 && p_cmsg != NULL && p_cmsg->cmsg_level == SOL_SOCKET
+        && p_cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&msg->fd, CMSG_DATA(p_cmsg), sizeof(int));
     }
-    int ret = readn(fd, buf, recv_len);
-    if (ret != recv_len) {
-        fprintf(stderr, "priv_sock_recv_buf error\n");
-        exit(EXIT_FAILURE);
+    if (ret < (int)PRIV_MSG_HEADER_SIZE || ret != (int)(PRIV_MSG_HEADER_SIZE + msg->len)
+        || (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (msg->fd != -1) {
+            close(msg->fd);
+        }
+        return -1;
     }
-}
-
-void priv_sock_send_fd(int sock_fd, int fd) {
-    send_fd(sock_fd, fd);
-}
-
-int priv_sock_recv_fd(int sock_fd) {
-    return recv_fd(sock_fd);
+    return 0;
 }
@@ -5,32 +5,45 @@
 
 // 内部进程自定义通信协议
 // 用于 FTP 服务进程与 nobody 进程通信
+// 每个请求与应答都是一条定长头部加可选数据的消息，由一次 sendmsg 发出，
+// 需要传递的描述符以 SCM_RIGHTS 附在同一条消息上；套接字对为 SOCK_SEQPACKET，保留消息边界
 
 // FTP 服务进程向 nobody 进程请求的命令
+// PASV_ACCEPT 紧跟在 PASV_LISTEN 之后发出，nobody 进程在连接到达或超时后才应答
+// 放弃这次被动模式时发出 PASV_CANCEL，它没有应答，之后读取 PASV_ACCEPT 的结果
 #define PRIV_SOCK_GET_DATA_SOCK     1
-#define PRIV_SOCK_PASV_ACTIVE       2
 #define PRIV_SOCK_PASV_LISTEN       3
 #define PRIV_SOCK_PASV_ACCEPT       4
+#define PRIV_SOCK_PASV_CANCEL       5
+
+// 会话进程向共享的 nobody 进程登记，附带会话通道的一端，数据为客户端与本地地址
+#define PRIV_SOCK_REGISTER          6
+
+// 打开附带的源文件描述符对应的压缩缓存，应答附带缓存文件，数据为压缩数据的偏移与长度
+#define PRIV_SOCK_ZCACHE_OPEN       7
 
 // nobody 进程对 FTP 服务进程的应答
 #define PRIV_SOCK_RESULT_OK         1
 #define PRIV_SOCK_RESULT_BAD        2
 
+#define PRIV_MSG_MAX_DATA           64
+
+// 一条消息：code 为命令或应答结果，arg 与 data 为参数
+typedef struct priv_msg {
+    char code;
+    int arg;
+    unsigned int len;
+    char data[PRIV_MSG_MAX_DATA];
+    int fd;     // 随消息收到的描述符，没有时为 -1，不在消息体中传输
+} priv_msg_t;
+
 void priv_sock_init(session_t *sess);
 void priv_sock_close(session_t *sess);
 void priv_sock_set_parent_context(session_t *sess);
 void priv_sock_set_child_context(session_t *sess);
 
-void priv_sock_send_cmd(int fd, char cmd);
-char priv_sock_get_cmd(int fd);
-void priv_sock_send_result(int fd, char res);
-char priv_sock_get_result(int fd);
-
-void priv_sock_send_int(int fd, int the_int);
-int priv_sock_get_int(int fd);
-void priv_sock_send_buf(int fd, const char *buf, unsigned int len);
-void priv_sock_recv_buf(int fd, char *buf, unsigned int len);
-void priv_sock_send_fd(int sock_fd, int fd);
-int priv_sock_recv_fd(int sock_fd);
+int priv_sock_send(int sock_fd, char code, int arg, const void *data, unsigned int len, int fd);
+void priv_sock_recv(int sock_fd, priv_msg_t *msg);
+int priv_sock_try_recv(int sock_fd, priv_msg_t *msg);
 
 #endif
\ No newline at end of file
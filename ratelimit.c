@@ -0,0 +1,90 @@
+#include "ratelimit.h"
+#include "common.h"
+#include "sysutil.h"
+
+static long long ratelimit_clock_monotonic(void);
+static void ratelimit_refill(ratelimit_t *rl);
+
+static ratelimit_clock_t s_clock = ratelimit_clock_monotonic;
+static ratelimit_sleep_t s_sleep = nano_sleep;
+
+/**
+ * 初始化令牌桶
+ * 桶初始为空，避免传输开始时的突发使平均速率超出上限
+ * @rate 每秒字节数，0 表示不限速
+ * @burst 桶容量，0 表示取 1/10 秒的配额
+ */
+void ratelimit_init(ratelimit_t *rl, unsigned int rate, unsigned int burst) {
+    rl->rate = rate;
+    if (burst == 0) {
+        burst = rate / 10;
+    }
+    rl->burst = burst > 0 ? burst : 1;
+    rl->tokens = 0;
+    rl->last_ns = s_clock();
+}
+
+/**
+ * 申请传输 want 字节，令牌不足时先等待
+ * 返回本次允许传输的字节数，不超过 want 与桶容量
+ */
+size_t ratelimit_grant(ratelimit_t *rl, size_t want) {
+    if (rl->rate == 0 || want == 0) {
+        return want;
+    }
+
+    // 至少等到足够传输一个完整分块，避免产生大量零碎的小分块
+    // 分块不小于半个桶时只等半个桶，睡过头期间补充的令牌还能放进桶里，不会因溢出而损失速率
+    double half = rl->burst / 2.0;
+    double need = (double)want < half ? (double)want : half;
+    ratelimit_refill(rl);
+    while (rl->tokens < need) {
+        s_sleep((need - rl->tokens) / (double)rl->rate);
+        ratelimit_refill(rl);
+    }
+
+    return rl->tokens >= (double)want ? want : (size_t)rl->tokens;
+}
+
+/**
+ * 扣除实际传输的字节数
+ */
+void ratelimit_consume(ratelimit_t *rl, size_t used) {
+    if (rl->rate == 0) {
+        return;
+    }
+    rl->tokens -= (double)used;
+}
+
+void ratelimit_set_clock(ratelimit_clock_t clock, ratelimit_sleep_t sleep) {
+    s_clock = clock;
+    s_sleep = sleep;
+}
+
+// 当前时刻，单位为纳秒
+long long ratelimit_now(void) {
+    return s_clock();
+}
+
+void ratelimit_sleep(double seconds) {
+    s_sleep(seconds);
+}
+
+static long long ratelimit_clock_monotonic(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        ERR_EXIT("clock_gettime");
+    }
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void ratelimit_refill(ratelimit_t *rl) {
+    long long now = s_clock();
+    if (now > rl->last_ns) {
+        rl->tokens += (double)(now - rl->last_ns) * (double)rl->rate / 1e9;
+        if (rl->tokens > (double)rl->burst) {
+            rl->tokens = rl->burst;
+        }
+    }
+    rl->last_ns = now;
+}
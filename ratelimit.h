@@ -0,0 +1,28 @@
+#ifndef _RATE_LIMIT_H_
+#define _RATE_LIMIT_H_
+
+#include <stddef.h>
+
+// 令牌桶限速器
+// 令牌以 rate 字节/秒的速度补充，最多积累 burst 字节
+// 传输前先用 ratelimit_grant 申请本次可传输的字节数，传输后用 ratelimit_consume 扣除
+typedef struct ratelimit {
+    unsigned int rate;
+    unsigned int burst;
+    double tokens;
+    long long last_ns;
+} ratelimit_t;
+
+typedef long long (*ratelimit_clock_t)(void);
+typedef void (*ratelimit_sleep_t)(double seconds);
+
+void ratelimit_init(ratelimit_t *rl, unsigned int rate, unsigned int burst);
+size_t ratelimit_grant(ratelimit_t *rl, size_t want);
+void ratelimit_consume(ratelimit_t *rl, size_t used);
+
+// 替换时钟与睡眠函数，用于以模拟时钟驱动限速器，见 ratelimit_test.c
+void ratelimit_set_clock(ratelimit_clock_t clock, ratelimit_sleep_t sleep);
+long long ratelimit_now(void);
+void ratelimit_sleep(double seconds);
+
+#endif /* _RATE_LIMIT_H_ */
@@ -0,0 +1,101 @@
+#include "ratelimit.h"
+#include <stdio.h>
+#include <math.h>
+
+// 以模拟时钟驱动令牌桶，检查各种速率、桶容量与分块大小下实际速率与上限的偏差
+// 模拟时钟只在睡眠时前进，传输本身不花时间，是限速器最难限住的情况
+// 用法：make test-ratelimit
+
+#define TEST_DURATION_SEC   10.0
+#define TEST_TOLERANCE      0.03
+
+static long long s_fake_ns;
+// 模拟调度延迟：每次睡眠多睡的时间
+static long long s_oversleep_ns;
+
+static long long fake_clock(void) {
+    return s_fake_ns;
+}
+
+// 按纳秒向上取整，与真实的睡眠一样至少前进一个时钟单位
+static void fake_sleep(double seconds) {
+    long long ns = (long long)ceil(seconds * 1e9);
+    s_fake_ns += (ns > 0 ? ns : 1) + s_oversleep_ns;
+}
+
+/**
+ * 以 chunk 字节的分块持续传输，返回实际速率与上限之比
+ * 每次只传输 grant 允许的一部分时模拟短写
+ */
+static double run(unsigned int rate, unsigned int burst, size_t chunk, int short_write) {
+    ratelimit_t rl;
+    s_fake_ns = 1000000000LL;
+    ratelimit_init(&rl, rate, burst);
+    // 结束时桶里最多剩下一桶没用完的令牌，传输时间为装满一桶的 100 倍以上时误差不超过 1%
+    double duration = 100.0 * rl.burst / rate;
+    if (duration < TEST_DURATION_SEC) {
+        duration = TEST_DURATION_SEC;
+    }
+    long long start = s_fake_ns;
+    long long end = start + (long long)(duration * 1e9);
+
+    double total = 0;
+    while (s_fake_ns < end) {
+        size_t n = ratelimit_grant(&rl, chunk);
+        if (short_write && n > 1) {
+            n = n / 2 + 1;
+        }
+        ratelimit_consume(&rl, n);
+        total += (double)n;
+    }
+    double elapsed = (double)(s_fake_ns - start) / 1e9;
+    return total / elapsed / (double)rate;
+}
+
+int main(void) {
+    static const unsigned int rates[] = {1024, 1024 * 1024, 1024 * 1024 * 1024};
+    static const unsigned int bursts[] = {0, 4096, 65536, 1024 * 1024};
+    static const size_t chunks[] = {512, 4096, 65536, 1024 * 1024};
+    static const long long oversleeps[] = {0, 50000};
+
+    ratelimit_set_clock(fake_clock, fake_sleep);
+
+    int failed = 0;
+    int cases = 0;
+    size_t r, b, c, o;
+    int s;
+    for (r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        for (b = 0; b < sizeof(bursts) / sizeof(bursts[0]); b++) {
+            for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+                for (o = 0; o < sizeof(oversleeps) / sizeof(oversleeps[0]); o++) {
+                    for (s = 0; s <= 1; s++) {
+                        unsigned int rate = rates[r];
+                        unsigned int burst = bursts[b];
+                        // 每秒不到一个分块时测不出平均速率
+                        if (chunks[c] > rate) {
+                            continue;
+                        }
+                        // 多睡的时间里积累的令牌超出桶容量时，速率必然低于上限，不属于限速器的误差
+                        unsigned int effective = burst > 0 ? burst : rate / 10;
+                        if ((double)oversleeps[o] * rate / 1e9 > effective / 2.0) {
+                            continue;
+                        }
+                        s_oversleep_ns = oversleeps[o];
+                        double ratio = run(rate, burst, chunks[c], s);
+                        int ok = fabs(ratio - 1.0) <= TEST_TOLERANCE;
+                        cases++;
+                        if ( ! ok) {
+                            failed++;
+                        }
+                        printf("%s rate=%u burst=%u chunk=%zu oversleep=%lldus short=%d achieved=%.4f\n",
+                            ok ? "ok  " : "FAIL", rate, burst, chunks[c], oversleeps[o] / 1000, s,
+                            ratio);
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%d/%d cases within %.0f%% of the cap\n", cases - failed, cases, TEST_TOLERANCE * 100);
+    return failed == 0 ? 0 : 1;
+}
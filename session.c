@@ -3,16 +3,39 @@
 #include "ftpproto.h"
 #include "privsock.h"
 #include "sysutil.h"
+#include "pasvpool.h"
+#include "broker.h"
+#include "auth.h"
+#include "zcache.h"
 
 void begin_session(session_t *sess) {
     activate_oobinline(sess->ctrl_fd);
+    activate_nodelay(sess->ctrl_fd);
+    // 被动模式的监听地址与应答地址都取自控制连接的本地地址，每个会话只查询一次
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(sess->ctrl_fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        ERR_EXIT("getsockname");
+    }
+    sess->local_ip = addr.sin_addr.s_addr;
+    auth_session_close();
+    zcache_session_close();
     priv_sock_init(sess);
-    pid_t pid = fork();
-    if (pid < 0) {
-        ERR_EXIT("fork");
+    // 使用共享的 nobody 进程时，本进程登记后直接成为 FTP 服务进程
+    pid_t pid = 0;
+    if (broker_enabled()) {
+        broker_register(sess);
+    } else {
+        pid = fork();
+        if (pid < 0) {
+            ERR_EXIT("fork");
+        }
     }
     if (pid == 0) {
         // FTP 服务进程
+        // ABOR 关闭数据连接后，正在进行的写操作应返回 EPIPE，而不是让进程被 SIGPIPE 终止
+        signal(SIGPIPE, SIG_IGN);
+        pasvpool_close();
         priv_sock_set_child_context(sess);
         handle_child(sess);
     } else {
@@ -2,26 +2,57 @@
 #define _SESSION_H_
 
 #include "common.h"
+#include "sysutil.h"
+#include "ratelimit.h"
+#include "bwshare.h"
+
+struct uring;
+struct z_stream_s;
+
+#define REPLY_BUF_SIZE 4096
 
 typedef struct session {
     // 控制连接
     uid_t uid;
+    gid_t gid;
+    char user[MAX_USERNAME];    // USER 给出的用户名，用户存在时才记录
     int ctrl_fd;
-    char cmdline[MAX_COMMAND_LINE];
+    linebuf_t ctrl_buf;
+    char *cmdline;
     char cmd[MAX_COMMAND];
     char arg[MAX_ARG];
+    int logged_in;
+    // 应答先放入缓冲区，处理完客户端一次发来的所有命令后再一起写出
+    char reply_buf[REPLY_BUF_SIZE];
+    unsigned int reply_len;
 
     // 数据连接
     struct sockaddr_in *port_addr;
     int pasv_listen_fd;
+    int pasv_pool_slot;     // 监听套接字在端口池中的编号，-1 表示不属于端口池
+    int pasv_conn_fd;       // nobody 进程已接受、尚未交给 FTP 服务进程的数据连接
+    int pasv_accepting;     // PASV_ACCEPT 已发出（已收到），尚未取得（发出）结果
+    long pasv_deadline;
+    int port_connect_fd;    // nobody 进程正在从 20 端口发起的主动模式连接
+    long port_deadline;
     int data_fd;
+    int data_keep_fd;       // 块模式下传输结束后保留、供下一次传输使用的数据连接
     int data_process;
+    struct uring *data_uring;
+    int data_uring_failed;
+    struct uring *stat_uring;
+    int stat_uring_failed;
+    // MODE Z 的压缩流与解压流，首次使用时创建，之后每次传输重置后复用
+    struct z_stream_s *zdeflate;
+    struct z_stream_s *zinflate;
+    char *zbuf;             // 压缩流的输入与输出缓冲区
 
     // 限速
     unsigned int bw_upload_rate_max;
     unsigned int bw_download_rate_max;
-    long bw_transfer_start_sec;
-    long bw_transfer_start_usec;
+    ratelimit_t bw_upload_bucket;
+    ratelimit_t bw_download_bucket;
+    bwshare_t bw_share;
 
     // 父子进程通道
     int parent_fd;
@@ -29,13 +60,26 @@ typedef struct session {
 
     // FTP 协议状态
     int is_ascii;
+    int is_block_mode;      // MODE B，数据连接上按块传输，以块描述符标记文件结束
+    int is_deflate_mode;    // MODE Z，数据以 zlib 格式压缩后传输，仍以关闭连接标记文件结束
     long long restart_pos;
     char *rnfr_name;
     int abor_received;
+    int urg_pending;        // 收到 SIGURG 时 ABOR 尚未完整到达，等待控制连接上的数据再次触发
 
     // 连接数限制
     unsigned int num_clients;
     unsigned int num_this_ip;
+    unsigned int client_ip;
+    unsigned int local_ip;  // 控制连接的本地地址
+    int conntab_id;         // 在共享连接表中的记录
+
+    // 事件驱动模式
+    int evloop_hosted;
+    int quit_received;
+    int cwd_fd;             // 引擎中已登录会话的当前目录，会话进程中为 -1
+    int evloop_fd;          // 会话进程向引擎交还控制连接的通道，-1 表示不是由引擎移交来的
+    int auth_pending;       // 引擎中 PASS 的口令已交给验证进程，等待结果
 } session_t;
 
 void begin_session(session_t *sess);
@@ -1,38 +1,69 @@
 #include "sysutil.h"
 #include "common.h"
+#include <sched.h>
 
 
-int tcp_client(unsigned short port) {
+/**
+ * tcp_client 创建用于主动连接的套接字
+ * @ip 本地地址，网络字节序，0 表示由内核选择
+ * @port 本地端口，0 表示由内核选择
+ * 成功返回套接字，失败返回 -1
+ */
+int tcp_client(unsigned int ip, unsigned short port) {
     int sock;
     if ((sock = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-        ERR_EXIT("tcp_client");
+        return -1;
     }
+    int on = 1;
     if (port > 0) {
-        int on = 1;
+        // 同一个本地端口同时连接多个对端
         if ((setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on))) < 0) {
-            ERR_EXIT("setsockopt");
+            close(sock);
+            return -1;
         }
-        char ip[16] = {0};
-        getlocalip(ip);
+    } else if (ip != 0) {
+        // 只绑定地址时推迟到 connect 再按四元组选择本地端口，
+        // 否则 bind 就要独占一个端口，连接多时临时端口先耗尽；内核不支持时忽略
+        setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, (const char *)&on, sizeof(on));
+    }
+    if (ip != 0 || port > 0) {
         struct sockaddr_in localaddr;
         memset(&localaddr, 0, sizeof(localaddr));
         localaddr.sin_family = AF_INET;
         localaddr.sin_port = htons(port);
-        localaddr.sin_addr.s_addr = inet_addr(ip);
+        localaddr.sin_addr.s_addr = ip;
         if (bind(sock, (struct sockaddr *)&localaddr, sizeof(localaddr)) < 0) {
-            ERR_EXIT("bind");
+            close(sock);
+            return -1;
         }
     }
     return sock;
 }
 
+static int tcp_listen(const char *host, unsigned short port, int reuseport);
+
 /**
  * tcp_server 启动 TCP 服务器
  * @host 服务器 IP 地址或服务器主机名
  * @port 服务器端口
  * 成功返回监听套接字
  */
- int tcp_server(const char *host, unsigned short port) {
+int tcp_server(const char *host, unsigned short port) {
+    return tcp_listen(host, port, 0);
+}
+
+/**
+ * tcp_server_reuseport 启动可与其他进程共享端口的 TCP 服务器
+ * 同一地址上的多个监听套接字由内核分摊新连接
+ * @host 服务器 IP 地址或服务器主机名
+ * @port 服务器端口
+ * 成功返回监听套接字
+ */
+int tcp_server_reuseport(const char *host, unsigned short port) {
+    return tcp_listen(host, port, 1);
+}
+
+ static int tcp_listen(const char *host, unsigned short port, int reuseport) {
      int listenfd;
      if ((listenfd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
          ERR_EXIT("tcp_server");
@@ -59,6 +90,10 @@ int tcp_client(unsigned short port) {
      if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on))) < 0) {
          ERR_EXIT("set socket opt");
      }
+     if (reuseport
+         && (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const char *)&on, sizeof(on))) < 0) {
+         ERR_EXIT("set socket opt");
+     }
      if (bind(listenfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
          ERR_EXIT("bind");
      }
@@ -101,7 +136,7 @@ int tcp_client(unsigned short port) {
   * 设置 IO 为非阻塞模式
   * @fd 文件描述符
   */
-void active_nonblock(int fd) {
+void activate_nonblock(int fd) {
     int ret;
     int flags = fcntl(fd, F_GETFL);
     if (flags == -1) {
@@ -118,7 +153,7 @@ void active_nonblock(int fd) {
  * 设置 IO 为阻塞模式
  * @fd 文件描述符
  */
-void deactive_nonblock(int fd) {
+void deactivate_nonblock(int fd) {
     int ret;
     int flags = fcntl(fd, F_GETFL);
     if (flags == -1) {
@@ -256,7 +291,7 @@ int connect_timeout(int fd, struct sockaddr_in *addr, unsigned int wait_seconds)
     socklen_t addrlen = sizeof(struct sockaddr_in);
 
     if (wait_seconds > 0) {
-        active_nonblock(fd);
+        activate_nonblock(fd);
     }
 
     ret = connect(fd, (struct sockaddr *)addr, addrlen);
@@ -294,7 +329,7 @@ int connect_timeout(int fd, struct sockaddr_in *addr, unsigned int wait_seconds)
         }
     }
     if (wait_seconds > 0) {
-        deactive_nonblock(fd);
+        deactivate_nonblock(fd);
     }
     return ret;
 }
@@ -413,6 +448,90 @@ ssize_t readline(int sockfd, void *buf, size_t maxline) {
     return -1;
 }
 
+/**
+ * 从缓冲区中取出一行，缓冲区中没有完整的行时才读套接字
+ * @fd 套接字，可以是非阻塞的
+ * @lb 该套接字专用的接收缓冲区
+ * @line 输出参数，指向缓冲区中的行，行尾的 '\n' 被替换为 '\0'，下次读取前有效
+ * 成功返回行的长度（含 '\n'），对端关闭返回 0，失败返回 -1：
+ * 非阻塞套接字上数据不足一行时 errno 为 EAGAIN，行长超过 MAX_COMMAND_LINE 时 errno 为 EMSGSIZE
+ */
+ssize_t linebuf_readline(int fd, linebuf_t *lb, char **line) {
+    while (1) {
+        char *eol = memchr(lb->data + lb->scan, '\n', lb->end - lb->scan);
+        if (eol != NULL) {
+            *eol = '\0';
+            *line = lb->data + lb->start;
+            ssize_t len = eol - *line + 1;
+            lb->start = lb->scan = eol - lb->data + 1;
+            return len;
+        }
+
+        unsigned int avail = lb->end - lb->start;
+        if (avail >= MAX_COMMAND_LINE) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        // 缓冲区已取空时从头开始；剩余空间不够一整行时把未取走的数据移到开头
+        if (avail == 0) {
+            lb->start = lb->scan = lb->end = 0;
+        } else if (LINEBUF_SIZE - lb->end < MAX_COMMAND_LINE) {
+            memmove(lb->data, lb->data + lb->start, avail);
+            lb->start = 0;
+            lb->end = avail;
+        }
+        lb->scan = lb->end;
+
+        ssize_t ret = read(fd, lb->data + lb->end, LINEBUF_SIZE - lb->end);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (ret == 0) {
+            return 0;
+        }
+        lb->end += ret;
+    }
+}
+
+/**
+ * 缓冲区中是否还有完整的行，不读套接字
+ */
+int linebuf_has_line(linebuf_t *lb) {
+    if (memchr(lb->data + lb->scan, '\n', lb->end - lb->scan) != NULL) {
+        return 1;
+    }
+    lb->scan = lb->end;
+    return 0;
+}
+
+/**
+ * 不阻塞地读入套接字上已到达的数据，返回下一个完整行的长度（含 '\n'），不取走该行
+ * 没有完整的行时返回 0；只使用缓冲区末尾的空闲空间，不移动已有的数据，可在信号处理函数中调用
+ * @line 输出参数，指向缓冲区中的行首，行尾没有 '\0'
+ */
+ssize_t linebuf_peekline(int fd, linebuf_t *lb, char **line) {
+    while (1) {
+        char *eol = memchr(lb->data + lb->start, '\n', lb->end - lb->start);
+        if (eol != NULL) {
+            *line = lb->data + lb->start;
+            return eol - *line + 1;
+        }
+        if (lb->end == LINEBUF_SIZE) {
+            return 0;
+        }
+        ssize_t ret = recv(fd, lb->data + lb->end, LINEBUF_SIZE - lb->end, MSG_DONTWAIT);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return 0;
+        }
+        lb->end += ret;
+    }
+}
+
 void send_fd(int sock_fd, int fd) {
     int ret;
     struct msghdr msg;
@@ -481,87 +600,135 @@ int recv_fd(const int sock_fd) {
     return recv_fd;
 }
 
-const char* statbuf_get_perms(struct stat *sbuf) {
-    static char perms[] = "----------";
-    perms[0] = '?';
+/**
+ * 按十进制写出 v，不足 width 位时补空格
+ * @left 为真时左对齐，否则右对齐
+ * 返回写入内容之后的位置，不添加结尾的 '\0'
+ */
+char* format_uint(char *p, unsigned long long v, int width, int left) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+
+    int pad = width > n ? width - n : 0;
+    if ( ! left) {
+        memset(p, ' ', pad);
+        p += pad;
+    }
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    if (left) {
+        memset(p, ' ', pad);
+        p += pad;
+    }
+    return p;
+}
+
+// 按小写十六进制写出 v
+char* format_hex(char *p, unsigned long long v) {
+    char tmp[16];
+    int n = 0;
+    do {
+        tmp[n++] = "0123456789abcdef"[v & 0xf];
+        v >>= 4;
+    } while (v > 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
 
-    mode_t mode = sbuf->st_mode;
-    switch(mode & S_IFMT) {
+// 写出 ls -l 格式的 10 个字符的类型与权限
+char* statbuf_format_perms(char *p, mode_t mode) {
+    switch (mode & S_IFMT) {
         case S_IFREG:
-            perms[0] = '-';
+            p[0] = '-';
             break;
         case S_IFDIR:
-            perms[0] = 'd';
+            p[0] = 'd';
             break;
         case S_IFLNK:
-            perms[0] = 'l';
+            p[0] = 'l';
             break;
         case S_IFIFO:
-            perms[0] = 'p';
+            p[0] = 'p';
             break;
         case S_IFSOCK:
-            perms[0] = 's';
+            p[0] = 's';
             break;
         case S_IFCHR:
-            perms[0] = 'c';
+            p[0] = 'c';
             break;
         case S_IFBLK:
-            perms[0] = 'b';
+            p[0] = 'b';
+            break;
+        default:
+            p[0] = '?';
             break;
     }
 
-    if (mode & S_IRUSR) {
-        perms[1] = 'r';
-    }
-    if (mode & S_IWUSR) {
-        perms[2] = 'w';
-    }
-    if (mode & S_IXUSR) {
-        perms[3] = 'x';
-    }
-    if (mode & S_IRGRP) {
-        perms[4] = 'r';
-    }
-    if (mode & S_IWGRP) {
-        perms[5] = 'w';
-    }
-    if (mode & S_IXGRP) {
-        perms[6] = 'x';
-    }
-    if (mode & S_IROTH) {
-        perms[7] = 'r';
-    }
-    if (mode & S_IWOTH) {
-        perms[8] = 'w';
-    }
-    if (mode & S_IXOTH) {
-        perms[9] = 'x';
-    }
+    p[1] = (mode & S_IRUSR) ? 'r' : '-';
+    p[2] = (mode & S_IWUSR) ? 'w' : '-';
+    p[3] = (mode & S_IXUSR) ? 'x' : '-';
+    p[4] = (mode & S_IRGRP) ? 'r' : '-';
+    p[5] = (mode & S_IWGRP) ? 'w' : '-';
+    p[6] = (mode & S_IXGRP) ? 'x' : '-';
+    p[7] = (mode & S_IROTH) ? 'r' : '-';
+    p[8] = (mode & S_IWOTH) ? 'w' : '-';
+    p[9] = (mode & S_IXOTH) ? 'x' : '-';
     if (mode & S_ISUID) {
-        perms[3] = (perms[3] == 'x') ? 's' : 'S';
+        p[3] = (p[3] == 'x') ? 's' : 'S';
     }
     if (mode & S_ISGID) {
-        perms[6] = (perms[6] == 'x') ? 's' : 'S';
+        p[6] = (p[6] == 'x') ? 's' : 'S';
     }
     if (mode & S_ISVTX) {
-        perms[9] = (perms[9] == 'x') ? 't' : 'T';
+        p[9] = (p[9] == 'x') ? 't' : 'T';
     }
+    return p + 10;
+}
 
-    return perms;
+/**
+ * 开始一次列表，只取一次当前时间
+ */
+void date_clock_init(date_clock_t *clk) {
+    clk->now = time(NULL);
+    clk->hour_start = -1;
 }
 
-const char* statbuf_get_date(struct stat *sbuf) {
-    const char *p_date_format = "%b %e %H:%M";
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    time_t local_time = tv.tv_sec;
-    if (sbuf->st_mtime > local_time || (local_time - sbuf->st_mtime) > 60*60*24*182) {
-        p_date_format = "%b %e %Y";
+/**
+ * 写出文件时间，半年以内为 "%b %e %H:%M"，否则为 "%b %e %Y"
+ * 同一小时内的时间只在第一次调用 localtime_r，其余按偏移量推算
+ */
+char* statbuf_format_date(char *p, date_clock_t *clk, time_t mtime) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    if (clk->hour_start == -1 || mtime < clk->hour_start || mtime >= clk->hour_start + 3600) {
+        localtime_r(&mtime, &clk->tm);
+        clk->hour_start = mtime - clk->tm.tm_min * 60 - clk->tm.tm_sec;
     }
-    static char datebuf[1024] = {0};
-    struct tm* p_tm = localtime(&local_time);
-    strftime(datebuf, sizeof(datebuf), p_date_format, p_tm);
-    return datebuf;
+    struct tm *tm = &clk->tm;
+
+    memcpy(p, months + tm->tm_mon * 3, 3);
+    p[3] = ' ';
+    p = format_uint(p + 4, tm->tm_mday, 2, 0);
+    *p++ = ' ';
+    if (mtime > clk->now || clk->now - mtime > 60*60*24*182) {
+        p = format_uint(p, tm->tm_year + 1900, 4, 0);
+    } else {
+        int min = (mtime - clk->hour_start) / 60;
+        p[0] = '0' + tm->tm_hour / 10;
+        p[1] = '0' + tm->tm_hour % 10;
+        p[2] = ':';
+        p[3] = '0' + min / 10;
+        p[4] = '0' + min % 10;
+        p += 5;
+    }
+    return p;
 }
 
 static int lock_internal(int fd, int lock_type) {
@@ -625,6 +792,62 @@ void nano_sleep(double seconds) {
     } while (ret == -1 && errno == EINTR);
 }
 
+/**
+ * nobody 用户的 uid 与 gid，第一次调用时查询，之后直接返回保存的结果
+ * 主进程在启动时调用一次，之后创建的进程都继承查询结果，不必每次都经过 NSS
+ * 用户不存在时返回 -1
+ */
+int get_nobody(uid_t *uid, gid_t *gid) {
+    static int resolved = 0;
+    static int found = 0;
+    static uid_t nobody_uid;
+    static gid_t nobody_gid;
+    if ( ! resolved) {
+        struct passwd *pw = getpwnam("nobody");
+        if (pw != NULL) {
+            nobody_uid = pw->pw_uid;
+            nobody_gid = pw->pw_gid;
+            found = 1;
+        }
+        resolved = 1;
+    }
+    if ( ! found) {
+        return -1;
+    }
+    if (uid != NULL) {
+        *uid = nobody_uid;
+    }
+    if (gid != NULL) {
+        *gid = nobody_gid;
+    }
+    return 0;
+}
+
+/**
+ * 多个进程共享内存中的自旋锁，锁的值为持有者的 pid
+ * 持有者已经退出时接管该锁；持有者是本进程时说明是在信号处理函数中退出进程，直接继续
+ */
+void shm_lock(volatile int *lock) {
+    int self = getpid();
+    while (1) {
+        int owner = *lock;
+        if (owner == self) {
+            return;
+        }
+        if (owner == 0 || (kill(owner, 0) == -1 && errno == ESRCH)) {
+            if (__sync_bool_compare_and_swap(lock, owner, self)) {
+                return;
+            }
+            continue;
+        }
+        sched_yield();
+    }
+}
+
+void shm_unlock(volatile int *lock) {
+    __sync_lock_release(lock);
+}
+
 // 开启套接字 fd 接收带外数据的功能
 void activate_oobinline(int fd) {
     int oob_inline = 1;
@@ -634,11 +857,36 @@ void activate_oobinline(int fd) {
     }
 }
 
+// 关闭 Nagle 算法，应答已在应用层合并，不需要内核再等待
+void activate_nodelay(int fd) {
+    int nodelay = 1;
+    int ret = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (ret == -1) {
+        ERR_EXIT("setsockopt");
+    }
+}
+
 // 当文件描述符 fd 上有带外数据时，将产生 SIGURG 信号
 // 该函数设定当前进程能够接收 fd 所产生的 SIGURG 信号
 void activate_sigurg(int fd) {
-    int ret = fcntl(fd, F_SETOWN, getuid());
+    int ret = fcntl(fd, F_SETOWN, getpid());
     if (ret == -1) {
         ERR_EXIT("fcntl");
     }
 }
+
+// fd 上有普通数据到达时也产生 SIGURG，须先调用 activate_sigurg
+void activate_sigurg_input(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETSIG, SIGURG) == -1
+        || fcntl(fd, F_SETFL, flags | O_ASYNC) == -1) {
+        ERR_EXIT("fcntl");
+    }
+}
+
+void deactivate_sigurg_input(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_ASYNC) == -1) {
+        ERR_EXIT("fcntl");
+    }
+}
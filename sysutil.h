@@ -4,7 +4,8 @@
 #include "common.h"
 
 int tcp_server(const char *host, unsigned short port);
-int tcp_client(unsigned short port);
+int tcp_server_reuseport(const char *host, unsigned short port);
+int tcp_client(unsigned int ip, unsigned short port);
 
 int getlocalip(char *ip);
 
@@ -21,11 +22,35 @@ ssize_t writen(int fd, const void *buf, size_t count);
 ssize_t recv_peek(int sockfd, void *buf, size_t len);
 ssize_t readline(int sockfd, void *buf, size_t maxline);
 
+// 按行读取的接收缓冲区，一次 read 尽可能多地读入数据，之后的行直接从缓冲区中取出
+#define LINEBUF_SIZE 4096
+
+typedef struct linebuf {
+    char data[LINEBUF_SIZE];
+    unsigned int start;     // 下一行的起点
+    unsigned int scan;      // 从这里开始查找行尾，已查找过的数据不再重复查找
+    unsigned int end;       // 已读入数据的末尾
+} linebuf_t;
+
+ssize_t linebuf_readline(int fd, linebuf_t *lb, char **line);
+int linebuf_has_line(linebuf_t *lb);
+ssize_t linebuf_peekline(int fd, linebuf_t *lb, char **line);
+
 void send_fd(int sock_fd, int fd);
 int recv_fd(const int sock_fd);
 
-const char* statbuf_get_perms(struct stat *sbuf);
-const char* statbuf_get_date(struct stat *sbuf);
+// 列表中格式化文件时间使用的时钟，缓存最近一次换算的本地时间
+typedef struct date_clock {
+    time_t now;
+    time_t hour_start;
+    struct tm tm;
+} date_clock_t;
+
+char* format_uint(char *p, unsigned long long v, int width, int left);
+char* format_hex(char *p, unsigned long long v);
+char* statbuf_format_perms(char *p, mode_t mode);
+void date_clock_init(date_clock_t *clk);
+char* statbuf_format_date(char *p, date_clock_t *clk, time_t mtime);
 
 int lock_file_read(int fd);
 int lock_file_write(int fd);
@@ -34,7 +59,15 @@ long get_time_sec(void);
 long get_time_usec(void);
 void nano_sleep(double seconds);
 
+int get_nobody(uid_t *uid, gid_t *gid);
+
+void shm_lock(volatile int *lock);
+void shm_unlock(volatile int *lock);
+
 void activate_oobinline(int fd);
+void activate_nodelay(int fd);
 void activate_sigurg(int fd);
+void activate_sigurg_input(int fd);
+void deactivate_sigurg_input(int fd);
 
 #endif
\ No newline at end of file
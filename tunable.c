@@ -2,7 +2,12 @@
 
 int tunable_pasv_enable = 1;
 int tunable_port_enable = 1;
+int tunable_event_driven_enable = 0;
+int tunable_io_uring_enable = 0;
+int tunable_list_stat_ordered = 1;
+int tunable_connect_from_port_20 = 1;
 unsigned int tunable_listen_port = 21;
+unsigned int tunable_listen_workers = 0;
 unsigned int tunable_max_clients = 2000;
 unsigned int tunable_max_per_ip = 50;
 unsigned int tunable_accept_timeout = 60;
@@ -12,4 +17,21 @@ unsigned int tunable_data_connection_timeout = 300;
 unsigned int tunable_local_umask = 077;
 unsigned int tunable_upload_max_rate = 0;
 unsigned int tunable_download_max_rate = 0;
-const char *tunable_listen_address;
\ No newline at end of file
+unsigned int tunable_rate_burst = 0;
+unsigned int tunable_global_max_rate = 0;
+unsigned int tunable_per_ip_max_rate = 0;
+unsigned int tunable_per_user_max_rate = 0;
+unsigned int tunable_dir_cache_size = 0;
+unsigned int tunable_list_stat_parallel = 0;
+unsigned int tunable_pasv_min_port = 0;
+unsigned int tunable_pasv_max_port = 0;
+unsigned int tunable_broker_processes = 0;
+unsigned int tunable_auth_workers = 0;
+unsigned int tunable_auth_cache_ttl = 0;
+unsigned int tunable_deflate_level = 1;
+unsigned int tunable_deflate_cache_size = 1024 * 1024 * 1024;
+unsigned int tunable_deflate_cache_min_size = 1024 * 1024;
+const char *tunable_listen_address;
+const char *tunable_pasv_address;
+const char *tunable_user_db_file;
+const char *tunable_deflate_cache_dir;
\ No newline at end of file
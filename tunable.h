@@ -3,7 +3,12 @@
 
 extern int tunable_pasv_enable;
 extern int tunable_port_enable;
+extern int tunable_event_driven_enable;
+extern int tunable_io_uring_enable;
+extern int tunable_list_stat_ordered;
+extern int tunable_connect_from_port_20;
 extern unsigned int tunable_listen_port;
+extern unsigned int tunable_listen_workers;
 extern unsigned int tunable_max_clients;
 extern unsigned int tunable_max_per_ip;
 extern unsigned int tunable_accept_timeout;
@@ -13,7 +18,24 @@ extern unsigned int tunable_data_connection_timeout;
 extern unsigned int tunable_local_umask;
 extern unsigned int tunable_upload_max_rate;
 extern unsigned int tunable_download_max_rate;
+extern unsigned int tunable_rate_burst;
+extern unsigned int tunable_global_max_rate;
+extern unsigned int tunable_per_ip_max_rate;
+extern unsigned int tunable_per_user_max_rate;
+extern unsigned int tunable_dir_cache_size;
+extern unsigned int tunable_list_stat_parallel;
+extern unsigned int tunable_pasv_min_port;
+extern unsigned int tunable_pasv_max_port;
+extern unsigned int tunable_broker_processes;
+extern unsigned int tunable_auth_workers;
+extern unsigned int tunable_auth_cache_ttl;
+extern unsigned int tunable_deflate_level;
+extern unsigned int tunable_deflate_cache_size;
+extern unsigned int tunable_deflate_cache_min_size;
 extern const char *tunable_listen_address;
+extern const char *tunable_pasv_address;
+extern const char *tunable_user_db_file;
+extern const char *tunable_deflate_cache_dir;
 
 
 #endif /* _TUNABLE_H_ */
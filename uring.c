@@ -0,0 +1,222 @@
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+static int uring_enter(uring_t *ring, unsigned int wait_nr);
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * 创建 io_uring 实例，with_bufs 非 0 时同时分配传输缓冲区
+ * 内核不支持或被禁用时返回 NULL，调用者应回退到普通的系统调用
+ */
+uring_t* uring_create(int with_bufs) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = io_uring_setup(URING_ENTRIES, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    uring_t *ring = (uring_t *)malloc(sizeof(uring_t));
+    memset(ring, 0, sizeof(uring_t));
+    ring->ring_fd = fd;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(fd);
+            free(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *sq = (char *)ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+
+    // 提交队列的索引数组固定为 sqes 的下标，之后只需移动 tail
+    unsigned int *sq_array = (unsigned int *)(sq + p.sq_off.array);
+    unsigned int i;
+    for (i = 0; i < p.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    char *cq = (char *)ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if ( ! with_bufs) {
+        return ring;
+    }
+
+    struct iovec iov[URING_NUM_BUFS];
+    char *mem = (char *)mmap(NULL, URING_NUM_BUFS * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        uring_destroy(ring);
+        return NULL;
+    }
+    for (i = 0; i < URING_NUM_BUFS; i++) {
+        ring->bufs[i] = mem + i * URING_BUF_SIZE;
+        iov[i].iov_base = ring->bufs[i];
+        iov[i].iov_len = URING_BUF_SIZE;
+    }
+    // 注册失败（例如超出 RLIMIT_MEMLOCK）时仍可用普通读写操作
+    ring->bufs_registered =
+        io_uring_register(fd, IORING_REGISTER_BUFFERS, iov, URING_NUM_BUFS) == 0;
+
+    return ring;
+}
+
+void uring_destroy(uring_t *ring) {
+    if (ring->bufs[0] != NULL) {
+        munmap(ring->bufs[0], URING_NUM_BUFS * URING_BUF_SIZE);
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+    free(ring);
+}
+
+/**
+ * 取得一个空闲的提交项，队列已满时返回 NULL
+ */
+struct io_uring_sqe* uring_get_sqe(uring_t *ring) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *addr,
+    unsigned int len, unsigned long long offset) {
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->off = offset;
+}
+
+/**
+ * 准备一个 splice 操作，偏移量为 -1 表示使用管道或套接字的当前位置
+ */
+void uring_prep_splice(struct io_uring_sqe *sqe, int fd_in, long long off_in,
+    int fd_out, long long off_out, unsigned int len) {
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fd_out;
+    sqe->len = len;
+    sqe->off = (unsigned long long)off_out;
+    sqe->splice_off_in = (unsigned long long)off_in;
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_flags = SPLICE_F_MOVE;
+}
+
+/**
+ * 准备一个 statx 操作，path 与 stx 在操作完成之前必须保持有效
+ * 内核在工作线程中执行，多个 statx 可以同时等待文件系统返回
+ */
+void uring_prep_statx(struct io_uring_sqe *sqe, int dirfd, const char *path, int flags,
+    unsigned int mask, struct statx *stx) {
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (unsigned long)path;
+    sqe->len = mask;
+    sqe->off = (unsigned long)stx;
+    sqe->statx_flags = flags;
+}
+
+/**
+ * 提交所有已准备好的操作，不等待完成
+ */
+int uring_submit(uring_t *ring) {
+    return uring_enter(ring, 0);
+}
+
+/**
+ * 取出一个完成事件，没有时提交未提交的操作并阻塞等待
+ * 成功返回 0，失败返回 -1
+ */
+int uring_wait_cqe(uring_t *ring, struct io_uring_cqe *cqe) {
+    while (1) {
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head != tail) {
+            *cqe = ring->cqes[head & *ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (uring_enter(ring, 1) < 0) {
+            return -1;
+        }
+    }
+}
+
+static int uring_enter(uring_t *ring, unsigned int wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    while (1) {
+        // 被信号打断后内核可能已经取走了部分提交项，以内核的 head 为准
+        unsigned int to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        int ret = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_nr,
+            wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0 && errno == EINTR) {
+            if (wait_nr > 0) {
+                // 由调用者重新检查完成队列
+                return 0;
+            }
+            continue;
+        }
+        return ret < 0 ? -1 : 0;
+    }
+}
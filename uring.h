@@ -0,0 +1,54 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include "common.h"
+#include <linux/io_uring.h>
+
+// 不依赖 liburing 的最小 io_uring 封装，供数据连接传输与目录列表的并发 statx 使用
+
+#define URING_ENTRIES       64
+#define URING_NUM_BUFS      4
+#define URING_BUF_SIZE      (64 * 1024)
+
+typedef struct uring {
+    int ring_fd;
+
+    // 提交队列
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;
+    struct io_uring_sqe *sqes;
+
+    // 完成队列
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // 传输缓冲区，注册成功时可使用 READ_FIXED / WRITE_FIXED
+    char *bufs[URING_NUM_BUFS];
+    int bufs_registered;
+} uring_t;
+
+uring_t* uring_create(int with_bufs);
+void uring_destroy(uring_t *ring);
+
+struct io_uring_sqe* uring_get_sqe(uring_t *ring);
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *addr,
+    unsigned int len, unsigned long long offset);
+void uring_prep_splice(struct io_uring_sqe *sqe, int fd_in, long long off_in,
+    int fd_out, long long off_out, unsigned int len);
+void uring_prep_statx(struct io_uring_sqe *sqe, int dirfd, const char *path, int flags,
+    unsigned int mask, struct statx *stx);
+int uring_submit(uring_t *ring);
+int uring_wait_cqe(uring_t *ring, struct io_uring_cqe *cqe);
+
+#endif /* _URING_H_ */
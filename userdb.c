@@ -0,0 +1,401 @@
+#include "userdb.h"
+#include "tunable.h"
+#include "sysutil.h"
+#include "str.h"
+#include <sys/mman.h>
+
+#define USERDB_MIN_USERS    1024
+#define USERDB_MIN_POOL     (64 * 1024)
+#define USERDB_LINE_MAX     (MAX_USERNAME + 256 + PATH_MAX + 64)
+#define USERDB_FIELDS       7
+
+// 用户项，字符串保存在字符串区中，这里只记录偏移
+typedef struct userdb_entry {
+    unsigned int name;
+    unsigned int hash;
+    unsigned int home;
+    uid_t uid;
+    gid_t gid;
+    unsigned int upload_max_rate;
+    unsigned int download_max_rate;
+} userdb_entry_t;
+
+// 源文件的状态，用于发现文件变化
+typedef struct userdb_source {
+    dev_t dev;
+    ino_t ino;
+    long long mtime_ns;
+    off_t size;
+} userdb_source_t;
+
+// 一份完整的数据库，头部之后依次为散列槽、用户项与字符串区
+// 散列槽中为用户项的下标加 1，0 表示空槽
+typedef struct userdb_buf {
+    volatile unsigned int seq;      // 重建期间为奇数，查找时据此发现读到的内容已被改写
+    unsigned int generation;
+    userdb_source_t source;
+    unsigned int nusers;
+    unsigned int pool_used;
+} userdb_buf_t;
+
+typedef struct userdb_shm {
+    volatile int lock;
+    volatile unsigned int active;
+    // 最近一次重建失败时的文件状态，文件再次变化之前不再重试
+    userdb_source_t failed;
+} userdb_shm_t;
+
+static userdb_shm_t *s_shm;
+static char *s_bufs[2];
+static unsigned int s_max_users;
+static unsigned int s_nslots;
+static unsigned int s_pool_size;
+
+static void userdb_size(FILE *fp, off_t file_size);
+static int userdb_build(char *buf, unsigned int generation, int verbose);
+static int userdb_parse_line(char *buf, char *line, int lineno, int verbose);
+static int userdb_find(char *buf, const char *name, userdb_user_t *user);
+static void userdb_refresh(void);
+static void userdb_get_source(const struct stat *sbuf, userdb_source_t *source);
+static int userdb_same_source(const userdb_source_t *a, const userdb_source_t *b);
+static unsigned int userdb_hash(const char *name);
+static int userdb_copy(char *dst, size_t size, const char *pool, unsigned int off);
+
+static userdb_buf_t* buf_header(char *buf) {
+    return (userdb_buf_t *)buf;
+}
+
+static unsigned int* buf_slots(char *buf) {
+    return (unsigned int *)(buf + sizeof(userdb_buf_t));
+}
+
+static userdb_entry_t* buf_entries(char *buf) {
+    return (userdb_entry_t *)(buf_slots(buf) + s_nslots);
+}
+
+static char* buf_pool(char *buf) {
+    return (char *)(buf_entries(buf) + s_max_users);
+}
+
+/**
+ * 编译 user_db_file，容量按启动时的文件大小预留一倍的余量
+ * 须在成为守护进程之前调用，文件格式错误时能在终端看到出错信息
+ */
+void userdb_init(void) {
+    if (tunable_user_db_file == NULL) {
+        return;
+    }
+    FILE *fp = fopen(tunable_user_db_file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "cannot open user_db_file %s\n", tunable_user_db_file);
+        exit(EXIT_FAILURE);
+    }
+    struct stat sbuf;
+    if (fstat(fileno(fp), &sbuf) < 0) {
+        ERR_EXIT("fstat");
+    }
+    userdb_size(fp, sbuf.st_size);
+    fclose(fp);
+
+    size_t buf_size = sizeof(userdb_buf_t) + s_nslots * sizeof(unsigned int)
+        + s_max_users * sizeof(userdb_entry_t) + s_pool_size;
+    buf_size = (buf_size + 7) & ~(size_t)7;
+    void *p = mmap(NULL, sizeof(userdb_shm_t) + 2 * buf_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        ERR_EXIT("mmap");
+    }
+    s_shm = (userdb_shm_t *)p;
+    s_bufs[0] = (char *)p + sizeof(userdb_shm_t);
+    s_bufs[1] = s_bufs[0] + buf_size;
+
+    if (userdb_build(s_bufs[0], 1, 1) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    s_shm->active = 0;
+}
+
+int userdb_enabled(void) {
+    return s_shm != NULL;
+}
+
+/**
+ * 按用户名查找，找到返回 0，不存在返回 -1
+ * @user 输出用户信息
+ */
+int userdb_lookup(const char *name, userdb_user_t *user) {
+    userdb_refresh();
+    while (1) {
+        char *buf = s_bufs[s_shm->active];
+        unsigned int seq = buf_header(buf)->seq;
+        __sync_synchronize();
+        int ret = (seq & 1) ? -1 : userdb_find(buf, name, user);
+        __sync_synchronize();
+        // 读的过程中这份数据被重建（已不是当前的那一份），重新读
+        if ( ! (seq & 1) && buf_header(buf)->seq == seq) {
+            return ret;
+        }
+    }
+}
+
+/**
+ * 数据库的版本号，每次重建后递增
+ */
+unsigned int userdb_generation(void) {
+    userdb_refresh();
+    return buf_header(s_bufs[s_shm->active])->generation;
+}
+
+// 用户数取行数的两倍并向上取 2 的幂，散列槽再多一倍
+static void userdb_size(FILE *fp, off_t file_size) {
+    unsigned int lines = 0;
+    int c;
+    while ((c = getc(fp)) != EOF) {
+        if (c == '\n') {
+            lines++;
+        }
+    }
+    s_max_users = USERDB_MIN_USERS;
+    while (s_max_users < 2 * (lines + 1)) {
+        s_max_users *= 2;
+    }
+    s_nslots = 2 * s_max_users;
+    s_pool_size = USERDB_MIN_POOL;
+    while (s_pool_size < 2 * (unsigned long long)file_size) {
+        s_pool_size *= 2;
+    }
+}
+
+/**
+ * 把 user_db_file 编译到 buf 中，buf 不是当前使用的那一份
+ * 成功返回 0，格式错误或超出容量返回 -1
+ */
+static int userdb_build(char *buf, unsigned int generation, int verbose) {
+    FILE *fp = fopen(tunable_user_db_file, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    struct stat sbuf;
+    if (fstat(fileno(fp), &sbuf) < 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    userdb_buf_t *hdr = buf_header(buf);
+    hdr->seq++;
+    __sync_synchronize();
+    memset(buf_slots(buf), 0, s_nslots * sizeof(unsigned int));
+    hdr->nusers = 0;
+    hdr->pool_used = 0;
+
+    int ret = 0;
+    int lineno = 0;
+    char line[USERDB_LINE_MAX];
+    while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        ret = userdb_parse_line(buf, line, lineno, verbose);
+    }
+    fclose(fp);
+
+    userdb_get_source(&sbuf, &hdr->source);
+    hdr->generation = generation;
+    __sync_synchronize();
+    hdr->seq++;
+    return ret;
+}
+
+// 解析一行并加入数据库
+static int userdb_parse_line(char *buf, char *line, int lineno, int verbose) {
+    str_trim_crlf(line);
+    if (line[0] == '\0' || line[0] == '#') {
+        return 0;
+    }
+
+    char *fields[USERDB_FIELDS] = {NULL};
+    int nfields = 0;
+    char *p = line;
+    while (nfields < USERDB_FIELDS) {
+        fields[nfields++] = p;
+        p = strchr(p, ':');
+        if (p == NULL) {
+            break;
+        }
+        *p++ = '\0';
+    }
+
+    const char *err = NULL;
+    char *end;
+    unsigned long uid = 0, gid = 0, up = 0, down = 0;
+    if (nfields < 5 || p != NULL) {
+        err = "expected name:password:uid:gid:home[:upload_max_rate[:download_max_rate]]";
+    } else if (fields[0][0] == '\0' || strlen(fields[0]) >= MAX_USERNAME) {
+        err = "bad user name";
+    } else if (strlen(fields[1]) >= sizeof(((userdb_user_t *)0)->hash)) {
+        err = "password hash too long";
+    } else if (fields[4][0] != '/' || strlen(fields[4]) >= PATH_MAX) {
+        err = "home must be an absolute path";
+    } else {
+        uid = strtoul(fields[2], &end, 10);
+        if (fields[2][0] == '\0' || *end != '\0') {
+            err = "bad uid";
+        }
+        gid = strtoul(fields[3], &end, 10);
+        if (fields[3][0] == '\0' || *end != '\0') {
+            err = "bad gid";
+        }
+        if (nfields > 5 && fields[5][0] != '\0') {
+            up = strtoul(fields[5], &end, 10);
+            if (*end != '\0') {
+                err = "bad upload_max_rate";
+            }
+        }
+        if (nfields > 6 && fields[6][0] != '\0') {
+            down = strtoul(fields[6], &end, 10);
+            if (*end != '\0') {
+                err = "bad download_max_rate";
+            }
+        }
+    }
+
+    userdb_buf_t *hdr = buf_header(buf);
+    size_t need = strlen(fields[0]) + 1 + (nfields > 1 ? strlen(fields[1]) + 1 : 0)
+        + (nfields > 4 ? strlen(fields[4]) + 1 : 0);
+    if (err == NULL && (hdr->nusers == s_max_users || hdr->pool_used + need > s_pool_size)) {
+        err = "too many users, restart to enlarge the database";
+    }
+    userdb_user_t dummy;
+    if (err == NULL && userdb_find(buf, fields[0], &dummy) == 0) {
+        err = "duplicate user";
+    }
+    if (err != NULL) {
+        if (verbose) {
+            fprintf(stderr, "%s:%d: %s\n", tunable_user_db_file, lineno, err);
+        }
+        return -1;
+    }
+
+    userdb_entry_t *e = &buf_entries(buf)[hdr->nusers];
+    char *pool = buf_pool(buf);
+    int i;
+    unsigned int *offs[3] = {&e->name, &e->hash, &e->home};
+    int idx[3] = {0, 1, 4};
+    for (i = 0; i < 3; i++) {
+        size_t len = strlen(fields[idx[i]]) + 1;
+        *offs[i] = hdr->pool_used;
+        memcpy(pool + hdr->pool_used, fields[idx[i]], len);
+        hdr->pool_used += len;
+    }
+    e->uid = (uid_t)uid;
+    e->gid = (gid_t)gid;
+    e->upload_max_rate = (unsigned int)up;
+    e->download_max_rate = (unsigned int)down;
+
+    unsigned int *slots = buf_slots(buf);
+    unsigned int k = userdb_hash(fields[0]) & (s_nslots - 1);
+    while (slots[k] != 0) {
+        k = (k + 1) & (s_nslots - 1);
+    }
+    slots[k] = ++hdr->nusers;
+    return 0;
+}
+
+// 重建可能正在改写 buf，所有下标与偏移都要检查范围，由调用者检查 seq 决定结果是否有效
+static int userdb_find(char *buf, const char *name, userdb_user_t *user) {
+    unsigned int *slots = buf_slots(buf);
+    userdb_entry_t *entries = buf_entries(buf);
+    char *pool = buf_pool(buf);
+    unsigned int k = userdb_hash(name) & (s_nslots - 1);
+    unsigned int probe;
+    for (probe = 0; probe < s_nslots; probe++, k = (k + 1) & (s_nslots - 1)) {
+        unsigned int slot = slots[k];
+        if (slot == 0) {
+            return -1;
+        }
+        if (slot > s_max_users) {
+            return -1;
+        }
+        userdb_entry_t *e = &entries[slot - 1];
+        if (userdb_copy(user->name, sizeof(user->name), pool, e->name) < 0) {
+            return -1;
+        }
+        if (strcmp(user->name, name) != 0) {
+            continue;
+        }
+        if (userdb_copy(user->hash, sizeof(user->hash), pool, e->hash) < 0
+            || userdb_copy(user->home, sizeof(user->home), pool, e->home) < 0) {
+            return -1;
+        }
+        user->uid = e->uid;
+        user->gid = e->gid;
+        user->upload_max_rate = e->upload_max_rate;
+        user->download_max_rate = e->download_max_rate;
+        return 0;
+    }
+    return -1;
+}
+
+// 文件变化时重建到另一份中，成功后切换
+static void userdb_refresh(void) {
+    if (s_shm == NULL) {
+        return;
+    }
+    struct stat sbuf;
+    if (stat(tunable_user_db_file, &sbuf) < 0) {
+        // 文件暂时不存在时继续使用旧数据
+        return;
+    }
+    userdb_source_t source;
+    userdb_get_source(&sbuf, &source);
+    if (userdb_same_source(&source, &buf_header(s_bufs[s_shm->active])->source)) {
+        return;
+    }
+
+    shm_lock(&s_shm->lock);
+    char *cur = s_bufs[s_shm->active];
+    if ( ! userdb_same_source(&source, &buf_header(cur)->source)
+        && ! userdb_same_source(&source, &s_shm->failed)) {
+        unsigned int next = 1 - s_shm->active;
+        if (userdb_build(s_bufs[next], buf_header(cur)->generation + 1, 0) == 0) {
+            __sync_synchronize();
+            s_shm->active = next;
+        } else {
+            s_shm->failed = source;
+        }
+    }
+    shm_unlock(&s_shm->lock);
+}
+
+static void userdb_get_source(const struct stat *sbuf, userdb_source_t *source) {
+    source->dev = sbuf->st_dev;
+    source->ino = sbuf->st_ino;
+    source->mtime_ns = (long long)sbuf->st_mtim.tv_sec * 1000000000LL + sbuf->st_mtim.tv_nsec;
+    source->size = sbuf->st_size;
+}
+
+static int userdb_same_source(const userdb_source_t *a, const userdb_source_t *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->mtime_ns == b->mtime_ns
+        && a->size == b->size;
+}
+
+// FNV-1a
+static unsigned int userdb_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name != '\0') {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int userdb_copy(char *dst, size_t size, const char *pool, unsigned int off) {
+    if (off >= s_pool_size) {
+        return -1;
+    }
+    size_t max = s_pool_size - off < size ? s_pool_size - off : size;
+    size_t len = strnlen(pool + off, max);
+    if (len == max) {
+        return -1;
+    }
+    memcpy(dst, pool + off, len + 1);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _USER_DB_H_
+#define _USER_DB_H_
+
+#include "common.h"
+#include <limits.h>
+
+// 虚拟用户数据库
+// 配置了 user_db_file 时，用户不再通过 NSS 查询，而是由主进程在启动时把该文件编译成
+// 共享内存中按用户名散列的表，登录时 O(1) 查找
+// 文件每行一个用户：name:crypt 口令:uid:gid:home[:upload_max_rate[:download_max_rate]]
+// 虚拟用户以映射到的本地 uid/gid 访问文件，限速为 0 或省略时使用全局配置
+// 查找时发现文件变化就在另一半共享内存中重建，成功后再切换，查找中的进程不受影响；
+// 修改时应写入临时文件后 rename，重建失败时继续使用旧数据
+
+typedef struct userdb_user {
+    char name[MAX_USERNAME];
+    char hash[256];
+    char home[PATH_MAX];
+    uid_t uid;
+    gid_t gid;
+    unsigned int upload_max_rate;
+    unsigned int download_max_rate;
+} userdb_user_t;
+
+void userdb_init(void);
+int userdb_enabled(void);
+int userdb_lookup(const char *name, userdb_user_t *user);
+unsigned int userdb_generation(void);
+
+#endif /* _USER_DB_H_ */
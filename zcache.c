@@ -0,0 +1,346 @@
+#include "zcache.h"
+#include "common.h"
+#include "tunable.h"
+#include "sysutil.h"
+#include "privsock.h"
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <zlib.h>
+
+#define ZCACHE_MAGIC        "MFZC0001"
+#define ZCACHE_BUF_SIZE     (256 * 1024)
+#define ZCACHE_NAME_MAX     40
+
+// 缓存文件的头部，随后是完整的 zlib 格式压缩数据
+typedef struct zcache_header {
+    char magic[8];
+    long long size;         // 源文件的状态，任何一项变化都使缓存失效
+    long long mtime_ns;
+    long long ctime_ns;
+    long long zlen;         // 压缩数据的长度
+} zcache_header_t;
+
+typedef struct zcache_file {
+    char name[ZCACHE_NAME_MAX];
+    long long mtime_ns;
+    off_t size;
+} zcache_file_t;
+
+// 请求队列，[0] 由压缩进程接收，[1] 由会话发送
+static int s_queue_fds[2] = {-1, -1};
+static pid_t s_worker;
+
+static void zcache_start_worker(void);
+static void zcache_worker(void);
+static void zcache_build(int srcfd, z_stream *z, char *in, char *out);
+static void zcache_path(char *path, const struct stat *st);
+static int zcache_check(const char *path, const struct stat *st, long long *zlen);
+static void zcache_evict(void);
+static int zcache_file_cmp(const void *a, const void *b);
+static long long zcache_time_ns(const struct timespec *ts);
+
+void zcache_init(void) {
+    if (tunable_deflate_cache_dir == NULL || tunable_deflate_level == 0) {
+        return;
+    }
+
+    // 缓存中可能有会话无权读取的文件的内容，目录只允许 nobody 访问
+    if (mkdir(tunable_deflate_cache_dir, 0700) < 0 && errno != EEXIST) {
+        ERR_EXIT("mkdir");
+    }
+    uid_t uid;
+    gid_t gid;
+    if (get_nobody(&uid, &gid) == 0 && chown(tunable_deflate_cache_dir, uid, gid) < 0) {
+        ERR_EXIT("chown");
+    }
+    if (chmod(tunable_deflate_cache_dir, 0700) < 0) {
+        ERR_EXIT("chmod");
+    }
+
+    // 队列满时会话直接放弃请求，不等待压缩进程
+    if (socketpair(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, s_queue_fds) < 0) {
+        ERR_EXIT("socketpair");
+    }
+    activate_nonblock(s_queue_fds[1]);
+    zcache_start_worker();
+}
+
+/**
+ * 主进程回收子进程时调用，压缩进程意外退出时重新启动它
+ * pid 是压缩进程返回 1
+ */
+int zcache_reap(pid_t pid) {
+    if (s_queue_fds[0] == -1 || pid != s_worker) {
+        return 0;
+    }
+    zcache_start_worker();
+    return 1;
+}
+
+int zcache_enabled(void) {
+    return s_queue_fds[1] != -1;
+}
+
+/**
+ * 会话进程只发送请求，不能取得其他会话交来的文件描述符
+ */
+void zcache_session_close(void) {
+    if (s_queue_fds[0] != -1) {
+        close(s_queue_fds[0]);
+        s_queue_fds[0] = -1;
+    }
+}
+
+/**
+ * 请求压缩进程在后台为 fd 对应的文件建立缓存，不等待结果
+ * 同一个文件的重复请求由压缩进程跳过
+ */
+void zcache_request(int fd) {
+    // 请求只有一个描述符，沿用内部通信的消息格式
+    priv_sock_send(s_queue_fds[1], 0, 0, NULL, 0, fd);
+}
+
+/**
+ * 在 nobody 进程中打开源文件 srcfd 的压缩缓存
+ * 成功返回缓存文件的描述符，并输出压缩数据在其中的偏移与长度；没有有效的缓存时返回 -1
+ */
+int zcache_open(int srcfd, long long *offset, long long *len) {
+    struct stat st;
+    if (tunable_deflate_cache_dir == NULL || fstat(srcfd, &st) < 0 || ! S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    char path[PATH_MAX];
+    zcache_path(path, &st);
+    int fd = zcache_check(path, &st, len);
+    if (fd == -1) {
+        return -1;
+    }
+    // 命中时更新 mtime，淘汰时按它判断最近是否被使用过
+    futimens(fd, NULL);
+    *offset = sizeof(zcache_header_t);
+    return fd;
+}
+
+static void zcache_start_worker(void) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        ERR_EXIT("fork");
+    }
+    if (pid > 0) {
+        s_worker = pid;
+        return;
+    }
+
+    // 主进程退出时随之退出
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent) {
+        exit(EXIT_SUCCESS);
+    }
+    close(s_queue_fds[1]);
+
+    // 压缩进程只需要读会话传来的文件和写缓存目录，以较低的优先级运行，不与传输争用 CPU
+    uid_t uid;
+    gid_t gid;
+    if (get_nobody(&uid, &gid) == 0) {
+        if (setgid(gid) < 0) {
+            ERR_EXIT("setgid");
+        }
+        if (setuid(uid) < 0) {
+            ERR_EXIT("setuid");
+        }
+    }
+    setpriority(PRIO_PROCESS, 0, 10);
+
+    zcache_worker();
+    exit(EXIT_SUCCESS);
+}
+
+static void zcache_worker(void) {
+    // 缓存只压缩一次，使用最高的压缩级别
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit(&z, Z_BEST_COMPRESSION) != Z_OK) {
+        ERR_EXIT("deflateInit");
+    }
+    char *in = (char *)malloc(ZCACHE_BUF_SIZE);
+    char *out = (char *)malloc(ZCACHE_BUF_SIZE);
+    if (in == NULL || out == NULL) {
+        ERR_EXIT("malloc");
+    }
+
+    while (1) {
+        priv_msg_t msg;
+        if (priv_sock_try_recv(s_queue_fds[0], &msg) < 0) {
+            continue;
+        }
+        if (msg.fd != -1) {
+            zcache_build(msg.fd, &z, in, out);
+            close(msg.fd);
+        }
+    }
+}
+
+// 压缩 srcfd 写入缓存，先写临时文件，完整写完且源文件在此期间没有变化时才改名
+static void zcache_build(int srcfd, z_stream *z, char *in, char *out) {
+    struct stat st;
+    if (fstat(srcfd, &st) < 0 || ! S_ISREG(st.st_mode)
+        || st.st_size < (off_t)tunable_deflate_cache_min_size) {
+        return;
+    }
+    char path[PATH_MAX];
+    zcache_path(path, &st);
+    long long zlen;
+    int fd = zcache_check(path, &st, &zlen);
+    if (fd != -1) {
+        close(fd);
+        return;
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/.tmp", tunable_deflate_cache_dir);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return;
+    }
+
+    zcache_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ZCACHE_MAGIC, sizeof(hdr.magic));
+    hdr.size = st.st_size;
+    hdr.mtime_ns = zcache_time_ns(&st.st_mtim);
+    hdr.ctime_ns = zcache_time_ns(&st.st_ctim);
+
+    deflateReset(z);
+    off_t pos = 0;
+    off_t wpos = sizeof(hdr);
+    int ok = 1;
+    int flush = Z_NO_FLUSH;
+    while (ok && flush != Z_FINISH) {
+        ssize_t n = pread(srcfd, in, ZCACHE_BUF_SIZE, pos);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            ok = 0;
+            break;
+        }
+        pos += n;
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        z->next_in = (Bytef *)in;
+        z->avail_in = n;
+        do {
+            z->next_out = (Bytef *)out;
+            z->avail_out = ZCACHE_BUF_SIZE;
+            deflate(z, flush);
+            ssize_t have = ZCACHE_BUF_SIZE - z->avail_out;
+            if (pwrite(fd, out, have, wpos) != have) {
+                ok = 0;
+                break;
+            }
+            wpos += have;
+        } while (z->avail_out == 0);
+    }
+
+    // 压缩期间源文件被修改时丢弃结果
+    struct stat now;
+    if (ok && fstat(srcfd, &now) == 0 && now.st_size == st.st_size && pos == st.st_size
+        && zcache_time_ns(&now.st_mtim) == hdr.mtime_ns
+        && zcache_time_ns(&now.st_ctim) == hdr.ctime_ns) {
+        hdr.zlen = wpos - sizeof(hdr);
+        ok = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+    } else {
+        ok = 0;
+    }
+    close(fd);
+    if ( ! ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return;
+    }
+    zcache_evict();
+}
+
+static void zcache_path(char *path, const struct stat *st) {
+    snprintf(path, PATH_MAX, "%s/%llx-%llx", tunable_deflate_cache_dir,
+        (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+}
+
+// 打开缓存文件并检查它是否与源文件的当前状态一致，一致时返回描述符
+static int zcache_check(const char *path, const struct stat *st, long long *zlen) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    zcache_header_t hdr;
+    struct stat cst;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(fd, &cst) < 0
+        || memcmp(hdr.magic, ZCACHE_MAGIC, sizeof(hdr.magic)) != 0
+        || hdr.size != st->st_size
+        || hdr.mtime_ns != zcache_time_ns(&st->st_mtim)
+        || hdr.ctime_ns != zcache_time_ns(&st->st_ctim)
+        || cst.st_size != (off_t)(sizeof(hdr) + hdr.zlen)) {
+        close(fd);
+        return -1;
+    }
+    *zlen = hdr.zlen;
+    return fd;
+}
+
+// 缓存的总大小超过 deflate_cache_size 时，删除最久没有被使用的文件
+static void zcache_evict(void) {
+    if (tunable_deflate_cache_size == 0) {
+        return;
+    }
+    DIR *dir = opendir(tunable_deflate_cache_dir);
+    if (dir == NULL) {
+        return;
+    }
+    zcache_file_t *files = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    long long total = 0;
+    struct dirent *dt;
+    while ((dt = readdir(dir)) != NULL) {
+        struct stat st;
+        if (dt->d_name[0] == '.' || strlen(dt->d_name) >= ZCACHE_NAME_MAX
+            || fstatat(dirfd(dir), dt->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0
+            || ! S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            zcache_file_t *p = (zcache_file_t *)realloc(files, capacity * sizeof(zcache_file_t));
+            if (p == NULL) {
+                break;
+            }
+            files = p;
+        }
+        strcpy(files[count].name, dt->d_name);
+        files[count].mtime_ns = zcache_time_ns(&st.st_mtim);
+        files[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+
+    if (total > (long long)tunable_deflate_cache_size) {
+        qsort(files, count, sizeof(zcache_file_t), zcache_file_cmp);
+        size_t i;
+        for (i = 0; i < count && total > (long long)tunable_deflate_cache_size; i++) {
+            if (unlinkat(dirfd(dir), files[i].name, 0) == 0) {
+                total -= files[i].size;
+            }
+        }
+    }
+    closedir(dir);
+    free(files);
+}
+
+static int zcache_file_cmp(const void *a, const void *b) {
+    long long ta = ((const zcache_file_t *)a)->mtime_ns;
+    long long tb = ((const zcache_file_t *)b)->mtime_ns;
+    return ta < tb ? -1 : ta > tb;
+}
+
+static long long zcache_time_ns(const struct timespec *ts) {
+    return (long long)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
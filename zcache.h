@@ -0,0 +1,21 @@
+#ifndef _Z_CACHE_H_
+#define _Z_CACHE_H_
+
+#include <sys/types.h>
+
+// MODE Z 的压缩缓存
+// 配置了 deflate_cache_dir 时，主进程创建一个以 nobody 身份运行的压缩进程，
+// 会话以 MODE Z 下载较大的文件而缓存中没有时，把已打开的文件描述符交给它，
+// 由它在后台以最高压缩级别压缩一次，写入缓存目录，以源文件的 (dev, ino) 命名
+// 缓存文件头部记录源文件的大小、mtime 与 ctime，源文件被修改后缓存自动失效
+// 缓存目录只有 nobody 可以访问，会话通过 nobody 进程打开缓存文件，
+// nobody 进程根据会话传来的源文件描述符定位缓存，会话只能取得自己能读的文件的缓存
+
+void zcache_init(void);
+int zcache_reap(pid_t pid);
+int zcache_enabled(void);
+void zcache_session_close(void);
+void zcache_request(int fd);
+int zcache_open(int srcfd, long long *offset, long long *len);
+
+#endif /* _Z_CACHE_H_ */